@@ -0,0 +1,156 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "hash.h"
+
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(size) (((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	char *data;
+};
+
+struct arena {
+	struct arena_chunk *chunk;
+	struct hash_table *interned;
+};
+
+static struct arena_chunk *arena_chunk_new(size_t size);
+
+struct arena *arena_new()
+{
+	struct arena *arena = malloc(sizeof(struct arena));
+
+	if (!arena)
+		err(EXIT_FAILURE, NULL);
+
+	arena->chunk = NULL;
+	arena->interned = NULL;
+
+	return arena;
+}
+
+/*
+ * Release every allocation made from the arena at once.
+ */
+void arena_free(struct arena *arena)
+{
+	if (!arena)
+		return;
+
+	struct arena_chunk *chunk = arena->chunk;
+
+	while (chunk) {
+		struct arena_chunk *next = chunk->next;
+
+		free(chunk);
+
+		chunk = next;
+	}
+
+	hash_table_free(arena->interned);
+
+	free(arena);
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	size = ARENA_ALIGN(size);
+
+	if (arena->chunk && arena->chunk->size - arena->chunk->used >= size) {
+		void *ptr = arena->chunk->data + arena->chunk->used;
+
+		arena->chunk->used += size;
+
+		return ptr;
+	}
+
+	/*
+	 * Large allocations get a chunk of their own behind the current one,
+	 * so the space left in the current chunk is not wasted.
+	 */
+	if (arena->chunk && size > ARENA_CHUNK_SIZE / 4) {
+		struct arena_chunk *chunk = arena_chunk_new(size);
+
+		chunk->used = size;
+		chunk->next = arena->chunk->next;
+		arena->chunk->next = chunk;
+
+		return chunk->data;
+	}
+
+	struct arena_chunk *chunk = arena_chunk_new(size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+
+	chunk->used = size;
+	chunk->next = arena->chunk;
+	arena->chunk = chunk;
+
+	return chunk->data;
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+	size_t size = strlen(str) + 1;
+	char *dup = arena_alloc(arena, size);
+
+	memcpy(dup, str, size);
+
+	return dup;
+}
+
+/*
+ * Like arena_strdup, but equal strings share a single copy. Meant for values
+ * repeated across many devices, such as manufacturers or filesystem types.
+ */
+char *arena_intern(struct arena *arena, const char *str)
+{
+	size_t size = strlen(str) + 1;
+
+	if (!arena->interned)
+		arena->interned = hash_table_new(0);
+
+	char *interned = hash_table_get(arena->interned, str, size);
+
+	if (interned)
+		return interned;
+
+	interned = arena_strdup(arena, str);
+
+	hash_table_put(arena->interned, interned, size, interned);
+
+	return interned;
+}
+
+/*
+ * The number of bytes allocated from the arena so far.
+ */
+size_t arena_size(struct arena *arena)
+{
+	size_t size = 0;
+
+	for (struct arena_chunk *chunk = arena->chunk; chunk; chunk = chunk->next)
+		size += chunk->used;
+
+	return size;
+}
+
+static struct arena_chunk *arena_chunk_new(size_t size)
+{
+	struct arena_chunk *chunk = malloc(ARENA_ALIGN(sizeof(struct arena_chunk)) + size);
+
+	if (!chunk)
+		err(EXIT_FAILURE, NULL);
+
+	chunk->data = (char *)chunk + ARENA_ALIGN(sizeof(struct arena_chunk));
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+
+	return chunk;
+}
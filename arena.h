@@ -0,0 +1,15 @@
+#ifndef _SALLYMOUNT_ARENA_H
+#define _SALLYMOUNT_ARENA_H
+
+#include <stddef.h>
+
+struct arena;
+
+struct arena *arena_new();
+void arena_free(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+char *arena_intern(struct arena *arena, const char *str);
+size_t arena_size(struct arena *arena);
+
+#endif
@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "usb.h"
+#include "timing.h"
+
+/*
+ * Benchmark of enumeration, lookup and rendering over synthetic device
+ * fixtures, built by make bench. Allocations are counted by timing.c, which
+ * sees those sallymount makes through malloc, calloc, realloc, strdup,
+ * strndup and asprintf.
+ */
+
+static const size_t BENCH_SIZES[] = {10, 100, 1000, 10000};
+static const size_t BENCH_PARTITIONS = 3;
+static const size_t BENCH_WORK = 100000;
+
+int main(int argc, char **argv)
+{
+	size_t num_partitions = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_PARTITIONS;
+
+	timing_count_allocations();
+
+	printf("%7s %10s  %-10s %12s %10s\n", "DEVICES", "PARTITIONS", "PHASE", "MS", "ALLOCS");
+
+	for (size_t i = 0; i < sizeof(BENCH_SIZES) / sizeof(BENCH_SIZES[0]); i++) {
+		size_t rounds = BENCH_WORK / BENCH_SIZES[i];
+
+		usb_bench(stdout, BENCH_SIZES[i], num_partitions, rounds ? rounds : 1, timing_allocations);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "check.h"
+
+#define CHECK_EXT_MAGIC 0xef53
+#define CHECK_EXT_VALID_FS 0x0001
+#define CHECK_EXT_ERROR_FS 0x0002
+#define CHECK_EXT_INCOMPAT_RECOVER 0x0004
+#define CHECK_FAT_DIRTY 0x01
+#define CHECK_EXFAT_DIRTY 0x0002
+#define CHECK_EXFAT_MEDIA_FAILURE 0x0004
+
+extern char **environ;
+
+/*
+ * Checkers and the options to repair without asking, per filesystem type.
+ */
+static const struct check_checker {
+	const char *type;
+	const char *program;
+	const char *repair;
+} CHECKERS[] = {
+	{"ext2", "fsck.ext2", "-p"},
+	{"ext3", "fsck.ext3", "-p"},
+	{"ext4", "fsck.ext4", "-p"},
+	{"vfat", "fsck.vfat", "-a"},
+	{"exfat", "fsck.exfat", "-p"}
+};
+
+static const struct check_checker *check_checker_find(const char *type);
+static int check_read(int fd, unsigned char *buffer, size_t size, off_t offset);
+static uint16_t check_le16(const unsigned char *bytes);
+static uint32_t check_le32(const unsigned char *bytes);
+
+/*
+ * Whether the filesystem on node is marked as needing a check: an ext
+ * filesystem not cleanly unmounted, with errors or with a journal to
+ * replay, or a FAT or exFAT volume with its dirty bit set. Only the
+ * superblock or boot sector is read. Filesystems of other types, or that
+ * cannot be read, are never reported as needing one.
+ */
+int check_needed(const char *node, const char *type)
+{
+	unsigned char buffer[1024];
+	int needed = 0;
+	int fd = -1;
+
+	if (!check_checker_find(type))
+		return 0;
+
+	if ((fd = open(node, O_RDONLY | O_CLOEXEC)) == -1) {
+		errno = 0;
+
+		return 0;
+	}
+
+	if (strncmp(type, "ext", 3) == 0) {
+		if (!check_read(fd, buffer, 1024, 1024) && check_le16(buffer + 0x38) == CHECK_EXT_MAGIC) {
+			uint16_t state = check_le16(buffer + 0x3a);
+
+			needed = !(state & CHECK_EXT_VALID_FS) ||
+			         (state & CHECK_EXT_ERROR_FS) ||
+			         (check_le32(buffer + 0x60) & CHECK_EXT_INCOMPAT_RECOVER);
+		}
+	} else if (!check_read(fd, buffer, 512, 0) && buffer[510] == 0x55 && buffer[511] == 0xaa) {
+		if (strcmp(type, "exfat") == 0)
+			needed = memcmp(buffer + 3, "EXFAT   ", 8) == 0 &&
+			         (check_le16(buffer + 106) & (CHECK_EXFAT_DIRTY | CHECK_EXFAT_MEDIA_FAILURE));
+
+		/*
+		 * FAT32 has no 16-bit FAT size, and its state byte after its
+		 * longer BPB.
+		 */
+		else
+			needed = buffer[check_le16(buffer + 22) ? 37 : 65] & CHECK_FAT_DIRTY;
+	}
+
+	close(fd);
+
+	errno = 0;
+
+	return needed;
+}
+
+/*
+ * Run the checker for type on node, repairing what it safely can. Returns
+ * its exit status, of which 0 and 1 mean the filesystem is now clean, or -1
+ * if it could not be run.
+ */
+int check_run(const char *node, const char *type)
+{
+	const struct check_checker *checker = check_checker_find(type);
+	posix_spawn_file_actions_t actions;
+	pid_t pid = 0;
+	int status = 0;
+	int retcode = 0;
+
+	if (!checker) {
+		errno = ENOTSUP;
+
+		return -1;
+	}
+
+	char *argv[] = {(char *)checker->program, (char *)checker->repair, (char *)node, NULL};
+
+	/*
+	 * Checks run concurrently, so their progress output is discarded to
+	 * keep it from interleaving. Errors still go to stderr.
+	 */
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+	retcode = posix_spawnp(&pid, checker->program, &actions, NULL, argv, environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (retcode) {
+		errno = retcode;
+
+		return -1;
+	}
+
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR)
+			return -1;
+	}
+
+	if (!WIFEXITED(status)) {
+		errno = EINTR;
+
+		return -1;
+	}
+
+	return WEXITSTATUS(status);
+}
+
+static const struct check_checker *check_checker_find(const char *type)
+{
+	for (size_t i = 0; i < sizeof(CHECKERS) / sizeof(CHECKERS[0]); i++) {
+		if (strcmp(type, CHECKERS[i].type) == 0)
+			return &CHECKERS[i];
+	}
+
+	return NULL;
+}
+
+static int check_read(int fd, unsigned char *buffer, size_t size, off_t offset)
+{
+	return pread(fd, buffer, size, offset) == (ssize_t)size ? 0 : -1;
+}
+
+static uint16_t check_le16(const unsigned char *bytes)
+{
+	return bytes[0] | bytes[1] << 8;
+}
+
+static uint32_t check_le32(const unsigned char *bytes)
+{
+	return check_le16(bytes) | (uint32_t)check_le16(bytes + 2) << 16;
+}
@@ -0,0 +1,7 @@
+#ifndef _SALLYMOUNT_CHECK_H
+#define _SALLYMOUNT_CHECK_H
+
+int check_needed(const char *node, const char *type);
+int check_run(const char *node, const char *type);
+
+#endif
@@ -1,9 +1,15 @@
+#include <stdlib.h>
 #include <string.h>
 #include <argp.h>
 
 #include "cli.h"
 #include "mount.h"
 #include "umount.h"
+#include "watch.h"
+#include "devbench.h"
+#include "usb.h"
+#include "timing.h"
+#include "metrics.h"
 
 const char *argp_program_version = "1.0 - \"Sleep deprecation\"";
 const char *argp_program_bug_address = "simon@simonallen.org";
@@ -14,9 +20,23 @@ static const char cli_doc[] =
 	"\v"
 	"Supported commands are:\n"
 	"  mount    Mount USB mass storage devices\n"
-	"  umount   Unmount USB mass storage devices";
+	"  umount   Unmount USB mass storage devices\n"
+	"  watch    Watch for USB mass storage devices and mount them\n"
+	"  bench    Measure the throughput of USB mass storage devices\n"
+	"\n"
+	"USB-PATH is a device or partition node (e.g., /dev/sdb1), a USB device path\n"
+	"(e.g., 1.2 or 1.2-1), or one of LABEL=label, UUID=uuid or SERIAL=serial.\n"
+	"\n"
+	CLI_WHERE_DOC;
+
+enum {
+	CLI_OPTION_OUTPUT = 0x100,
+	CLI_OPTION_SOURCE,
+	CLI_OPTION_TIMINGS,
+	CLI_OPTION_METRICS
+};
 
-static const char cli_args_doc[] = "[COMMAND [OPTION...]...]";
+static const char cli_args_doc[] = "[USB-PATH...]\nCOMMAND [OPTION...]...";
 
 static struct argp_option cli_options[] = {
 	{
@@ -47,6 +67,60 @@ static struct argp_option cli_options[] = {
 		0,
 		"Print sizes in powers of 1000 (e.g., 1.1G)"
 	},
+	{
+		"cache",
+		'c',
+		"FILE",
+		OPTION_ARG_OPTIONAL,
+		"Print from the inventory cache in FILE while no device events have happened "
+		"since it was written (default " USB_CACHE_PATH ")"
+	},
+	{
+		"output",
+		CLI_OPTION_OUTPUT,
+		"FORMAT",
+		0,
+		"Print in FORMAT, one of text (default), json, ndjson or csv"
+	},
+	{
+		"columns",
+		'o',
+		"LIST",
+		0,
+		"Print only the comma separated columns in LIST (e.g., NODE,SIZE,MOUNTED)"
+	},
+	{
+		"where",
+		'w',
+		"FILTER",
+		0,
+		"Print only devices and partitions matching FILTER"
+	},
+	{
+		"timings",
+		CLI_OPTION_TIMINGS,
+		"FILE",
+		OPTION_ARG_OPTIONAL,
+		"Print how long each phase and device operation took, and how many library "
+		"calls and allocations were made, to standard error; with FILE, also write "
+		"them there as a Chrome trace"
+	},
+	{
+		"metrics",
+		CLI_OPTION_METRICS,
+		"FILE",
+		0,
+		"Write device counts and mount and unmount latencies and failures to FILE "
+		"for the Prometheus node exporter's textfile collector once done"
+	},
+	{
+		"source",
+		CLI_OPTION_SOURCE,
+		"SOURCE",
+		OPTION_HIDDEN,
+		"Enumerate devices from SOURCE, sysfs (default), sysfs:ROOT for a tree under "
+		"ROOT, udev or fixture:NxM for N synthetic devices with M partitions each"
+	},
 	{NULL}
 };
 
@@ -83,6 +157,60 @@ error_t cli_parse_opt(int key, char *arg, struct argp_state *state) {
 
 			break;
 
+		case 'c':
+			cli_args->cache_path = arg ? arg : USB_CACHE_PATH;
+
+			break;
+
+		case CLI_OPTION_OUTPUT:
+			if (strcmp(arg, "text") == 0)
+				cli_args->output = USB_OUTPUT_TEXT;
+
+			else if (strcmp(arg, "json") == 0)
+				cli_args->output = USB_OUTPUT_JSON;
+
+			else if (strcmp(arg, "ndjson") == 0)
+				cli_args->output = USB_OUTPUT_NDJSON;
+
+			else if (strcmp(arg, "csv") == 0)
+				cli_args->output = USB_OUTPUT_CSV;
+
+			else
+				argp_error(state, "invalid output format: %s", arg);
+
+			break;
+
+		case 'o':
+			if (!usb_columns_valid(arg))
+				argp_error(state, "invalid column list: %s", arg);
+
+			cli_args->columns = arg;
+
+			break;
+
+		case 'w':
+			usb_filter_free(cli_args->where);
+
+			cli_args->where = cli_parse_where(arg, state);
+
+			break;
+
+		case CLI_OPTION_TIMINGS:
+			timing_enable(arg);
+
+			break;
+
+		case CLI_OPTION_METRICS:
+			metrics_enable(arg);
+
+			break;
+
+		case CLI_OPTION_SOURCE:
+			if (usb_source_set(arg))
+				argp_error(state, "invalid device source: %s", arg);
+
+			break;
+
 		case ARGP_KEY_ARG:
 			if (strcmp(arg, "mount") == 0) {
 				cli_args->command = arg;
@@ -92,6 +220,14 @@ error_t cli_parse_opt(int key, char *arg, struct argp_state *state) {
 				cli_args->command = arg;
 
 				cmd_umount(state);
+			} else if (strcmp(arg, "watch") == 0) {
+				cli_args->command = arg;
+
+				cmd_watch(state);
+			} else if (strcmp(arg, "bench") == 0) {
+				cli_args->command = arg;
+
+				cmd_bench(state);
 			} else {
 				for (int i = 0; i < state->argc; i++) {
 					if (!cli_args->usb_paths[i]) {
@@ -108,3 +244,24 @@ error_t cli_parse_opt(int key, char *arg, struct argp_state *state) {
 
 	return 0;
 }
+
+size_t cli_parse_jobs(char *arg, struct argp_state *state)
+{
+	char *end = NULL;
+	long jobs = strtol(arg, &end, 10);
+
+	if (*arg == '\0' || *end != '\0' || jobs < 1)
+		argp_error(state, "invalid number of jobs: %s", arg);
+
+	return jobs;
+}
+
+struct usb_filter *cli_parse_where(char *arg, struct argp_state *state)
+{
+	struct usb_filter *filter = usb_filter_new(arg);
+
+	if (!filter)
+		argp_error(state, "invalid filter: %s", arg);
+
+	return filter;
+}
@@ -1,6 +1,16 @@
 #ifndef _SALLYMOUNT_CLI_H
 #define _SALLYMOUNT_CLI_H
 
+#define CLI_WHERE_DOC \
+	"FILTER is a comma separated list of FIELD OP VALUE terms, all of which must\n" \
+	"hold (e.g., type=exfat,bus=3,size>64G). FIELD is one of bus, dev_path,\n" \
+	"serial, manufacturer or product, tested on devices, or size, type, label,\n" \
+	"uuid or mounted, tested on partitions. OP is one of =, !=, <, <=, > or >=.\n" \
+	"Text values are shell patterns (e.g., dev_path=1.2*) compared with = and !=,\n" \
+	"sizes take a K, M, G or T suffix, and mounted is yes or no."
+
+struct usb_filter;
+
 error_t argp_err_exit_status;
 const char *argp_program_version;
 const char *argp_program_bug_address;
@@ -9,12 +19,18 @@ struct cli_args {
 	int verbose;
 	int all;
 	int human_readable;
+	int output;
+	char *columns;
+	struct usb_filter *where;
+	char *cache_path;
 	char *command;
 	char **usb_paths;
 	size_t num_usb_paths;
 };
 
 error_t cli_parse_opt(int key, char *arg, struct argp_state *state);
+size_t cli_parse_jobs(char *arg, struct argp_state *state);
+struct usb_filter *cli_parse_where(char *arg, struct argp_state *state);
 
 struct argp cli_argp;
 
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+
+#include "cli.h"
+#include "devbench.h"
+#include "usb.h"
+
+#define CLI_BENCH_DEFAULT_SIZE (64 * 1024 * 1024)
+#define CLI_BENCH_DEFAULT_QUEUE_DEPTH 8
+#define CLI_BENCH_MAX_QUEUE_DEPTH 256
+
+static const char cli_doc_bench[] =
+	"\n"
+	"Measure the throughput of USB mass storage devices."
+	"\v"
+	"Each device is read sequentially, then in 4K blocks at random for a few\n"
+	"seconds, all devices at once, bypassing the page cache. READ and WRITE are\n"
+	"in MB/s, and RANDOM_READ in 4K reads per second.\n"
+	"\n"
+	"USB-PATH is a device or partition node (e.g., /dev/sdb1), a USB device path\n"
+	"(e.g., 1.2 or 1.2-1), or one of LABEL=label, UUID=uuid or SERIAL=serial.\n"
+	"\n"
+	CLI_WHERE_DOC;
+
+static const char cli_args_doc_bench[] = "[USB-PATH...]";
+
+static struct argp_option cli_options_bench[] = {
+	{
+		"all",
+		'a',
+		0,
+		0,
+		"Measure all USB devices"
+	},
+	{
+		"write",
+		'W',
+		0,
+		0,
+		"Also write a scratch file, removed afterwards, in the first mounted "
+		"partition of each device"
+	},
+	{
+		"size",
+		's',
+		"SIZE",
+		0,
+		"Read and write up to SIZE bytes sequentially, with a K, M or G suffix "
+		"(default 64M)"
+	},
+	{
+		"queue-depth",
+		'q',
+		"N",
+		0,
+		"Keep up to N requests, at most 256, in flight on each device (default 8)"
+	},
+	{
+		"where",
+		'w',
+		"FILTER",
+		0,
+		"Measure only devices matching FILTER, all of them if no USB-PATH is given"
+	},
+	{NULL}
+};
+
+static struct argp cli_argp_bench = {
+	cli_options_bench,
+	cli_parse_bench,
+	cli_args_doc_bench,
+	cli_doc_bench
+};
+
+error_t cli_parse_bench(int key, char *arg, struct argp_state *state)
+{
+	struct cli_args_bench *cli_args_bench = state->input;
+	char *end = NULL;
+	unsigned long long number = 0;
+
+	switch(key)
+	{
+		case 'a':
+			cli_args_bench->all = 1;
+
+			break;
+
+		case 'W':
+			cli_args_bench->write = 1;
+
+			break;
+
+		case 's':
+			number = strtoull(arg, &end, 10);
+
+			switch (*end) {
+				case 'G':
+					number *= 1024;
+					/* fall through */
+				case 'M':
+					number *= 1024;
+					/* fall through */
+				case 'K':
+					number *= 1024;
+					end++;
+			}
+
+			if (*arg == '\0' || *end != '\0' || number == 0)
+				argp_error(state, "invalid size: %s", arg);
+
+			cli_args_bench->size = number;
+
+			break;
+
+		case 'q':
+			number = strtoull(arg, &end, 10);
+
+			if (*arg == '\0' || *end != '\0' || number < 1 || number > CLI_BENCH_MAX_QUEUE_DEPTH)
+				argp_error(state, "invalid queue depth: %s", arg);
+
+			cli_args_bench->queue_depth = number;
+
+			break;
+
+		case 'w':
+			usb_filter_free(cli_args_bench->cli_args->where);
+
+			cli_args_bench->cli_args->where = cli_parse_where(arg, state);
+
+			break;
+
+		case ARGP_KEY_ARG:
+			for (int i = 0; i < state->argc; i++) {
+				if (!cli_args_bench->usb_paths[i]) {
+					cli_args_bench->usb_paths[i] = arg;
+					cli_args_bench->num_usb_paths++;
+
+					break;
+				}
+			}
+
+			break;
+	}
+
+	return 0;
+}
+
+void cmd_bench(struct argp_state *state)
+{
+	struct cli_args_bench cli_args_bench = {0};
+	int argc = state->argc - state->next + 1;
+	char **argv = &state->argv[state->next - 1];
+	char *argv0 = argv[0];
+
+	cli_args_bench.cli_args = state->input;
+	cli_args_bench.usb_paths = calloc(sizeof(char *), argc);
+	cli_args_bench.size = CLI_BENCH_DEFAULT_SIZE;
+	cli_args_bench.queue_depth = CLI_BENCH_DEFAULT_QUEUE_DEPTH;
+
+	argv[0] = malloc(strlen(state->name) + strlen("bench") + 2);
+
+	if(!argv[0])
+		argp_failure(state, 1, ENOMEM, 0);
+
+	sprintf(argv[0], "%s bench", state->name);
+
+	argp_parse(&cli_argp_bench, argc, argv, ARGP_IN_ORDER, &argc, &cli_args_bench);
+
+	free(argv[0]);
+
+	argv[0] = argv0;
+
+	state->next += argc - 1;
+
+	if (cli_args_bench.all || (cli_args_bench.cli_args->where && !cli_args_bench.num_usb_paths)) {
+		usb_throughput(NULL,
+		               0,
+		               cli_args_bench.cli_args->where,
+		               cli_args_bench.cli_args->human_readable,
+		               cli_args_bench.write,
+		               cli_args_bench.size,
+		               cli_args_bench.queue_depth);
+	} else {
+		usb_throughput(cli_args_bench.usb_paths,
+		               cli_args_bench.num_usb_paths,
+		               cli_args_bench.cli_args->where,
+		               cli_args_bench.cli_args->human_readable,
+		               cli_args_bench.write,
+		               cli_args_bench.size,
+		               cli_args_bench.queue_depth);
+	}
+
+	free(cli_args_bench.usb_paths);
+
+	return;
+}
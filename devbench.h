@@ -0,0 +1,18 @@
+#ifndef _SALLYMOUNT_DEVBENCH_H
+#define _SALLYMOUNT_DEVBENCH_H
+
+struct cli_args_bench
+{
+	struct cli_args *cli_args;
+	int all;
+	char **usb_paths;
+	size_t num_usb_paths;
+	int write;
+	size_t size;
+	unsigned int queue_depth;
+};
+
+error_t cli_parse_bench(int key, char *arg, struct argp_state *state);
+void cmd_bench(struct argp_state *state);
+
+#endif
@@ -0,0 +1,207 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+struct hash_entry {
+	void *key;
+	size_t key_size;
+	uint64_t hash;
+	void *value;
+	struct hash_entry *next;
+};
+
+struct hash_table {
+	struct hash_entry **buckets;
+	size_t num_buckets;
+	size_t num_entries;
+};
+
+static void hash_table_grow(struct hash_table *table);
+static struct hash_entry **hash_table_find(struct hash_table *table,
+                                           const void *key,
+                                           size_t key_size,
+                                           uint64_t hash);
+
+struct hash_table *hash_table_new(size_t size_hint)
+{
+	struct hash_table *table = malloc(sizeof(struct hash_table));
+
+	if (!table)
+		err(EXIT_FAILURE, NULL);
+
+	table->num_buckets = 16;
+
+	while (table->num_buckets < size_hint)
+		table->num_buckets *= 2;
+
+	table->num_entries = 0;
+	table->buckets = calloc(table->num_buckets, sizeof(struct hash_entry *));
+
+	if (!table->buckets)
+		err(EXIT_FAILURE, NULL);
+
+	return table;
+}
+
+void hash_table_free(struct hash_table *table)
+{
+	if (!table)
+		return;
+
+	for (size_t i = 0; i < table->num_buckets; i++) {
+		struct hash_entry *entry = table->buckets[i];
+
+		while (entry) {
+			struct hash_entry *next = entry->next;
+
+			free(entry->key);
+			free(entry);
+
+			entry = next;
+		}
+	}
+
+	free(table->buckets);
+	free(table);
+}
+
+/*
+ * Insert or replace the value stored under key. The key is copied, the value
+ * is not owned by the table.
+ */
+void hash_table_put(struct hash_table *table, const void *key, size_t key_size, void *value)
+{
+	uint64_t hash = hash_bytes(key, key_size);
+	struct hash_entry **slot = hash_table_find(table, key, key_size, hash);
+
+	if (*slot) {
+		(*slot)->value = value;
+
+		return;
+	}
+
+	struct hash_entry *entry = malloc(sizeof(struct hash_entry));
+
+	if (!entry)
+		err(EXIT_FAILURE, NULL);
+
+	entry->key = malloc(key_size ? key_size : 1);
+
+	if (!entry->key)
+		err(EXIT_FAILURE, NULL);
+
+	memcpy(entry->key, key, key_size);
+
+	entry->key_size = key_size;
+	entry->hash = hash;
+	entry->value = value;
+	entry->next = table->buckets[hash & (table->num_buckets - 1)];
+
+	table->buckets[hash & (table->num_buckets - 1)] = entry;
+	table->num_entries++;
+
+	if (table->num_entries > table->num_buckets)
+		hash_table_grow(table);
+}
+
+void *hash_table_get(struct hash_table *table, const void *key, size_t key_size)
+{
+	struct hash_entry *entry = *hash_table_find(table, key, key_size, hash_bytes(key, key_size));
+
+	if (!entry)
+		return NULL;
+
+	return entry->value;
+}
+
+/*
+ * Remove key from the table, returning the value that was stored under it.
+ */
+void *hash_table_remove(struct hash_table *table, const void *key, size_t key_size)
+{
+	struct hash_entry **slot = hash_table_find(table, key, key_size, hash_bytes(key, key_size));
+	struct hash_entry *entry = *slot;
+
+	if (!entry)
+		return NULL;
+
+	void *value = entry->value;
+	*slot = entry->next;
+
+	free(entry->key);
+	free(entry);
+
+	table->num_entries--;
+
+	return value;
+}
+
+size_t hash_table_size(struct hash_table *table)
+{
+	return table->num_entries;
+}
+
+/*
+ * 64-bit FNV-1a.
+ */
+uint64_t hash_bytes(const void *key, size_t key_size)
+{
+	const unsigned char *bytes = key;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < key_size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static struct hash_entry **hash_table_find(struct hash_table *table,
+                                           const void *key,
+                                           size_t key_size,
+                                           uint64_t hash)
+{
+	struct hash_entry **slot = &table->buckets[hash & (table->num_buckets - 1)];
+
+	while (*slot) {
+		if ((*slot)->hash == hash &&
+		    (*slot)->key_size == key_size &&
+		    memcmp((*slot)->key, key, key_size) == 0)
+			break;
+
+		slot = &(*slot)->next;
+	}
+
+	return slot;
+}
+
+static void hash_table_grow(struct hash_table *table)
+{
+	size_t num_buckets = table->num_buckets * 2;
+	struct hash_entry **buckets = calloc(num_buckets, sizeof(struct hash_entry *));
+
+	if (!buckets)
+		err(EXIT_FAILURE, NULL);
+
+	for (size_t i = 0; i < table->num_buckets; i++) {
+		struct hash_entry *entry = table->buckets[i];
+
+		while (entry) {
+			struct hash_entry *next = entry->next;
+
+			entry->next = buckets[entry->hash & (num_buckets - 1)];
+			buckets[entry->hash & (num_buckets - 1)] = entry;
+
+			entry = next;
+		}
+	}
+
+	free(table->buckets);
+
+	table->buckets = buckets;
+	table->num_buckets = num_buckets;
+}
@@ -0,0 +1,17 @@
+#ifndef _SALLYMOUNT_HASH_H
+#define _SALLYMOUNT_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct hash_table;
+
+struct hash_table *hash_table_new(size_t size_hint);
+void hash_table_free(struct hash_table *table);
+void hash_table_put(struct hash_table *table, const void *key, size_t key_size, void *value);
+void *hash_table_get(struct hash_table *table, const void *key, size_t key_size);
+void *hash_table_remove(struct hash_table *table, const void *key, size_t key_size);
+size_t hash_table_size(struct hash_table *table);
+uint64_t hash_bytes(const void *key, size_t key_size);
+
+#endif
@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+#include "hash.h"
+
+enum {
+	METRICS_DEVICES,
+	METRICS_PARTITIONS,
+	METRICS_MOUNTED,
+	METRICS_DURATION,
+	METRICS_FAILURES,
+	METRICS_LAST_RUN,
+	METRICS_MAX_FAMILIES
+};
+
+/*
+ * The metric families written, in order. Gauges describe the latest run
+ * only, while counters and histograms carry on from the previous file, so
+ * that they keep counting across runs.
+ */
+static const struct metrics_family {
+	const char *name;
+	const char *type;
+	const char *help;
+} FAMILIES[METRICS_MAX_FAMILIES] = {
+	[METRICS_DEVICES] = {
+		"sallymount_devices",
+		"gauge",
+		"USB mass storage devices by bus and negotiated link speed in Mbit/s."
+	},
+	[METRICS_PARTITIONS] = {
+		"sallymount_partitions",
+		"gauge",
+		"Partitions of USB mass storage devices by bus and link speed."
+	},
+	[METRICS_MOUNTED] = {
+		"sallymount_partitions_mounted",
+		"gauge",
+		"Partitions of USB mass storage devices mounted on their sallymount "
+		"mount directory, by bus and link speed."
+	},
+	[METRICS_DURATION] = {
+		"sallymount_operation_duration_seconds",
+		"histogram",
+		"Time taken to mount or unmount a partition by filesystem type."
+	},
+	[METRICS_FAILURES] = {
+		"sallymount_operation_failures_total",
+		"counter",
+		"Failed mounts and unmounts by filesystem type and errno."
+	},
+	[METRICS_LAST_RUN] = {
+		"sallymount_last_run_timestamp_seconds",
+		"gauge",
+		"When sallymount last wrote these metrics."
+	}
+};
+
+static const double DURATION_BUCKETS[] = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30};
+
+/*
+ * A series, keyed by its name and labels as written, e.g.
+ * sallymount_devices{bus="1",speed="480"}.
+ */
+struct metrics_series {
+	char *key;
+	int family;
+	double value;
+};
+
+static const char *metrics_path = NULL;
+static struct hash_table *series_table = NULL;
+static struct metrics_series **series = NULL;
+static size_t num_series = 0;
+static size_t size_series = 0;
+static pthread_mutex_t series_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void metrics_add(int family, const char *suffix, const char *labels, double value, int set);
+static void metrics_load(void);
+static int metrics_family_of(const char *key);
+static char *metrics_label_value(const char *str);
+static int metrics_series_compare(const void *a, const void *b);
+
+/*
+ * Write metrics to path, in the Prometheus text format, once the run ends.
+ */
+void metrics_enable(const char *path)
+{
+	metrics_path = path;
+	series_table = hash_table_new(0);
+}
+
+int metrics_enabled(void)
+{
+	return metrics_path != NULL;
+}
+
+/*
+ * Count a device on bus at speed, with num_partitions partitions of which
+ * num_mounted are mounted.
+ */
+void metrics_device(int bus, const char *speed, size_t num_partitions, size_t num_mounted)
+{
+	if (!metrics_path)
+		return;
+
+	char *speed_value = metrics_label_value(speed);
+	char *labels = NULL;
+
+	if (asprintf(&labels, "bus=\"%d\",speed=\"%s\"", bus, speed_value) == -1)
+		err(EXIT_FAILURE, NULL);
+
+	metrics_add(METRICS_DEVICES, "", labels, 1, 0);
+	metrics_add(METRICS_PARTITIONS, "", labels, num_partitions, 0);
+	metrics_add(METRICS_MOUNTED, "", labels, num_mounted, 0);
+
+	free(labels);
+	free(speed_value);
+}
+
+/*
+ * Record an operation, mount or umount, on a partition with a filesystem of
+ * type that took seconds, and failed with errnum unless that is 0. Safe to
+ * call from worker threads, and leaves errno alone.
+ */
+void metrics_observe(const char *operation, const char *type, double seconds, int errnum)
+{
+	if (!metrics_path)
+		return;
+
+	int saved_errno = errno;
+	char *type_value = metrics_label_value(type);
+	char *labels = NULL;
+	char *bucket_labels = NULL;
+
+	if (asprintf(&labels, "operation=\"%s\",type=\"%s\"", operation, type_value) == -1)
+		err(EXIT_FAILURE, NULL);
+
+	for (size_t i = 0; i < sizeof(DURATION_BUCKETS) / sizeof(DURATION_BUCKETS[0]); i++) {
+		if (asprintf(&bucket_labels, "%s,le=\"%g\"", labels, DURATION_BUCKETS[i]) == -1)
+			err(EXIT_FAILURE, NULL);
+
+		metrics_add(METRICS_DURATION, "_bucket", bucket_labels, seconds <= DURATION_BUCKETS[i], 0);
+
+		free(bucket_labels);
+	}
+
+	if (asprintf(&bucket_labels, "%s,le=\"+Inf\"", labels) == -1)
+		err(EXIT_FAILURE, NULL);
+
+	metrics_add(METRICS_DURATION, "_bucket", bucket_labels, 1, 0);
+	metrics_add(METRICS_DURATION, "_sum", labels, seconds, 0);
+	metrics_add(METRICS_DURATION, "_count", labels, 1, 0);
+
+	free(bucket_labels);
+
+	if (errnum) {
+		if (asprintf(&bucket_labels, "%s,errno=\"%d\"", labels, errnum) == -1)
+			err(EXIT_FAILURE, NULL);
+
+		metrics_add(METRICS_FAILURES, "", bucket_labels, 1, 0);
+
+		free(bucket_labels);
+	}
+
+	free(labels);
+	free(type_value);
+
+	errno = saved_errno;
+}
+
+/*
+ * Merge in the counters and histograms of the previous file and replace it,
+ * under a temporary name renamed into place so that the collector never
+ * reads a partial file.
+ */
+void metrics_write(void)
+{
+	if (!metrics_path)
+		return;
+
+	char *tmp_path = NULL;
+
+	metrics_add(METRICS_LAST_RUN, "", NULL, time(NULL), 1);
+	metrics_load();
+
+	qsort(series, num_series, sizeof(struct metrics_series *), metrics_series_compare);
+
+	if (asprintf(&tmp_path, "%s.XXXXXX", metrics_path) == -1)
+		err(EXIT_FAILURE, NULL);
+
+	int fd = mkostemp(tmp_path, O_CLOEXEC);
+	FILE *file = fd != -1 ? fdopen(fd, "w") : NULL;
+	int failed = !file || fchmod(fd, 0644);
+	int family = -1;
+
+	for (size_t i = 0; i < num_series && !failed; i++) {
+		if (series[i]->family != family) {
+			family = series[i]->family;
+
+			fprintf(file,
+			        "# HELP %s %s\n# TYPE %s %s\n",
+			        FAMILIES[family].name,
+			        FAMILIES[family].help,
+			        FAMILIES[family].name,
+			        FAMILIES[family].type);
+		}
+
+		failed = fprintf(file, "%s %.17g\n", series[i]->key, series[i]->value) < 0;
+	}
+
+	if (file) {
+		if (fclose(file) || failed || rename(tmp_path, metrics_path)) {
+			warn("Writing metrics to %s failed", metrics_path);
+
+			unlink(tmp_path);
+		}
+	} else {
+		warn("Writing metrics to %s failed", metrics_path);
+
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp_path);
+		}
+	}
+
+	for (size_t i = 0; i < num_series; i++) {
+		free(series[i]->key);
+		free(series[i]);
+	}
+
+	free(series);
+	free(tmp_path);
+
+	hash_table_free(series_table);
+}
+
+/*
+ * Add value to the series of family with suffix and labels, or set it to
+ * value if set is true, creating the series at 0 if need be.
+ */
+static void metrics_add(int family, const char *suffix, const char *labels, double value, int set)
+{
+	char *key = NULL;
+
+	if (asprintf(&key,
+	             "%s%s%s%s%s",
+	             FAMILIES[family].name,
+	             suffix,
+	             labels ? "{" : "",
+	             labels ? labels : "",
+	             labels ? "}" : "") == -1)
+		err(EXIT_FAILURE, NULL);
+
+	pthread_mutex_lock(&series_mutex);
+
+	struct metrics_series *entry = hash_table_get(series_table, key, strlen(key));
+
+	if (!entry) {
+		if (num_series == size_series) {
+			size_series = size_series ? size_series * 2 : 64;
+			series = realloc(series, size_series * sizeof(struct metrics_series *));
+
+			if (!series)
+				err(EXIT_FAILURE, NULL);
+		}
+
+		if (!(entry = malloc(sizeof(struct metrics_series))))
+			err(EXIT_FAILURE, NULL);
+
+		entry->key = key;
+		entry->family = family;
+		entry->value = 0;
+		series[num_series++] = entry;
+
+		hash_table_put(series_table, entry->key, strlen(entry->key), entry);
+	} else {
+		free(key);
+	}
+
+	entry->value = set ? value : entry->value + value;
+
+	pthread_mutex_unlock(&series_mutex);
+}
+
+/*
+ * Add the counters and histograms of the previous file to this run's, which
+ * keeps series of earlier runs that saw no activity in this one.
+ */
+static void metrics_load(void)
+{
+	FILE *file = fopen(metrics_path, "re");
+	char *line = NULL;
+	size_t line_size = 0;
+
+	if (!file)
+		return;
+
+	while (getline(&line, &line_size, file) != -1) {
+		char *value = strrchr(line, ' ');
+		int family = -1;
+
+		if (line[0] == '#' || !value)
+			continue;
+
+		*value++ = '\0';
+
+		if ((family = metrics_family_of(line)) == -1 || strcmp(FAMILIES[family].type, "gauge") == 0)
+			continue;
+
+		/*
+		 * Split the key back into the suffix and labels it was built
+		 * from.
+		 */
+		const char *labels = strchr(line, '{');
+		size_t name_size = labels ? (size_t)(labels - line) : strlen(line);
+		char *suffix = strndup(line + strlen(FAMILIES[family].name),
+		                       name_size - strlen(FAMILIES[family].name));
+		char *label_str = labels ? strndup(labels + 1, strlen(labels) - 2) : NULL;
+
+		if (!suffix || (labels && !label_str))
+			err(EXIT_FAILURE, NULL);
+
+		metrics_add(family, suffix, label_str, strtod(value, NULL), 0);
+
+		free(suffix);
+		free(label_str);
+	}
+
+	free(line);
+	fclose(file);
+}
+
+/*
+ * The family of the series key, or -1 if it is none of ours.
+ */
+static int metrics_family_of(const char *key)
+{
+	static const char *const suffixes[] = {"", "_bucket", "_sum", "_count"};
+	size_t name_size = strcspn(key, "{");
+
+	for (int i = 0; i < METRICS_MAX_FAMILIES; i++) {
+		size_t family_size = strlen(FAMILIES[i].name);
+
+		if (name_size < family_size || strncmp(key, FAMILIES[i].name, family_size) != 0)
+			continue;
+
+		for (size_t j = 0; j < sizeof(suffixes) / sizeof(suffixes[0]); j++) {
+			if (name_size - family_size == strlen(suffixes[j])
+			    && strncmp(key + family_size, suffixes[j], strlen(suffixes[j])) == 0)
+				return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Escape str for use as a label value.
+ */
+static char *metrics_label_value(const char *str)
+{
+	char *value = malloc(2 * strlen(str) + 1);
+	char *out = value;
+
+	if (!value)
+		err(EXIT_FAILURE, NULL);
+
+	for (; *str; str++) {
+		if (*str == '\\' || *str == '"') {
+			*out++ = '\\';
+			*out++ = *str;
+		} else if (*str == '\n') {
+			*out++ = '\\';
+			*out++ = 'n';
+		} else {
+			*out++ = *str;
+		}
+	}
+
+	*out = '\0';
+
+	return value;
+}
+
+/*
+ * Order series by family, then by key, which keeps each family together as
+ * the text format requires. Buckets of a histogram go in order of their
+ * upper bound.
+ */
+static int metrics_series_compare(const void *a, const void *b)
+{
+	const struct metrics_series *series_a = *(const struct metrics_series *const *)a;
+	const struct metrics_series *series_b = *(const struct metrics_series *const *)b;
+
+	if (series_a->family != series_b->family)
+		return series_a->family - series_b->family;
+
+	const char *bound_a = strstr(series_a->key, ",le=\"");
+	const char *bound_b = strstr(series_b->key, ",le=\"");
+
+	if (bound_a && bound_b && bound_a - series_a->key == bound_b - series_b->key
+	    && strncmp(series_a->key, series_b->key, bound_a - series_a->key) == 0) {
+		double le_a = strtod(bound_a + 5, NULL);
+		double le_b = strtod(bound_b + 5, NULL);
+
+		return (le_a > le_b) - (le_a < le_b);
+	}
+
+	return strcmp(series_a->key, series_b->key);
+}
@@ -0,0 +1,12 @@
+#ifndef _SALLYMOUNT_METRICS_H
+#define _SALLYMOUNT_METRICS_H
+
+#include <stddef.h>
+
+void metrics_enable(const char *path);
+int metrics_enabled(void);
+void metrics_device(int bus, const char *speed, size_t num_partitions, size_t num_mounted);
+void metrics_observe(const char *operation, const char *type, double seconds, int errnum);
+void metrics_write(void);
+
+#endif
@@ -2,12 +2,18 @@
 #include <string.h>
 #include <argp.h>
 
+#include "cli.h"
 #include "mount.h"
 #include "usb.h"
 
 static const char cli_doc_mount[] =
 	"\n"
-	"Mount USB mass storage devices.";
+	"Mount USB mass storage devices."
+	"\v"
+	"USB-PATH is a device or partition node (e.g., /dev/sdb1), a USB device path\n"
+	"(e.g., 1.2 or 1.2-1), or one of LABEL=label, UUID=uuid or SERIAL=serial.\n"
+	"\n"
+	CLI_WHERE_DOC;
 
 static const char cli_args_doc_mount[] = "[USB-PATH...]";
 
@@ -26,6 +32,28 @@ static struct argp_option cli_options_mount[] = {
 		0,
 		"Mount options string"
 	},
+	{
+		"jobs",
+		'j',
+		"N",
+		0,
+		"Mount up to N partitions concurrently, and check up to N devices"
+	},
+	{
+		"check",
+		'c',
+		0,
+		0,
+		"Check filesystems marked as dirty before mounting them"
+	},
+	{
+		"where",
+		'w',
+		"FILTER",
+		0,
+		"Mount only devices and partitions matching FILTER, all of them if no "
+		"USB-PATH is given"
+	},
 	{NULL}
 };
 
@@ -52,6 +80,23 @@ error_t cli_parse_mount(int key, char *arg, struct argp_state *state)
 
 			break;
 
+		case 'j':
+			cli_args_mount->jobs = cli_parse_jobs(arg, state);
+
+			break;
+
+		case 'c':
+			cli_args_mount->check = 1;
+
+			break;
+
+		case 'w':
+			usb_filter_free(cli_args_mount->cli_args->where);
+
+			cli_args_mount->cli_args->where = cli_parse_where(arg, state);
+
+			break;
+
 		case ARGP_KEY_ARG:
 			for (int i = 0; i < state->argc; i++) {
 				if (!cli_args_mount->usb_paths[i]) {
@@ -78,6 +123,7 @@ void cmd_mount(struct argp_state *state)
 	cli_args_mount.cli_args = state->input;
 	cli_args_mount.usb_paths = calloc(sizeof(char *), argc);
 	cli_args_mount.options = NULL;
+	cli_args_mount.jobs = 1;
 
 	argv[0] = malloc(strlen(state->name) + strlen("mount") + 2);
 
@@ -94,10 +140,18 @@ void cmd_mount(struct argp_state *state)
 
 	state->next += argc - 1;
 
-	if (cli_args_mount.all) {
-		usb_mount_all(cli_args_mount.options);
+	if (cli_args_mount.all || (cli_args_mount.cli_args->where && !cli_args_mount.num_usb_paths)) {
+		usb_mount_all(cli_args_mount.cli_args->where,
+		              cli_args_mount.options,
+		              cli_args_mount.jobs,
+		              cli_args_mount.check);
 	} else {
-		usb_mount_multiple(cli_args_mount.usb_paths, cli_args_mount.num_usb_paths, cli_args_mount.options);
+		usb_mount_multiple(cli_args_mount.usb_paths,
+		                   cli_args_mount.num_usb_paths,
+		                   cli_args_mount.cli_args->where,
+		                   cli_args_mount.options,
+		                   cli_args_mount.jobs,
+		                   cli_args_mount.check);
 	}
 
 	free(cli_args_mount.usb_paths);
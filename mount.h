@@ -8,6 +8,8 @@ struct cli_args_mount
 	char **usb_paths;
 	size_t num_usb_paths;
 	char *options;
+	size_t jobs;
+	int check;
 };
 
 error_t cli_parse_mount(int key, char *arg, struct argp_state *state);
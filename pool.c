@@ -0,0 +1,184 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+struct pool {
+	char *tasks;
+	size_t task_size;
+	size_t num_tasks;
+	size_t next_task;
+	const size_t *groups;
+	size_t groups_per_task;
+	const size_t *limits;
+	size_t *running;
+	char *started;
+	void (*run)(void *task);
+	pthread_mutex_t mutex;
+	pthread_cond_t done;
+};
+
+static void *pool_worker(void *arg);
+static size_t pool_next_task(struct pool *pool);
+static void pool_release_task(struct pool *pool, size_t task);
+
+/*
+ * Run every task in the array with at most num_jobs tasks in flight. Tasks are
+ * handed out in array order and the call returns once all have finished, so
+ * callers can report results in a deterministic order afterwards.
+ */
+void pool_run(void *tasks,
+              size_t task_size,
+              size_t num_tasks,
+              size_t num_jobs,
+              void (*run)(void *task))
+{
+	pool_run_limited(tasks, task_size, num_tasks, num_jobs, NULL, 0, NULL, 0, run);
+}
+
+/*
+ * Like pool_run, with each task also counting against groups_per_task groups,
+ * given by groups[task * groups_per_task + i], each with at most limits[group]
+ * tasks in flight. A task is held back while any of its groups is full, and
+ * later tasks may overtake it meanwhile.
+ */
+void pool_run_limited(void *tasks,
+                      size_t task_size,
+                      size_t num_tasks,
+                      size_t num_jobs,
+                      const size_t *groups,
+                      size_t groups_per_task,
+                      const size_t *limits,
+                      size_t num_groups,
+                      void (*run)(void *task))
+{
+	struct pool pool = {
+		.tasks = tasks,
+		.task_size = task_size,
+		.num_tasks = num_tasks,
+		.next_task = 0,
+		.groups = groups,
+		.groups_per_task = groups ? groups_per_task : 0,
+		.limits = limits,
+		.run = run
+	};
+
+	if (num_jobs > num_tasks)
+		num_jobs = num_tasks;
+
+	if (num_jobs <= 1) {
+		for (size_t i = 0; i < num_tasks; i++)
+			run(pool.tasks + i * task_size);
+
+		return;
+	}
+
+	pthread_t *threads = malloc(num_jobs * sizeof(pthread_t));
+	int retcode = 0;
+
+	pool.running = calloc(num_groups + 1, sizeof(size_t));
+	pool.started = calloc(num_tasks + 1, 1);
+
+	if (!threads || !pool.running || !pool.started)
+		err(EXIT_FAILURE, NULL);
+
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	for (size_t i = 0; i < num_jobs; i++) {
+		if ((retcode = pthread_create(&threads[i], NULL, pool_worker, &pool))) {
+			errno = retcode;
+
+			err(EXIT_FAILURE, NULL);
+		}
+	}
+
+	for (size_t i = 0; i < num_jobs; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&pool.done);
+	pthread_mutex_destroy(&pool.mutex);
+
+	free(pool.started);
+	free(pool.running);
+	free(threads);
+}
+
+static void *pool_worker(void *arg)
+{
+	struct pool *pool = arg;
+
+	while (1) {
+		pthread_mutex_lock(&pool->mutex);
+
+		size_t task = pool_next_task(pool);
+
+		while (task == pool->num_tasks && pool->next_task < pool->num_tasks) {
+			pthread_cond_wait(&pool->done, &pool->mutex);
+
+			task = pool_next_task(pool);
+		}
+
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (task >= pool->num_tasks)
+			break;
+
+		pool->run(pool->tasks + task * pool->task_size);
+
+		if (pool->groups_per_task) {
+			pthread_mutex_lock(&pool->mutex);
+
+			pool_release_task(pool, task);
+
+			pthread_cond_broadcast(&pool->done);
+			pthread_mutex_unlock(&pool->mutex);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Take the first task not yet started whose groups all have room, or return
+ * num_tasks if there is none for now. next_task is kept at the first task not
+ * yet started. Called with the mutex held.
+ */
+static size_t pool_next_task(struct pool *pool)
+{
+	for (size_t task = pool->next_task; task < pool->num_tasks; task++) {
+		const size_t *groups = pool->groups + task * pool->groups_per_task;
+		size_t i = 0;
+
+		if (pool->started[task])
+			continue;
+
+		while (i < pool->groups_per_task && pool->running[groups[i]] < pool->limits[groups[i]])
+			i++;
+
+		if (i < pool->groups_per_task)
+			continue;
+
+		for (i = 0; i < pool->groups_per_task; i++)
+			pool->running[groups[i]]++;
+
+		pool->started[task] = 1;
+
+		while (pool->next_task < pool->num_tasks && pool->started[pool->next_task])
+			pool->next_task++;
+
+		return task;
+	}
+
+	return pool->num_tasks;
+}
+
+static void pool_release_task(struct pool *pool, size_t task)
+{
+	const size_t *groups = pool->groups + task * pool->groups_per_task;
+
+	for (size_t i = 0; i < pool->groups_per_task; i++)
+		pool->running[groups[i]]--;
+}
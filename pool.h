@@ -0,0 +1,21 @@
+#ifndef _SALLYMOUNT_POOL_H
+#define _SALLYMOUNT_POOL_H
+
+#include <stddef.h>
+
+void pool_run(void *tasks,
+              size_t task_size,
+              size_t num_tasks,
+              size_t num_jobs,
+              void (*run)(void *task));
+void pool_run_limited(void *tasks,
+                      size_t task_size,
+                      size_t num_tasks,
+                      size_t num_jobs,
+                      const size_t *groups,
+                      size_t groups_per_task,
+                      const size_t *limits,
+                      size_t num_groups,
+                      void (*run)(void *task));
+
+#endif
@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <blkid.h>
+
+#include "probe.h"
+#include "arena.h"
+#include "hash.h"
+#include "pool.h"
+
+#define PROBE_MAX_JOBS 8
+
+/*
+ * Bytes at the start of a device covered by the checksum. This spans the
+ * superblocks of the common filesystems, up to that of btrfs at 64 KiB.
+ */
+#define PROBE_HEAD_SIZE (68 * 1024)
+
+static const char PROBE_CACHE_MAGIC[8] = "SALLYPRB";
+static const uint32_t PROBE_CACHE_VERSION = 2;
+
+/*
+ * Probe results are cached by device number, disk sequence number and size,
+ * so that a device is only probed again once it has changed. The kernel
+ * gives a disk a new sequence number whenever its media changes, but not
+ * when it is reformatted, so while uevents have happened since the cache
+ * was written a checksum of the head of the device is compared as well. The
+ * checksum is a single read, normally from the page cache, where probing
+ * takes many reads at scattered offsets.
+ */
+struct probe_key {
+	uint64_t devnum;
+	uint64_t diskseq;
+	uint64_t size;
+};
+
+struct probe_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint64_t seqnum;
+};
+
+struct probe_cache_record {
+	struct probe_key key;
+	uint64_t checksum;
+	uint16_t label_size;
+	uint16_t uuid_size;
+	uint16_t type_size;
+};
+
+struct probe_cache_entry {
+	uint64_t checksum;
+	char *label;
+	char *uuid;
+	char *type;
+};
+
+/*
+ * Cached results, mapping keys to entries, all allocated from the arena.
+ * current is set if no uevent has happened since the cache was written.
+ */
+struct probe_cache {
+	struct arena *arena;
+	struct hash_table *table;
+	int current;
+};
+
+struct probe_task {
+	struct probe_request *request;
+	struct probe_cache *cache;
+	struct probe_key key;
+	uint64_t checksum;
+	int keyed;
+};
+
+static struct probe_cache *probe_cache_load(const char *cache_path, unsigned long long seqnum);
+static void probe_cache_store(const char *cache_path,
+                              unsigned long long seqnum,
+                              struct probe_task *tasks,
+                              size_t num_tasks);
+static void probe_cache_free(struct probe_cache *cache);
+static void probe_task_run(void *arg);
+static int probe_checksum(int fd, uint64_t *checksum);
+static char *probe_strdup(const char *str);
+
+/*
+ * Probe the filesystems of requests in parallel, answering from the cache at
+ * cache_path where the devices are unchanged, and rewriting it with the
+ * results. seqnum is the uevent sequence number read before the devices were
+ * found, or 0 if unknown.
+ */
+void probe_run(struct probe_request *requests,
+               size_t num_requests,
+               const char *cache_path,
+               unsigned long long seqnum)
+{
+	struct probe_task *tasks = calloc(num_requests + 1, sizeof(struct probe_task));
+	struct probe_cache *cache = probe_cache_load(cache_path, seqnum);
+
+	if (!tasks)
+		err(EXIT_FAILURE, NULL);
+
+	for (size_t i = 0; i < num_requests; i++) {
+		tasks[i].request = &requests[i];
+		tasks[i].cache = cache;
+	}
+
+	pool_run(tasks, sizeof(struct probe_task), num_requests, PROBE_MAX_JOBS, probe_task_run);
+
+	probe_cache_store(cache_path, seqnum, tasks, num_requests);
+	probe_cache_free(cache);
+
+	free(tasks);
+
+	errno = 0;
+}
+
+static void probe_task_run(void *arg)
+{
+	struct probe_task *task = arg;
+	struct probe_request *request = task->request;
+	const char *label = NULL;
+	const char *uuid = NULL;
+	const char *type = NULL;
+	int fd = open(request->node, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	struct probe_cache_entry *cached = NULL;
+
+	if (fd != -1) {
+		task->key.devnum = request->devnum;
+		task->key.size = lseek(fd, 0, SEEK_END);
+
+		if (ioctl(fd, BLKGETDISKSEQ, &task->key.diskseq))
+			task->key.diskseq = 0;
+
+		cached = hash_table_get(task->cache->table, &task->key, sizeof(task->key));
+
+		if (cached && task->cache->current) {
+			task->checksum = cached->checksum;
+			task->keyed = 1;
+		} else if (!probe_checksum(fd, &task->checksum)) {
+			task->keyed = 1;
+		}
+
+		if (cached && (!task->keyed || cached->checksum != task->checksum))
+			cached = NULL;
+	}
+
+	if (cached) {
+		label = cached->label;
+		uuid = cached->uuid;
+		type = cached->type;
+	}
+
+	blkid_probe probe = !cached && fd != -1 ? blkid_new_probe() : NULL;
+
+	if (probe) {
+		blkid_probe_enable_superblocks(probe, 1);
+		blkid_probe_set_superblocks_flags(probe,
+		                                  BLKID_SUBLKS_LABEL | BLKID_SUBLKS_UUID | BLKID_SUBLKS_TYPE);
+
+		if (blkid_probe_set_device(probe, fd, 0, 0) == 0 && blkid_do_safeprobe(probe) == 0) {
+			blkid_probe_lookup_value(probe, "LABEL", &label, NULL);
+			blkid_probe_lookup_value(probe, "UUID", &uuid, NULL);
+			blkid_probe_lookup_value(probe, "TYPE", &type, NULL);
+		}
+	}
+
+	request->label = probe_strdup(label);
+	request->uuid = probe_strdup(uuid);
+	request->type = probe_strdup(type);
+
+	if (probe)
+		blkid_free_probe(probe);
+
+	if (fd != -1)
+		close(fd);
+}
+
+/*
+ * Checksum the head of the device open on fd. Returns -1 if it cannot be
+ * read.
+ */
+static int probe_checksum(int fd, uint64_t *checksum)
+{
+	char *head = malloc(PROBE_HEAD_SIZE);
+	ssize_t head_size = 0;
+
+	if (!head)
+		err(EXIT_FAILURE, NULL);
+
+	if ((head_size = pread(fd, head, PROBE_HEAD_SIZE, 0)) > 0)
+		*checksum = hash_bytes(head, head_size);
+
+	free(head);
+
+	return head_size > 0 ? 0 : -1;
+}
+
+static char *probe_strdup(const char *str)
+{
+	char *copy = strdup(str ? str : "");
+
+	if (!copy)
+		err(EXIT_FAILURE, NULL);
+
+	return copy;
+}
+
+/*
+ * Load the cache at cache_path. A missing cache, or one that someone other
+ * than us or root could have written, gives an empty one, and a malformed
+ * cache is read up to the first bad record. The cache is current if it was
+ * written at uevent sequence number seqnum.
+ */
+static struct probe_cache *probe_cache_load(const char *cache_path, unsigned long long seqnum)
+{
+	struct probe_cache *cache = malloc(sizeof(struct probe_cache));
+	int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+	struct probe_cache_header header;
+	struct probe_cache_record record;
+	struct stat st;
+
+	if (!cache)
+		err(EXIT_FAILURE, NULL);
+
+	cache->arena = arena_new();
+	cache->table = hash_table_new(0);
+	cache->current = 0;
+
+	if (fd == -1)
+		return cache;
+
+	if (fstat(fd, &st) ||
+	    (st.st_uid != 0 && st.st_uid != geteuid()) ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		close(fd);
+
+		return cache;
+	}
+
+	FILE *file = fdopen(fd, "r");
+
+	if (!file) {
+		close(fd);
+
+		return cache;
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	    memcmp(header.magic, PROBE_CACHE_MAGIC, sizeof(PROBE_CACHE_MAGIC)) ||
+	    header.version != PROBE_CACHE_VERSION) {
+		fclose(file);
+
+		return cache;
+	}
+
+	cache->current = seqnum && header.seqnum == seqnum;
+
+	while (fread(&record, sizeof(record), 1, file) == 1) {
+		struct probe_cache_entry *entry = arena_alloc(cache->arena, sizeof(struct probe_cache_entry));
+		char **values[3] = {&entry->label, &entry->uuid, &entry->type};
+		uint16_t sizes[3] = {record.label_size, record.uuid_size, record.type_size};
+		int i = 0;
+
+		entry->checksum = record.checksum;
+
+		for (; i < 3; i++) {
+			*values[i] = arena_alloc(cache->arena, sizes[i] + 1);
+			(*values[i])[sizes[i]] = '\0';
+
+			if (fread(*values[i], 1, sizes[i], file) != sizes[i])
+				break;
+		}
+
+		if (i < 3)
+			break;
+
+		hash_table_put(cache->table, &record.key, sizeof(record.key), entry);
+	}
+
+	fclose(file);
+
+	return cache;
+}
+
+/*
+ * Replace the cache with the results of this run, stamped with the uevent
+ * sequence number of the run, under a temporary name renamed into place.
+ * Failures are ignored, the cache being only an optimisation.
+ */
+static void probe_cache_store(const char *cache_path,
+                              unsigned long long seqnum,
+                              struct probe_task *tasks,
+                              size_t num_tasks)
+{
+	char *tmp_path = NULL;
+	char *dir_path = strdup(cache_path);
+
+	if (!dir_path || asprintf(&tmp_path, "%s.XXXXXX", cache_path) == -1)
+		err(EXIT_FAILURE, NULL);
+
+	mkdir(dirname(dir_path), 0755);
+
+	struct probe_cache_header header = {{0}, PROBE_CACHE_VERSION, seqnum};
+	int fd = mkostemp(tmp_path, O_CLOEXEC);
+	FILE *file = fd != -1 ? fdopen(fd, "w") : NULL;
+
+	memcpy(header.magic, PROBE_CACHE_MAGIC, sizeof(PROBE_CACHE_MAGIC));
+
+	int failed = !file || fchmod(fd, 0644) || fwrite(&header, sizeof(header), 1, file) != 1;
+
+	for (size_t i = 0; i < num_tasks && !failed; i++) {
+		struct probe_request *request = tasks[i].request;
+		struct probe_cache_record record = {tasks[i].key, tasks[i].checksum, 0, 0, 0};
+
+		if (!tasks[i].keyed)
+			continue;
+
+		record.label_size = strnlen(request->label, UINT16_MAX);
+		record.uuid_size = strnlen(request->uuid, UINT16_MAX);
+		record.type_size = strnlen(request->type, UINT16_MAX);
+
+		failed = fwrite(&record, sizeof(record), 1, file) != 1 ||
+		         fwrite(request->label, 1, record.label_size, file) != record.label_size ||
+		         fwrite(request->uuid, 1, record.uuid_size, file) != record.uuid_size ||
+		         fwrite(request->type, 1, record.type_size, file) != record.type_size;
+	}
+
+	if (file) {
+		if (fclose(file) || failed || rename(tmp_path, cache_path))
+			unlink(tmp_path);
+	} else if (fd != -1) {
+		close(fd);
+		unlink(tmp_path);
+	}
+
+	free(tmp_path);
+	free(dir_path);
+}
+
+static void probe_cache_free(struct probe_cache *cache)
+{
+	hash_table_free(cache->table);
+	arena_free(cache->arena);
+
+	free(cache);
+}
@@ -0,0 +1,24 @@
+#ifndef _SALLYMOUNT_PROBE_H
+#define _SALLYMOUNT_PROBE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * A block device to probe for a filesystem. label, uuid and type are set to
+ * malloc'd strings, empty if nothing was found, and freed by the caller.
+ */
+struct probe_request {
+	const char *node;
+	dev_t devnum;
+	char *label;
+	char *uuid;
+	char *type;
+};
+
+void probe_run(struct probe_request *requests,
+               size_t num_requests,
+               const char *cache_path,
+               unsigned long long seqnum);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "cli.h"
 #include "usb.h"
+#include "timing.h"
+#include "metrics.h"
 
 int main(int argc, char **argv)
 {
@@ -13,13 +15,33 @@ int main(int argc, char **argv)
 
 	if (!cli_args.command) {
 		if (cli_args.all || cli_args.num_usb_paths == 0) {
-			usb_print_all(cli_args.verbose, cli_args.human_readable);
+			usb_print_all(cli_args.where,
+			              cli_args.verbose,
+			              cli_args.human_readable,
+			              cli_args.output,
+			              cli_args.columns,
+			              cli_args.cache_path);
 		} else {
-			usb_print_multiple(cli_args.usb_paths, cli_args.num_usb_paths, cli_args.verbose, cli_args.human_readable);
+			usb_print_multiple(cli_args.usb_paths,
+			                   cli_args.num_usb_paths,
+			                   cli_args.where,
+			                   cli_args.verbose,
+			                   cli_args.human_readable,
+			                   cli_args.output,
+			                   cli_args.columns,
+			                   cli_args.cache_path);
 		}
 	}
 
+	if (metrics_enabled()) {
+		usb_metrics_inventory();
+		metrics_write();
+	}
+
+	timing_report(stderr);
+
 	free(cli_args.usb_paths);
+	usb_filter_free(cli_args.where);
 
 	return EXIT_SUCCESS;
 }
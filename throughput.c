@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "throughput.h"
+#include "pool.h"
+#include "timing.h"
+
+/*
+ * Sequential reads and writes go in blocks of THROUGHPUT_BLOCK_SIZE, random
+ * reads in blocks of THROUGHPUT_RANDOM_SIZE, each at the queue depth asked
+ * for. Buffers, offsets and sizes are aligned to THROUGHPUT_ALIGNMENT, the
+ * largest logical block size O_DIRECT can require.
+ */
+#define THROUGHPUT_BLOCK_SIZE (1024 * 1024)
+#define THROUGHPUT_RANDOM_SIZE 4096
+#define THROUGHPUT_ALIGNMENT 4096
+
+/*
+ * Random reads go on for as long as this, since their rate differs by orders
+ * of magnitude between flash drives and spinning disks.
+ */
+#define THROUGHPUT_RANDOM_SECONDS 3.0
+
+static const char *THROUGHPUT_SCRATCH_NAME = ".sallymount-bench.XXXXXX";
+
+/*
+ * An io_uring set up with raw system calls. Where the kernel lacks io_uring
+ * or forbids it, fd is -1 and submissions complete synchronously onto
+ * results, which is read through the same interface.
+ */
+struct throughput_ring {
+	int fd;
+	unsigned int entries;
+	unsigned int pending;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+	struct io_uring_cqe *results;
+	unsigned int results_head;
+	unsigned int num_results;
+};
+
+struct throughput_task {
+	struct throughput_request *request;
+	struct throughput_ring ring;
+	size_t size;
+	unsigned int queue_depth;
+	unsigned int seed;
+	char *buffers;
+};
+
+static void throughput_task_run(void *arg);
+static void throughput_write(struct throughput_task *task);
+static int throughput_pass(struct throughput_task *task,
+                           int fd,
+                           int write,
+                           size_t block_size,
+                           size_t num_blocks,
+                           off_t span,
+                           const struct timespec *start,
+                           size_t *completed);
+static double throughput_seconds_since(const struct timespec *start);
+static void throughput_ring_init(struct throughput_ring *ring, unsigned int entries);
+static void throughput_ring_free(struct throughput_ring *ring);
+static void throughput_ring_submit(struct throughput_ring *ring,
+                                   int fd,
+                                   int write,
+                                   char *buffer,
+                                   size_t size,
+                                   off_t offset,
+                                   uint64_t user_data);
+static int throughput_ring_wait(struct throughput_ring *ring, struct io_uring_cqe *cqe);
+
+/*
+ * Measure every device of requests at once, reading up to size bytes
+ * sequentially, then 4 KiB blocks at random for a few seconds, and writing
+ * size bytes to a scratch file where a directory is given.
+ */
+void throughput_run(struct throughput_request *requests,
+                    size_t num_requests,
+                    size_t size,
+                    unsigned int queue_depth)
+{
+	struct throughput_task *tasks = calloc(num_requests + 1, sizeof(struct throughput_task));
+
+	if (!tasks)
+		err(EXIT_FAILURE, NULL);
+
+	for (size_t i = 0; i < num_requests; i++) {
+		tasks[i].request = &requests[i];
+		tasks[i].size = size;
+		tasks[i].queue_depth = queue_depth;
+		tasks[i].seed = time(NULL) ^ i;
+	}
+
+	pool_run(tasks, sizeof(struct throughput_task), num_requests, num_requests, throughput_task_run);
+
+	free(tasks);
+}
+
+static void throughput_task_run(void *arg)
+{
+	struct throughput_task *task = arg;
+	struct throughput_request *request = task->request;
+	uint64_t timing = timing_start();
+	struct timespec start;
+	size_t completed = 0;
+
+	if (posix_memalign((void **)&task->buffers,
+	                   THROUGHPUT_ALIGNMENT,
+	                   (size_t)task->queue_depth * THROUGHPUT_BLOCK_SIZE))
+		err(EXIT_FAILURE, NULL);
+
+	/*
+	 * Written data is random, so that drives which compress or deduplicate
+	 * cannot make short work of it.
+	 */
+	for (size_t i = 0; request->scratch_dir && i < (size_t)task->queue_depth * THROUGHPUT_BLOCK_SIZE; i++)
+		task->buffers[i] = rand_r(&task->seed);
+
+	throughput_ring_init(&task->ring, task->queue_depth);
+
+	int fd = open(request->node, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	off_t device_size = fd != -1 ? lseek(fd, 0, SEEK_END) : -1;
+
+	if (device_size == -1) {
+		request->errnum = errno;
+	} else {
+		size_t size = task->size < (size_t)device_size ? task->size : (size_t)device_size;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (size >= THROUGHPUT_BLOCK_SIZE
+		    && !throughput_pass(task,
+		                        fd,
+		                        0,
+		                        THROUGHPUT_BLOCK_SIZE,
+		                        size / THROUGHPUT_BLOCK_SIZE,
+		                        0,
+		                        NULL,
+		                        &completed))
+			request->read_rate = completed * THROUGHPUT_BLOCK_SIZE / throughput_seconds_since(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (device_size >= THROUGHPUT_RANDOM_SIZE
+		    && !throughput_pass(task,
+		                        fd,
+		                        0,
+		                        THROUGHPUT_RANDOM_SIZE,
+		                        SIZE_MAX,
+		                        device_size,
+		                        &start,
+		                        &completed))
+			request->random_iops = completed / throughput_seconds_since(&start);
+	}
+
+	if (fd != -1)
+		close(fd);
+
+	if (request->scratch_dir)
+		throughput_write(task);
+
+	throughput_ring_free(&task->ring);
+
+	free(task->buffers);
+
+	timing_stop(timing, "throughput", request->node);
+}
+
+/*
+ * Write a scratch file in the scratch directory, unlinked as soon as it is
+ * created so that nothing is left behind, and time it until it is on the
+ * device. Filesystems without O_DIRECT are written through the page cache,
+ * which the final fdatasync still accounts for.
+ */
+static void throughput_write(struct throughput_task *task)
+{
+	struct throughput_request *request = task->request;
+	struct timespec start;
+	size_t completed = 0;
+	char *path = NULL;
+
+	if (asprintf(&path, "%s/%s", request->scratch_dir, THROUGHPUT_SCRATCH_NAME) == -1)
+		err(EXIT_FAILURE, NULL);
+
+	int fd = mkostemp(path, O_CLOEXEC);
+
+	if (fd == -1) {
+		request->errnum = errno;
+
+		free(path);
+
+		return;
+	}
+
+	unlink(path);
+	free(path);
+
+	fcntl(fd, F_SETFL, O_DIRECT);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (task->size >= THROUGHPUT_BLOCK_SIZE
+	    && !throughput_pass(task,
+	                        fd,
+	                        1,
+	                        THROUGHPUT_BLOCK_SIZE,
+	                        task->size / THROUGHPUT_BLOCK_SIZE,
+	                        0,
+	                        NULL,
+	                        &completed)) {
+		if (fdatasync(fd))
+			request->errnum = errno;
+		else
+			request->write_rate = completed * THROUGHPUT_BLOCK_SIZE / throughput_seconds_since(&start);
+	}
+
+	close(fd);
+}
+
+/*
+ * Read or write num_blocks blocks of block_size, keeping up to the queue
+ * depth of them in flight, at sequential offsets from 0, or at random ones
+ * below span if that is not 0. With start, stop issuing blocks once
+ * THROUGHPUT_RANDOM_SECONDS have passed since it. Sets completed to the
+ * blocks transferred, and returns -1, with the request's errnum set, if one
+ * failed.
+ */
+static int throughput_pass(struct throughput_task *task,
+                           int fd,
+                           int write,
+                           size_t block_size,
+                           size_t num_blocks,
+                           off_t span,
+                           const struct timespec *start,
+                           size_t *completed)
+{
+	unsigned int free_slots[task->queue_depth];
+	unsigned int num_free = task->queue_depth;
+	unsigned int in_flight = 0;
+	size_t issued = 0;
+	int failed = 0;
+
+	for (unsigned int i = 0; i < task->queue_depth; i++)
+		free_slots[i] = i;
+
+	*completed = 0;
+
+	while (1) {
+		while (num_free && issued < num_blocks && !failed
+		       && !(start && throughput_seconds_since(start) >= THROUGHPUT_RANDOM_SECONDS)) {
+			unsigned int slot = free_slots[--num_free];
+			off_t offset = issued * block_size;
+
+			if (span) {
+				uint64_t block = (uint64_t)rand_r(&task->seed) << 31 | rand_r(&task->seed);
+
+				offset = block % (span / block_size) * block_size;
+			}
+
+			throughput_ring_submit(&task->ring,
+			                       fd,
+			                       write,
+			                       task->buffers + (size_t)slot * THROUGHPUT_BLOCK_SIZE,
+			                       block_size,
+			                       offset,
+			                       slot);
+
+			issued++;
+			in_flight++;
+		}
+
+		if (!in_flight)
+			break;
+
+		struct io_uring_cqe cqe;
+
+		if (throughput_ring_wait(&task->ring, &cqe)) {
+			task->request->errnum = errno;
+
+			return -1;
+		}
+
+		if (cqe.res < 0 && !failed) {
+			task->request->errnum = -cqe.res;
+			failed = 1;
+		} else if (cqe.res > 0) {
+			(*completed)++;
+		}
+
+		free_slots[num_free++] = cqe.user_data;
+		in_flight--;
+	}
+
+	return failed ? -1 : 0;
+}
+
+static double throughput_seconds_since(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void throughput_ring_init(struct throughput_ring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(struct throughput_ring));
+	memset(&params, 0, sizeof(struct io_uring_params));
+
+	ring->entries = entries;
+	ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+
+	if (ring->fd != -1) {
+		ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			if (ring->cq_map_size > ring->sq_map_size)
+				ring->sq_map_size = ring->cq_map_size;
+
+			ring->cq_map_size = 0;
+		}
+
+		ring->sq_map = mmap(NULL,
+		                    ring->sq_map_size,
+		                    PROT_READ | PROT_WRITE,
+		                    MAP_SHARED | MAP_POPULATE,
+		                    ring->fd,
+		                    IORING_OFF_SQ_RING);
+		ring->cq_map = !ring->cq_map_size ? ring->sq_map : mmap(NULL,
+		                                                        ring->cq_map_size,
+		                                                        PROT_READ | PROT_WRITE,
+		                                                        MAP_SHARED | MAP_POPULATE,
+		                                                        ring->fd,
+		                                                        IORING_OFF_CQ_RING);
+		ring->sqes = mmap(NULL,
+		                  ring->sqes_size,
+		                  PROT_READ | PROT_WRITE,
+		                  MAP_SHARED | MAP_POPULATE,
+		                  ring->fd,
+		                  IORING_OFF_SQES);
+
+		if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+			throughput_ring_free(ring);
+			memset(ring, 0, sizeof(struct throughput_ring));
+
+			ring->entries = entries;
+			ring->fd = -1;
+		} else {
+			char *sq = ring->sq_map;
+			char *cq = ring->cq_map;
+
+			ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+			ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+			ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+			ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+			ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+			ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+			ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+		}
+	}
+
+	if (ring->fd == -1 && !(ring->results = calloc(entries, sizeof(struct io_uring_cqe))))
+		err(EXIT_FAILURE, NULL);
+}
+
+static void throughput_ring_free(struct throughput_ring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->cq_map && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+
+	if (ring->sq_map && ring->sq_map != MAP_FAILED)
+		munmap(ring->sq_map, ring->sq_map_size);
+
+	if (ring->fd != -1)
+		close(ring->fd);
+
+	free(ring->results);
+}
+
+/*
+ * Queue a read or write of size bytes of buffer at offset, to be submitted
+ * by the next wait.
+ */
+static void throughput_ring_submit(struct throughput_ring *ring,
+                                   int fd,
+                                   int write,
+                                   char *buffer,
+                                   size_t size,
+                                   off_t offset,
+                                   uint64_t user_data)
+{
+	if (ring->fd == -1) {
+		struct io_uring_cqe *result = &ring->results[(ring->results_head + ring->num_results++) % ring->entries];
+		ssize_t res = write ? pwrite(fd, buffer, size, offset) : pread(fd, buffer, size, offset);
+
+		result->user_data = user_data;
+		result->res = res == -1 ? -errno : res;
+
+		return;
+	}
+
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buffer;
+	sqe->len = size;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+
+	ring->sq_array[index] = index;
+	ring->pending++;
+
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submit what is queued and take the next completion into cqe, waiting for
+ * one if there is none. Returns -1, with errno set, if that fails.
+ */
+static int throughput_ring_wait(struct throughput_ring *ring, struct io_uring_cqe *cqe)
+{
+	if (ring->fd == -1) {
+		*cqe = ring->results[ring->results_head];
+
+		ring->results_head = (ring->results_head + 1) % ring->entries;
+		ring->num_results--;
+
+		return 0;
+	}
+
+	while (1) {
+		unsigned int head = *ring->cq_head;
+		unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (ring->pending || head == tail) {
+			int submitted = syscall(SYS_io_uring_enter,
+			                        ring->fd,
+			                        ring->pending,
+			                        head == tail ? 1 : 0,
+			                        IORING_ENTER_GETEVENTS,
+			                        NULL,
+			                        0);
+
+			if (submitted == -1) {
+				if (errno == EINTR)
+					continue;
+
+				return -1;
+			}
+
+			ring->pending -= submitted;
+
+			continue;
+		}
+
+		*cqe = ring->cqes[head & *ring->cq_mask];
+
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		return 0;
+	}
+}
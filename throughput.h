@@ -0,0 +1,26 @@
+#ifndef _SALLYMOUNT_THROUGHPUT_H
+#define _SALLYMOUNT_THROUGHPUT_H
+
+#include <stddef.h>
+
+/*
+ * A block device to measure, and optionally a directory on it to write a
+ * scratch file in. Rates are set in bytes per second and random_iops in
+ * 4 KiB reads per second, each 0 if not measured. errnum is set if the
+ * device could not be measured in full.
+ */
+struct throughput_request {
+	const char *node;
+	const char *scratch_dir;
+	double read_rate;
+	double write_rate;
+	double random_iops;
+	int errnum;
+};
+
+void throughput_run(struct throughput_request *requests,
+                    size_t num_requests,
+                    size_t size,
+                    unsigned int queue_depth);
+
+#endif
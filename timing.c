@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "timing.h"
+
+static const char *COUNTER_NAMES[TIMING_MAX_COUNTERS] = {
+	[TIMING_UDEV] = "libudev calls",
+	[TIMING_LIBMOUNT] = "libmount calls",
+	[TIMING_SYSFS] = "sysfs reads",
+	[TIMING_ALLOC] = "allocations"
+};
+
+/*
+ * A phase, or an operation on one device, timed from start to end in
+ * nanoseconds of the monotonic clock.
+ */
+struct timing_span {
+	const char *name;
+	char *detail;
+	uint64_t start;
+	uint64_t end;
+	pid_t tid;
+};
+
+static int enabled = 0;
+static int counting_allocations = 0;
+static const char *trace_output = NULL;
+static uint64_t origin = 0;
+static size_t counters[TIMING_MAX_COUNTERS];
+static struct timing_span *spans = NULL;
+static size_t num_spans = 0;
+static size_t size_spans = 0;
+static pthread_mutex_t spans_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *str);
+char *__real_strndup(const char *str, size_t size);
+
+static uint64_t timing_now(void);
+static void timing_write_trace(const char *path);
+static void timing_json_print_string(FILE *stream, const char *str);
+
+/*
+ * Allocations are counted by linking with malloc, calloc, realloc, strdup,
+ * strndup and asprintf wrapped, which covers the calls sallymount makes
+ * itself. Buffers grown by getline and open_memstream, and allocations made
+ * inside the libraries, are not counted. Nothing is counted until timings
+ * or allocation counting are enabled. Spans are allocated with the real
+ * functions so as not to count themselves.
+ */
+void *__wrap_malloc(size_t size)
+{
+	if (counting_allocations)
+		timing_count(TIMING_ALLOC);
+
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size)
+{
+	if (counting_allocations)
+		timing_count(TIMING_ALLOC);
+
+	return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	if (counting_allocations)
+		timing_count(TIMING_ALLOC);
+
+	return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *str)
+{
+	if (counting_allocations)
+		timing_count(TIMING_ALLOC);
+
+	return __real_strdup(str);
+}
+
+char *__wrap_strndup(const char *str, size_t size)
+{
+	if (counting_allocations)
+		timing_count(TIMING_ALLOC);
+
+	return __real_strndup(str, size);
+}
+
+int __wrap_asprintf(char **ptr, const char *format, ...)
+{
+	va_list args;
+
+	if (counting_allocations)
+		timing_count(TIMING_ALLOC);
+
+	va_start(args, format);
+
+	int retcode = vasprintf(ptr, format, args);
+
+	va_end(args);
+
+	return retcode;
+}
+
+/*
+ * Count allocations without recording spans, as for benchmarks.
+ */
+void timing_count_allocations(void)
+{
+	counting_allocations = 1;
+}
+
+/*
+ * Start recording spans, to be summarised by timing_report and, if
+ * trace_path is given, written there as a Chrome trace.
+ */
+void timing_enable(const char *trace_path)
+{
+	enabled = 1;
+	counting_allocations = 1;
+	trace_output = trace_path;
+	origin = timing_now();
+}
+
+/*
+ * The start of a span to pass to timing_stop, or 0 if timings are off.
+ */
+uint64_t timing_start(void)
+{
+	return enabled ? timing_now() : 0;
+}
+
+/*
+ * Record the span called name from start until now, with detail naming the
+ * device it concerns, if any.
+ */
+void timing_stop(uint64_t start, const char *name, const char *detail)
+{
+	if (!enabled)
+		return;
+
+	uint64_t end = timing_now();
+	char *detail_copy = NULL;
+
+	if (detail) {
+		detail_copy = __real_malloc(strlen(detail) + 1);
+
+		if (!detail_copy)
+			err(EXIT_FAILURE, NULL);
+
+		strcpy(detail_copy, detail);
+	}
+
+	pthread_mutex_lock(&spans_mutex);
+
+	if (num_spans == size_spans) {
+		size_spans = size_spans ? size_spans * 2 : 64;
+		spans = __real_realloc(spans, size_spans * sizeof(struct timing_span));
+
+		if (!spans)
+			err(EXIT_FAILURE, NULL);
+	}
+
+	spans[num_spans].name = name;
+	spans[num_spans].detail = detail_copy;
+	spans[num_spans].start = start;
+	spans[num_spans].end = end;
+	spans[num_spans].tid = syscall(SYS_gettid);
+	num_spans++;
+
+	pthread_mutex_unlock(&spans_mutex);
+}
+
+void timing_count(enum timing_counter counter)
+{
+	__atomic_add_fetch(&counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+size_t timing_allocations(void)
+{
+	return __atomic_load_n(&counters[TIMING_ALLOC], __ATOMIC_RELAXED);
+}
+
+/*
+ * Print the count, total, mean and longest time of every kind of span, in
+ * the order each first ended, and the counters. Spans of the same kind run
+ * in parallel add up to more than the time they took.
+ */
+void timing_report(FILE *stream)
+{
+	if (!enabled)
+		return;
+
+	double total = (timing_now() - origin) / 1e6;
+
+	fprintf(stream, "%-12s %7s %12s %12s %12s\n", "PHASE", "COUNT", "TOTAL MS", "MEAN MS", "MAX MS");
+
+	for (size_t i = 0; i < num_spans; i++) {
+		size_t count = 0;
+		double sum = 0;
+		double max = 0;
+		size_t j = 0;
+
+		while (j < i && strcmp(spans[j].name, spans[i].name) != 0)
+			j++;
+
+		if (j < i)
+			continue;
+
+		for (j = i; j < num_spans; j++) {
+			if (strcmp(spans[j].name, spans[i].name) != 0)
+				continue;
+
+			double duration = (spans[j].end - spans[j].start) / 1e6;
+
+			count++;
+			sum += duration;
+
+			if (duration > max)
+				max = duration;
+		}
+
+		fprintf(stream,
+		        "%-12s %7zu %12.3f %12.3f %12.3f\n",
+		        spans[i].name,
+		        count,
+		        sum,
+		        sum / count,
+		        max);
+	}
+
+	fprintf(stream, "%-12s %7d %12.3f %12.3f %12.3f\n", "total", 1, total, total, total);
+	fputc('\n', stream);
+
+	for (size_t i = 0; i < TIMING_MAX_COUNTERS; i++)
+		fprintf(stream, "%-16s %10zu\n", COUNTER_NAMES[i], counters[i]);
+
+	if (trace_output)
+		timing_write_trace(trace_output);
+}
+
+static uint64_t timing_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Write the spans as complete events of the Chrome trace event format, which
+ * Perfetto and chrome://tracing load, one track per thread.
+ */
+static void timing_write_trace(const char *path)
+{
+	FILE *stream = fopen(path, "we");
+	pid_t pid = getpid();
+
+	if (!stream) {
+		warn("Cannot write trace to %s", path);
+
+		return;
+	}
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", stream);
+
+	for (size_t i = 0; i < num_spans; i++) {
+		fprintf(stream, "%s\n{\"name\":", i ? "," : "");
+		timing_json_print_string(stream, spans[i].name);
+		fprintf(stream,
+		        ",\"cat\":\"sallymount\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+		        (int)pid,
+		        (int)spans[i].tid,
+		        (spans[i].start - origin) / 1e3,
+		        (spans[i].end - spans[i].start) / 1e3);
+
+		if (spans[i].detail) {
+			fputs(",\"args\":{\"device\":", stream);
+			timing_json_print_string(stream, spans[i].detail);
+			fputc('}', stream);
+		}
+
+		fputc('}', stream);
+	}
+
+	fputs("\n]}\n", stream);
+
+	if (fclose(stream))
+		warn("Cannot write trace to %s", path);
+}
+
+static void timing_json_print_string(FILE *stream, const char *str)
+{
+	fputc('"', stream);
+
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(stream, "\\%c", *str);
+
+		else if ((unsigned char)*str < 0x20)
+			fprintf(stream, "\\u%04x", *str);
+
+		else
+			fputc(*str, stream);
+	}
+
+	fputc('"', stream);
+}
@@ -0,0 +1,29 @@
+#ifndef _SALLYMOUNT_TIMING_H
+#define _SALLYMOUNT_TIMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum timing_counter {
+	TIMING_UDEV,
+	TIMING_LIBMOUNT,
+	TIMING_SYSFS,
+	TIMING_ALLOC,
+	TIMING_MAX_COUNTERS
+};
+
+/*
+ * Evaluate call, counting it against counter.
+ */
+#define TIMING_CALL(counter, call) (timing_count(counter), (call))
+
+void timing_enable(const char *trace_path);
+uint64_t timing_start(void);
+void timing_stop(uint64_t start, const char *name, const char *detail);
+void timing_count(enum timing_counter counter);
+void timing_count_allocations(void);
+size_t timing_allocations(void);
+void timing_report(FILE *stream);
+
+#endif
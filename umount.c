@@ -2,12 +2,18 @@
 #include <string.h>
 #include <argp.h>
 
+#include "cli.h"
 #include "umount.h"
 #include "usb.h"
 
 static const char cli_doc_umount[] =
 	"\n"
-	"Unmount USB mass storage devices.";
+	"Unmount USB mass storage devices."
+	"\v"
+	"USB-PATH is a device or partition node (e.g., /dev/sdb1), a USB device path\n"
+	"(e.g., 1.2 or 1.2-1), or one of LABEL=label, UUID=uuid or SERIAL=serial.\n"
+	"\n"
+	CLI_WHERE_DOC;
 
 static const char cli_args_doc_umount[] = "[USB-PATH...]";
 
@@ -19,6 +25,21 @@ static struct argp_option cli_options_umount[] = {
 		0,
 		"Unmount all USB devices"
 	},
+	{
+		"jobs",
+		'j',
+		"N",
+		0,
+		"Unmount up to N partitions concurrently"
+	},
+	{
+		"where",
+		'w',
+		"FILTER",
+		0,
+		"Unmount only devices and partitions matching FILTER, all of them if no "
+		"USB-PATH is given"
+	},
 	{NULL}
 };
 
@@ -40,6 +61,18 @@ error_t cli_parse_umount(int key, char *arg, struct argp_state *state)
 
 			break;
 
+		case 'j':
+			cli_args_umount->jobs = cli_parse_jobs(arg, state);
+
+			break;
+
+		case 'w':
+			usb_filter_free(cli_args_umount->cli_args->where);
+
+			cli_args_umount->cli_args->where = cli_parse_where(arg, state);
+
+			break;
+
 		case ARGP_KEY_ARG:
 			for (int i = 0; i < state->argc; i++) {
 				if (!cli_args_umount->usb_paths[i]) {
@@ -65,6 +98,7 @@ void cmd_umount(struct argp_state *state)
 
 	cli_args_umount.cli_args = state->input;
 	cli_args_umount.usb_paths = calloc(sizeof(char *), argc);
+	cli_args_umount.jobs = 1;
 
 	argv[0] = malloc(strlen(state->name) + strlen("umount") + 2);
 
@@ -81,10 +115,13 @@ void cmd_umount(struct argp_state *state)
 
 	state->next += argc - 1;
 
-	if (cli_args_umount.all) {
-		usb_umount_all();
+	if (cli_args_umount.all || (cli_args_umount.cli_args->where && !cli_args_umount.num_usb_paths)) {
+		usb_umount_all(cli_args_umount.cli_args->where, cli_args_umount.jobs);
 	} else {
-		usb_umount_multiple(cli_args_umount.usb_paths, cli_args_umount.num_usb_paths);
+		usb_umount_multiple(cli_args_umount.usb_paths,
+		                    cli_args_umount.num_usb_paths,
+		                    cli_args_umount.cli_args->where,
+		                    cli_args_umount.jobs);
 	}
 
 	free(cli_args_umount.usb_paths);
@@ -7,6 +7,7 @@ struct cli_args_umount
 	int all;
 	char **usb_paths;
 	size_t num_usb_paths;
+	size_t jobs;
 };
 
 error_t cli_parse_umount(int key, char* arg, struct argp_state* state);
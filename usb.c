@@ -1,34 +1,279 @@
 #define _GNU_SOURCE
 
+#include <stdio.h>
 #include <unistd.h>
 #include <err.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <linux/mount.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
 #include <errno.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <libgen.h>
 #include <math.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include <libudev.h>
 #include <libmount.h>
 
 #include "usb.h"
+#include "arena.h"
+#include "hash.h"
+#include "pool.h"
+#include "probe.h"
+#include "check.h"
+#include "timing.h"
+#include "metrics.h"
+#include "throughput.h"
+
+/*
+ * Count every libudev and libmount call for --timings. A macro is not
+ * expanded again inside its own expansion, so each of these expands to a
+ * counted call of the function it is named after.
+ */
+#define udev_device_get_action(...) TIMING_CALL(TIMING_UDEV, udev_device_get_action(__VA_ARGS__))
+#define udev_device_get_devnode(...) TIMING_CALL(TIMING_UDEV, udev_device_get_devnode(__VA_ARGS__))
+#define udev_device_get_devnum(...) TIMING_CALL(TIMING_UDEV, udev_device_get_devnum(__VA_ARGS__))
+#define udev_device_get_devtype(...) TIMING_CALL(TIMING_UDEV, udev_device_get_devtype(__VA_ARGS__))
+#define udev_device_get_driver(...) TIMING_CALL(TIMING_UDEV, udev_device_get_driver(__VA_ARGS__))
+#define udev_device_get_is_initialized(...) TIMING_CALL(TIMING_UDEV, udev_device_get_is_initialized(__VA_ARGS__))
+#define udev_device_get_parent(...) TIMING_CALL(TIMING_UDEV, udev_device_get_parent(__VA_ARGS__))
+#define udev_device_get_parent_with_subsystem_devtype(...) TIMING_CALL(TIMING_UDEV, udev_device_get_parent_with_subsystem_devtype(__VA_ARGS__))
+#define udev_device_get_property_value(...) TIMING_CALL(TIMING_UDEV, udev_device_get_property_value(__VA_ARGS__))
+#define udev_device_get_sysattr_value(...) TIMING_CALL(TIMING_UDEV, udev_device_get_sysattr_value(__VA_ARGS__))
+#define udev_device_get_sysname(...) TIMING_CALL(TIMING_UDEV, udev_device_get_sysname(__VA_ARGS__))
+#define udev_device_get_syspath(...) TIMING_CALL(TIMING_UDEV, udev_device_get_syspath(__VA_ARGS__))
+#define udev_device_new_from_syspath(...) TIMING_CALL(TIMING_UDEV, udev_device_new_from_syspath(__VA_ARGS__))
+#define udev_device_unref(...) TIMING_CALL(TIMING_UDEV, udev_device_unref(__VA_ARGS__))
+#define udev_enumerate_add_match_property(...) TIMING_CALL(TIMING_UDEV, udev_enumerate_add_match_property(__VA_ARGS__))
+#define udev_enumerate_add_match_subsystem(...) TIMING_CALL(TIMING_UDEV, udev_enumerate_add_match_subsystem(__VA_ARGS__))
+#define udev_enumerate_get_list_entry(...) TIMING_CALL(TIMING_UDEV, udev_enumerate_get_list_entry(__VA_ARGS__))
+#define udev_enumerate_new(...) TIMING_CALL(TIMING_UDEV, udev_enumerate_new(__VA_ARGS__))
+#define udev_enumerate_scan_devices(...) TIMING_CALL(TIMING_UDEV, udev_enumerate_scan_devices(__VA_ARGS__))
+#define udev_enumerate_unref(...) TIMING_CALL(TIMING_UDEV, udev_enumerate_unref(__VA_ARGS__))
+#define udev_list_entry_get_name(...) TIMING_CALL(TIMING_UDEV, udev_list_entry_get_name(__VA_ARGS__))
+#define udev_list_entry_get_next(...) TIMING_CALL(TIMING_UDEV, udev_list_entry_get_next(__VA_ARGS__))
+#define udev_monitor_enable_receiving(...) TIMING_CALL(TIMING_UDEV, udev_monitor_enable_receiving(__VA_ARGS__))
+#define udev_monitor_filter_add_match_subsystem_devtype(...) TIMING_CALL(TIMING_UDEV, udev_monitor_filter_add_match_subsystem_devtype(__VA_ARGS__))
+#define udev_monitor_get_fd(...) TIMING_CALL(TIMING_UDEV, udev_monitor_get_fd(__VA_ARGS__))
+#define udev_monitor_new_from_netlink(...) TIMING_CALL(TIMING_UDEV, udev_monitor_new_from_netlink(__VA_ARGS__))
+#define udev_monitor_receive_device(...) TIMING_CALL(TIMING_UDEV, udev_monitor_receive_device(__VA_ARGS__))
+#define udev_monitor_unref(...) TIMING_CALL(TIMING_UDEV, udev_monitor_unref(__VA_ARGS__))
+#define udev_new(...) TIMING_CALL(TIMING_UDEV, udev_new(__VA_ARGS__))
+#define udev_unref(...) TIMING_CALL(TIMING_UDEV, udev_unref(__VA_ARGS__))
+#define mnt_context_enable_lazy(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_context_enable_lazy(__VA_ARGS__))
+#define mnt_context_mount(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_context_mount(__VA_ARGS__))
+#define mnt_context_set_options(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_context_set_options(__VA_ARGS__))
+#define mnt_context_set_source(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_context_set_source(__VA_ARGS__))
+#define mnt_context_set_target(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_context_set_target(__VA_ARGS__))
+#define mnt_context_umount(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_context_umount(__VA_ARGS__))
+#define mnt_free_context(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_free_context(__VA_ARGS__))
+#define mnt_free_iter(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_free_iter(__VA_ARGS__))
+#define mnt_fs_get_devno(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_fs_get_devno(__VA_ARGS__))
+#define mnt_fs_get_srcpath(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_fs_get_srcpath(__VA_ARGS__))
+#define mnt_fs_get_target(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_fs_get_target(__VA_ARGS__))
+#define mnt_new_context(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_new_context(__VA_ARGS__))
+#define mnt_new_iter(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_new_iter(__VA_ARGS__))
+#define mnt_new_table_from_file(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_new_table_from_file(__VA_ARGS__))
+#define mnt_table_get_nents(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_table_get_nents(__VA_ARGS__))
+#define mnt_table_next_fs(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_table_next_fs(__VA_ARGS__))
+#define mnt_unref_table(...) TIMING_CALL(TIMING_LIBMOUNT, mnt_unref_table(__VA_ARGS__))
 
 static const char *MOUNT_DIR_PREFIX = "/media";
+static const char *MOUNT_INFO_PATH = "/proc/self/mountinfo";
+static const char *UEVENT_SEQNUM_PATH = "/sys/kernel/uevent_seqnum";
+static const char *PROBE_CACHE_PATH = "/run/sallymount/probe";
+
+static const char CACHE_MAGIC[8] = "SALLYINV";
+static const uint32_t CACHE_VERSION = 2;
+
+static const char *SOURCE_SYSFS = "sysfs";
+static const char *SOURCE_UDEV = "udev";
+static const char *SOURCE_FIXTURE = "fixture:";
+static const unsigned int FIXTURE_MAJOR = 240;
+static const char *SYSFS_PATH = "sys";
+static const char *SYSFS_BLOCK_PATH = "class/block";
+static const char *UDEV_DATA_PATH = "run/udev/data";
+
+static const char *SELECTOR_LABEL = "LABEL=";
+static const char *SELECTOR_UUID = "UUID=";
+static const char *SELECTOR_SERIAL = "SERIAL=";
+
+/*
+ * Attributes loaded by the enumerator, so that listings only read the sysfs
+ * and udev database entries their columns and selectors need. Nodes, device
+ * paths and sysfs paths are always loaded.
+ */
+#define FIELD_SIZE (1 << 0)
+#define FIELD_FS (1 << 1)
+#define FIELD_MANUFACTURER (1 << 2)
+#define FIELD_PRODUCT (1 << 3)
+#define FIELD_SERIAL (1 << 4)
+#define FIELD_BUS (1 << 5)
+#define FIELD_VERSION (1 << 6)
+#define FIELD_SPEED (1 << 7)
+#define FIELD_MAX_CHILDREN (1 << 8)
+#define FIELD_PARTITIONS (1 << 9)
+#define FIELD_MOUNTS (1 << 10)
+#define FIELD_ALL (~0u)
+
+enum usb_filter_field {
+	FILTER_BUS,
+	FILTER_DEV_PATH,
+	FILTER_SERIAL,
+	FILTER_MANUFACTURER,
+	FILTER_PRODUCT,
+	FILTER_SIZE,
+	FILTER_TYPE,
+	FILTER_LABEL,
+	FILTER_UUID,
+	FILTER_MOUNTED,
+	FILTER_NUM_FIELDS
+};
+
+enum usb_filter_op {
+	FILTER_EQ,
+	FILTER_NE,
+	FILTER_LT,
+	FILTER_LE,
+	FILTER_GT,
+	FILTER_GE
+};
+
+enum usb_filter_type {
+	FILTER_TYPE_STRING,
+	FILTER_TYPE_NUMBER,
+	FILTER_TYPE_SIZE,
+	FILTER_TYPE_BOOLEAN
+};
+
+/*
+ * Fields a --where filter can test, with the attributes they need loaded.
+ * Fields not on devices are tested on partitions.
+ */
+static const struct usb_filter_field_info {
+	const char *name;
+	int type;
+	unsigned int fields;
+	int device;
+} FILTER_FIELDS[] = {
+	[FILTER_BUS] = {"bus", FILTER_TYPE_NUMBER, FIELD_BUS, 1},
+	[FILTER_DEV_PATH] = {"dev_path", FILTER_TYPE_STRING, 0, 1},
+	[FILTER_SERIAL] = {"serial", FILTER_TYPE_STRING, FIELD_SERIAL, 1},
+	[FILTER_MANUFACTURER] = {"manufacturer", FILTER_TYPE_STRING, FIELD_MANUFACTURER, 1},
+	[FILTER_PRODUCT] = {"product", FILTER_TYPE_STRING, FIELD_PRODUCT, 1},
+	[FILTER_SIZE] = {"size", FILTER_TYPE_SIZE, FIELD_SIZE, 0},
+	[FILTER_TYPE] = {"type", FILTER_TYPE_STRING, FIELD_FS, 0},
+	[FILTER_LABEL] = {"label", FILTER_TYPE_STRING, FIELD_FS, 0},
+	[FILTER_UUID] = {"uuid", FILTER_TYPE_STRING, FIELD_FS, 0},
+	[FILTER_MOUNTED] = {"mounted", FILTER_TYPE_BOOLEAN, FIELD_MOUNTS, 0}
+};
+
+/*
+ * Characters udev keeps as they are when deriving ID_SERIAL_SHORT from a USB
+ * serial, and the pattern characters matching any of them.
+ */
+static const char *FILTER_SERIAL_SAFE = "0123456789"
+                                        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                        "abcdefghijklmnopqrstuvwxyz"
+                                        "-.:=@*?";
+
+/*
+ * Mount attributes set up by fsmount rather than by the filesystem, with
+ * those they replace.
+ */
+static const struct usb_mount_attr {
+	const char *name;
+	unsigned int set;
+	unsigned int clear;
+} MOUNT_ATTRS[] = {
+	{"ro", MOUNT_ATTR_RDONLY, 0},
+	{"rw", 0, MOUNT_ATTR_RDONLY},
+	{"nosuid", MOUNT_ATTR_NOSUID, 0},
+	{"suid", 0, MOUNT_ATTR_NOSUID},
+	{"nodev", MOUNT_ATTR_NODEV, 0},
+	{"dev", 0, MOUNT_ATTR_NODEV},
+	{"noexec", MOUNT_ATTR_NOEXEC, 0},
+	{"exec", 0, MOUNT_ATTR_NOEXEC},
+	{"noatime", MOUNT_ATTR_NOATIME, MOUNT_ATTR__ATIME},
+	{"relatime", MOUNT_ATTR_RELATIME, MOUNT_ATTR__ATIME},
+	{"strictatime", MOUNT_ATTR_STRICTATIME, MOUNT_ATTR__ATIME},
+	{"nodiratime", MOUNT_ATTR_NODIRATIME, 0},
+	{"diratime", 0, MOUNT_ATTR_NODIRATIME},
+	{"defaults", 0, 0}
+};
+
+#define USB_MOUNT_FALLBACK 1
+
+/*
+ * Bytes the watch leaves unreachable in its list's arena before it considers
+ * rebuilding the list.
+ */
+#define WATCH_GARBAGE_MIN 65536
+
+/*
+ * Operations to run at once behind a hub, and on a root bus, by the link
+ * speed in Mbit/s. A mass storage device uses a fraction of its link, so a
+ * couple share a high speed hub before it saturates. A high speed root bus
+ * is a single shared link, while SuperSpeed root ports each have their own.
+ */
+static const struct usb_link_limit {
+	double speed;
+	size_t hub;
+	size_t bus;
+} LINK_LIMITS[] = {
+	{0, 1, 1},
+	{480, 2, 2},
+	{5000, 4, 8},
+	{10000, 6, 12},
+	{20000, 8, 16}
+};
 
-static const char *HEADER_NODE = "NODE";
-static const char *HEADER_MANUFACTURER = "MANUFACTURER";
-static const char *HEADER_PRODUCT = "PRODUCT";
-static const char *HEADER_SIZE = "SIZE";
-static const char *HEADER_LABEL = "LABEL";
-static const char *HEADER_TYPE = "TYPE";
-static const char *HEADER_BUS = "BUS";
-static const char *HEADER_DEV_PATH = "DEV_PATH";
-static const char *HEADER_MOUNTED = "MOUNTED";
-static const char *HEADER_SYS_PATH = "SYS_PATH";
-static const char *HEADER_SERIAL = "SERIAL";
-static const char *HEADER_VERSION = "VERSION";
-static const char *HEADER_SPEED = "SPEED";
-static const char *HEADER_PARTITION = "PARTITION";
+/*
+ * Set once fsopen is found to be unavailable, so later mounts go straight to
+ * libmount.
+ */
+static int fs_mount_unavailable = 0;
+
+/*
+ * Mount directories are managed relative to MOUNT_DIR_PREFIX, opened once.
+ * Device directories created or found during this run are remembered, so
+ * that mounting further partitions of a device only creates their own
+ * directory. All of it is guarded by mount_directory_mutex.
+ */
+static pthread_mutex_t mount_directory_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int mount_directory_fd = -1;
+static struct hash_table *mount_directories = NULL;
+
+static const char HEADER_NODE[] = "NODE";
+static const char HEADER_MANUFACTURER[] = "MANUFACTURER";
+static const char HEADER_PRODUCT[] = "PRODUCT";
+static const char HEADER_SIZE[] = "SIZE";
+static const char HEADER_LABEL[] = "LABEL";
+static const char HEADER_UUID[] = "UUID";
+static const char HEADER_TYPE[] = "TYPE";
+static const char HEADER_BUS[] = "BUS";
+static const char HEADER_DEV_PATH[] = "DEV_PATH";
+static const char HEADER_MOUNTED[] = "MOUNTED";
+static const char HEADER_SYS_PATH[] = "SYS_PATH";
+static const char HEADER_SERIAL[] = "SERIAL";
+static const char HEADER_VERSION[] = "VERSION";
+static const char HEADER_SPEED[] = "SPEED";
+static const char HEADER_READ[] = "READ";
+static const char HEADER_WRITE[] = "WRITE";
+static const char HEADER_RANDOM_READ[] = "RANDOM_READ";
+static const char HEADER_PARTITION[] = "PARTITION";
 
 static const char *CELL_NONE = "(none)";
 static const char *CELL_NA = "(n/a)";
@@ -42,16 +287,13 @@ struct usb_partition {
 	int num;
 	char *dev_path;
 	char *label;
+	char *uuid;
 	char *type;
 	char *sys_path;
+	dev_t devnum;
 	size_t size;
 };
 
-struct usb_partition_list {
-	struct usb_partition *partition;
-	struct usb_partition_list *next;
-};
-
 struct usb_device {
 	char *node;
 	char *manufacturer;
@@ -59,145 +301,887 @@ struct usb_device {
 	char *serial;
 	char *dev_path;
 	char *label;
+	char *uuid;
 	char *type;
 	char *sys_path;
 	char *version;
 	char *speed;
 	int bus;
+	int lun;
 	size_t size;
 	size_t max_children;
-	struct usb_partition_list *partition_list;
+	struct usb_partition *partitions;
+	size_t num_partitions;
 };
 
+/*
+ * Devices are stored contiguously, each with its partitions as a contiguous
+ * range. A device list, its devices, their partitions and all of their
+ * strings are allocated from the arena of the list, and released together
+ * with it.
+ */
 struct usb_device_list {
+	struct usb_device *devices;
+	size_t num_devices;
+	size_t size;
+	unsigned int fields;
+	struct arena *arena;
+};
+
+struct usb_udev_index_entry {
+	char *sys_path;
+	size_t device;
+};
+
+/*
+ * A disk, or one of its partitions, whose filesystem is to be probed for
+ * want of udev data. partition is SIZE_MAX for the disk itself.
+ */
+struct usb_probe_target {
+	size_t device;
+	size_t partition;
+	dev_t devnum;
+};
+
+struct usb_probe_target_list {
+	struct usb_probe_target *targets;
+	size_t num_targets;
+	size_t size;
+};
+
+struct usb_index_entry {
+	struct usb_device *device;
+	struct usb_partition *partition;
+	struct usb_index_entry *next;
+	struct usb_index_entry *next_entry;
+};
+
+/*
+ * Lookup index over a device list, mapping every name a device or partition
+ * can be selected by to the devices and partitions it matches. Partitions
+ * are matched by node and dev_path, and devices additionally by serial.
+ * Filesystem labels and UUIDs select whichever of the two carries them.
+ */
+struct usb_index {
+	struct hash_table *table;
+	struct usb_index_entry *entries;
+};
+
+struct usb_filter_term {
+	int field;
+	int op;
+	char *pattern;
+	long long number;
+};
+
+struct usb_filter {
+	struct usb_filter_term *terms;
+	size_t num_terms;
+	unsigned int fields;
+	int partition_terms;
+};
+
+struct usb_mount_entry {
+	dev_t devno;
+	char *source;
+	char *target;
+	struct usb_mount_entry *next_devno;
+	struct usb_mount_entry *next_source;
+	struct usb_mount_entry *below;
+	struct usb_mount_entry *next;
+};
+
+/*
+ * The mounts of mountinfo, read only once something is looked up, since
+ * most mounted checks are settled without it. Until then, adding and
+ * removing mounts is left to that read to pick up.
+ */
+struct usb_mount_table {
+	struct usb_mount_entry *entries;
+	struct hash_table *by_devno;
+	struct hash_table *by_source;
+	struct hash_table *by_target;
+	int loaded;
+	pthread_mutex_t mutex;
+};
+
+struct usb_partition_task {
+	struct usb_partition *partition;
+	struct usb_mount_table *mount_table;
+	char *options;
+	int mounted;
+	int check_failed;
+	int retcode;
+	int errnum;
+};
+
+/*
+ * Concurrency groups of the tasks of a bulk operation, two per task: the root
+ * bus of its device and the hub the device hangs off, the parent of its
+ * dev_path port chain. Each group is limited by the fastest link negotiated
+ * by its devices, which bounds the upstream link they share.
+ */
+struct usb_topology {
+	size_t *groups;
+	size_t *limits;
+	double *speeds;
+	size_t num_groups;
+	size_t size;
+	struct hash_table *keys;
+};
+
+/*
+ * The partitions of one device queued for mounting, checked one after the
+ * other so that a drive is not made to seek between them. Devices are
+ * checked concurrently.
+ */
+struct usb_check_task {
 	struct usb_device *device;
-	struct usb_device_list *next;
+	struct usb_partition_task **tasks;
+	size_t num_tasks;
+	size_t num_checked;
+	double seconds;
+};
+
+struct usb_watch {
+	struct udev *udev;
+	struct udev_monitor *monitor;
+	struct usb_device_list *list;
+	struct hash_table *devices;
+	struct hash_table *partitions;
+	struct usb_mount_table *mount_table;
+	size_t garbage;
+	char *options;
+	int mount;
+	int umount;
+	int verbose;
+};
+
+/*
+ * On-disk inventory cache. The file is a header, followed by the device and
+ * partition records, followed by a table of NUL-terminated strings. Records
+ * refer to strings by offset into that table, so the file can be mapped at
+ * any address and used in place.
+ */
+struct usb_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_devices;
+	uint32_t num_partitions;
+	uint32_t strings_size;
+	uint64_t seqnum;
+};
+
+struct usb_cache_device {
+	uint32_t node;
+	uint32_t manufacturer;
+	uint32_t product;
+	uint32_t serial;
+	uint32_t dev_path;
+	uint32_t label;
+	uint32_t uuid;
+	uint32_t type;
+	uint32_t sys_path;
+	uint32_t version;
+	uint32_t speed;
+	int32_t bus;
+	int32_t lun;
+	uint64_t size;
+	uint64_t max_children;
+	uint32_t first_partition;
+	uint32_t num_partitions;
+};
+
+struct usb_cache_partition {
+	uint32_t node;
+	uint32_t dev_path;
+	uint32_t label;
+	uint32_t uuid;
+	uint32_t type;
+	uint32_t sys_path;
+	int32_t num;
+	uint64_t devnum;
+	uint64_t size;
+};
+
+struct usb_cache_strings {
+	char *data;
+	size_t size;
+	size_t capacity;
+	struct hash_table *offsets;
+};
+
+/*
+ * A device list rendered in place from a mapped cache file. The strings of
+ * every device and partition point into the mapping.
+ */
+struct usb_cache {
+	void *map;
+	size_t map_size;
+	struct usb_device *devices;
+	struct usb_partition *partitions;
+	struct usb_device_list list;
+};
+
+enum usb_table_column {
+	TABLE_NODE,
+	TABLE_DEV_PATH,
+	TABLE_MOUNTED,
+	TABLE_SIZE,
+	TABLE_LABEL,
+	TABLE_TYPE,
+	TABLE_MANUFACTURER,
+	TABLE_PRODUCT,
+	TABLE_UUID,
+	TABLE_SERIAL,
+	TABLE_BUS,
+	TABLE_SYS_PATH,
+	TABLE_VERSION,
+	TABLE_SPEED,
+	TABLE_READ,
+	TABLE_WRITE,
+	TABLE_RANDOM_READ,
+	TABLE_NUM_COLUMNS
+};
+
+#define TABLE_MAX_COLUMNS 32
+
+/*
+ * Selectable table columns, named by their headers, with the fields each
+ * needs loaded. Columns describing only devices show (n/a) on partitions.
+ * Throughput columns are only shown by bench, and cannot be selected.
+ */
+static const struct usb_table_column_info {
+	const char *name;
+	unsigned int fields;
+	int device_only;
+	int throughput;
+} TABLE_COLUMNS[TABLE_NUM_COLUMNS] = {
+	[TABLE_NODE] = {HEADER_NODE, 0, 0},
+	[TABLE_DEV_PATH] = {HEADER_DEV_PATH, 0, 0},
+	[TABLE_MOUNTED] = {HEADER_MOUNTED, FIELD_MOUNTS, 0},
+	[TABLE_SIZE] = {HEADER_SIZE, FIELD_SIZE, 0},
+	[TABLE_LABEL] = {HEADER_LABEL, FIELD_FS, 0},
+	[TABLE_TYPE] = {HEADER_TYPE, FIELD_FS, 0},
+	[TABLE_MANUFACTURER] = {HEADER_MANUFACTURER, FIELD_MANUFACTURER, 1},
+	[TABLE_PRODUCT] = {HEADER_PRODUCT, FIELD_PRODUCT, 1},
+	[TABLE_UUID] = {HEADER_UUID, FIELD_FS, 0},
+	[TABLE_SERIAL] = {HEADER_SERIAL, FIELD_SERIAL, 1},
+	[TABLE_BUS] = {HEADER_BUS, FIELD_BUS, 1},
+	[TABLE_SYS_PATH] = {HEADER_SYS_PATH, 0, 0},
+	[TABLE_VERSION] = {HEADER_VERSION, FIELD_VERSION, 1},
+	[TABLE_SPEED] = {HEADER_SPEED, FIELD_SPEED, 1},
+	[TABLE_READ] = {HEADER_READ, 0, 1, 1},
+	[TABLE_WRITE] = {HEADER_WRITE, 0, 1, 1},
+	[TABLE_RANDOM_READ] = {HEADER_RANDOM_READ, 0, 1, 1}
+};
+
+static const int TABLE_DEFAULT_COLUMNS[] = {
+	TABLE_NODE,
+	TABLE_DEV_PATH,
+	TABLE_MOUNTED,
+	TABLE_SIZE,
+	TABLE_LABEL,
+	TABLE_TYPE,
+	TABLE_MANUFACTURER,
+	TABLE_PRODUCT
 };
 
-static struct usb_device *usb_device_new();
-static void usb_device_free(struct usb_device *device);
+static const int TABLE_THROUGHPUT_COLUMNS[] = {
+	TABLE_NODE,
+	TABLE_DEV_PATH,
+	TABLE_SIZE,
+	TABLE_MANUFACTURER,
+	TABLE_PRODUCT,
+	TABLE_SPEED,
+	TABLE_READ,
+	TABLE_WRITE,
+	TABLE_RANDOM_READ
+};
+
+/*
+ * A row of the table, one per device and partition. Partition rows carry the
+ * tree indicator drawn in front of each of their cells.
+ */
+struct usb_table_row {
+	const char *indicator;
+	const char **cells;
+};
+
+struct usb_table {
+	struct usb_table_row *rows;
+	size_t num_rows;
+	int columns[TABLE_MAX_COLUMNS];
+	size_t widths[TABLE_MAX_COLUMNS];
+	size_t num_columns;
+	int human_readable_mode;
+	struct hash_table *sizes;
+	struct usb_device *devices;
+	const struct throughput_request *throughput;
+	struct arena *arena;
+};
+
+struct usb_partition_task_list {
+	struct usb_partition_task *tasks;
+	size_t num_tasks;
+	size_t size;
+	struct hash_table *queued;
+};
+
+/*
+ * Where device lists are enumerated from. Every source builds the same model
+ * and honours the same fields and filter push down as usb_device_list_get.
+ */
+struct usb_source {
+	struct usb_device_list *(*list_get)(const struct usb_source *source,
+	                                    unsigned int fields,
+	                                    const struct usb_filter *filter);
+	size_t num_devices;
+	size_t num_partitions;
+	const char *root;
+};
+
+/*
+ * Directories held open by the sysfs source, which every attribute and udev
+ * database file is opened relative to. udev_fd is -1 without a udev
+ * database, in which case no device counts as processed by udev.
+ */
+struct usb_sysfs {
+	int sys_fd;
+	int udev_fd;
+	char value[4096];
+	char data[16384];
+};
+
+/*
+ * A block device linked from /sys/class/block, with its path relative to
+ * /sys and what its uevent file tells of it.
+ */
+struct usb_sysfs_entry {
+	char *path;
+	char *node;
+	dev_t devnum;
+	int is_partition;
+	int is_initialized;
+};
+
+/*
+ * Filesystem properties of a block device from its udev database file.
+ */
+struct usb_sysfs_fs {
+	const char *label;
+	const char *uuid;
+	const char *type;
+};
 
-static struct usb_partition *usb_partition_new();
-static void usb_partition_free(struct usb_partition *partition);
+struct usb_sysfs_dirent {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
 
-static struct usb_device_list *usb_device_list_new();
-static struct usb_device_list *usb_device_list_get();
-static void usb_device_list_add(struct usb_device_list *list, struct usb_device *device);
+static struct usb_partition *usb_device_add_partition(struct arena *arena,
+                                                     struct usb_device *device,
+                                                     const struct usb_partition *partition);
+static void usb_device_remove_partition(struct usb_device *device,
+                                        struct usb_partition *partition);
+
+static struct usb_device_list *usb_device_list_new(struct arena *arena);
+static struct usb_device_list *usb_device_list_copy(struct usb_device_list *list);
+static struct usb_device_list *usb_device_list_get(unsigned int fields,
+                                                  const struct usb_filter *filter);
+static struct usb_device *usb_device_list_add(struct usb_device_list *list,
+                                              const struct usb_device *device);
+static struct usb_device *usb_device_list_remove(struct usb_device_list *list,
+                                                 struct usb_device *device);
 static void usb_device_list_free(struct usb_device_list *list);
-static char *usb_device_list_detail_str(struct usb_device_list *list, int human_readable);
-static char *usb_device_list_table_str(struct usb_device_list *list, int human_readable);
+static struct usb_device_list *usb_device_list_select(struct usb_device_list *list,
+                                                     char *usb_paths[],
+                                                     int num_usb_paths,
+                                                     int *ret_code);
+static void usb_device_list_print_detail(FILE *stream,
+                                         struct usb_device_list *list,
+                                         struct usb_mount_table *mount_table,
+                                         int human_readable);
+static void usb_device_list_print_table(FILE *stream,
+                                        struct usb_device_list *list,
+                                        struct usb_mount_table *mount_table,
+                                        int human_readable,
+                                        const int *columns,
+                                        size_t num_columns);
+static void usb_device_list_print_json(FILE *stream,
+                                       struct usb_device_list *list,
+                                       struct usb_mount_table *mount_table,
+                                       int ndjson);
+static void usb_device_list_print_csv(FILE *stream,
+                                      struct usb_device_list *list,
+                                      struct usb_mount_table *mount_table);
+static char *usb_device_list_render(struct usb_device_list *list,
+                                    struct usb_mount_table *mount_table,
+                                    int verbose,
+                                    int human_readable,
+                                    int output,
+                                    const int *columns,
+                                    size_t num_columns,
+                                    size_t *size);
 static char *usb_device_list_table_label_formatter(const char *str);
 static char *usb_device_list_table_type_formatter(const char *str);
 
-static struct usb_partition_list *usb_partition_list_new();
-static void usb_partition_list_add(struct usb_partition_list *list,
-                                   struct usb_partition *partition);
-static void usb_partition_list_free(struct usb_partition_list *list);
-
-static size_t usb_device_and_partition_list_size(struct usb_device_list *list);
 static char *usb_get_partition_mount_directory(struct usb_partition *partition);
-static int usb_create_partition_mount_directory(char *mount_path);
-static int usb_delete_partition_mount_directory(char *mount_path);
-static int usb_mount_device(struct usb_device *device, char *options);
-static int usb_mount_partition(struct usb_partition *partition, char *options);
-static int usb_umount_device(struct usb_device *device);
-static int usb_umount_partition(struct usb_partition *partition);
-
-static size_t usb_device_list_table_max_width_dev_path(struct usb_device_list *list);
-static size_t usb_device_list_table_max_width_label(struct usb_device_list *list);
-static size_t usb_device_list_table_max_width_manufacturer(struct usb_device_list *list);
-static size_t usb_device_list_table_max_width_node(struct usb_device_list *list);
-static size_t usb_device_list_table_max_width_product(struct usb_device_list *list);
-static size_t usb_device_list_table_max_width_size(struct usb_device_list *list,
-                                                   int human_readable_mode);
-static size_t usb_device_list_table_max_width_type(struct usb_device_list *list);
-
-static struct udev_device *usb_udev_device_get_child(struct udev *udev,
-                                                     struct udev_device *parent_device,
-                                                     const char *subsystem);
+static int usb_mount_directory_open(void);
+static int usb_create_partition_mount_directory(struct usb_partition *partition);
+static int usb_delete_partition_mount_directory(struct usb_partition *partition);
+static int usb_partition_is_mounted(struct usb_mount_table *mount_table,
+                                    struct usb_partition *partition);
+static int usb_mount_path_is_mounted(struct usb_mount_table *mount_table,
+                                     struct usb_partition *partition,
+                                     const char *mount_path);
+static int usb_mount_partition(struct usb_partition *partition,
+                               struct usb_mount_table *mount_table,
+                               char *options);
+static int usb_fs_mount_partition(struct usb_partition *partition,
+                                  const char *mount_path,
+                                  const char *options);
+static int usb_fs_mount_options(int fs_fd, const char *options, unsigned int *attrs);
+static void usb_fs_mount_log(int fs_fd, struct usb_partition *partition);
+static int usb_mnt_mount_partition(struct usb_partition *partition,
+                                   const char *mount_path,
+                                   char *options);
+static int usb_umount_partition(struct usb_partition *partition,
+                                struct usb_mount_table *mount_table,
+                                int mounted);
+static int usb_detach_partition(struct usb_partition *partition,
+                                struct usb_mount_table *mount_table);
+
+static void usb_partition_task_list_init(struct usb_partition_task_list *list);
+static void usb_partition_task_list_free(struct usb_partition_task_list *list);
+static void usb_partition_task_list_add(struct usb_partition_task_list *list,
+                                        struct usb_partition *partition,
+                                        struct usb_mount_table *mount_table,
+                                        char *options);
+static void usb_partition_task_list_add_device(struct usb_partition_task_list *list,
+                                               struct usb_device *device,
+                                               struct usb_mount_table *mount_table,
+                                               char *options);
+static void usb_mount_task_run(void *task);
+static int usb_mount_task_list_run(struct usb_partition_task_list *list, size_t jobs);
+static void usb_check_task_run(void *task);
+static struct usb_topology *usb_topology_new(size_t num_tasks);
+static void usb_topology_set(struct usb_topology *topology, size_t task, struct usb_device *device);
+static size_t usb_topology_group(struct usb_topology *topology, const char *key, double speed);
+static void usb_topology_run(struct usb_topology *topology,
+                             void *tasks,
+                             size_t task_size,
+                             size_t num_tasks,
+                             size_t jobs,
+                             void (*run)(void *task));
+static void usb_topology_free(struct usb_topology *topology);
+static void usb_check_task_list_run(struct usb_partition_task_list *list, size_t jobs);
+static void usb_umount_task_run(void *task);
+static int usb_umount_task_list_run(struct usb_partition_task_list *list, size_t jobs);
+
+static struct usb_mount_table *usb_watch_mount_table(struct usb_watch *watch);
+static struct usb_device *usb_watch_parent_device(struct usb_watch *watch,
+                                                  struct udev_device *partition_device);
+static void usb_watch_add_device(struct usb_watch *watch, struct usb_device *device);
+static void usb_watch_add_partition(struct usb_watch *watch, struct usb_partition *partition);
+static void usb_watch_remove_device(struct usb_watch *watch, struct usb_device *device);
+static void usb_watch_remove_partition(struct usb_watch *watch, struct usb_partition *partition);
+static void usb_watch_mount_partition(struct usb_watch *watch, struct usb_partition *partition);
+static void usb_watch_update_fs(struct usb_watch *watch,
+                                char **label,
+                                char **uuid,
+                                char **type,
+                                struct udev_device *block_device);
+static struct usb_device *usb_watch_new_device(struct usb_watch *watch,
+                                               struct udev_device *block_device);
+static void usb_watch_index_device(struct usb_watch *watch, struct usb_device *device);
+static void usb_watch_reindex(struct usb_watch *watch);
+static void usb_watch_compact(struct usb_watch *watch);
+static void usb_watch_event(struct usb_watch *watch, struct udev_device *block_device);
+
+static struct usb_device_list *usb_device_list_get_cached(const char *cache_path,
+                                                         unsigned int fields,
+                                                         const struct usb_filter *filter,
+                                                         struct usb_cache **cache);
+static void usb_device_list_release(struct usb_device_list *list, struct usb_cache *cache);
+static unsigned long long usb_uevent_seqnum();
+static struct usb_cache *usb_cache_load(const char *cache_path, unsigned long long seqnum);
+static void usb_cache_store(const char *cache_path,
+                            struct usb_device_list *list,
+                            unsigned long long seqnum);
+static void usb_cache_free(struct usb_cache *cache);
+static uint32_t usb_cache_strings_add(struct usb_cache_strings *strings, const char *str);
+
+static struct usb_index *usb_index_new(struct usb_device_list *list);
+static void usb_index_free(struct usb_index *index);
+static void usb_index_add(struct usb_index *index,
+                          const char *selector,
+                          const char *value,
+                          struct usb_device *device,
+                          struct usb_partition *partition);
+static struct usb_index_entry *usb_index_find(struct usb_index *index, const char *usb_path);
+static unsigned int usb_index_fields(char *usb_paths[], int num_usb_paths);
+
+static int usb_filter_term_parse(struct usb_filter_term *term, const char *str);
+static int usb_filter_term_match(const struct usb_filter_term *term,
+                                 const char *str,
+                                 long long number);
+static int usb_filter_match_device(const struct usb_filter *filter, const struct usb_device *device);
+static int usb_filter_match_partition(const struct usb_filter *filter,
+                                      struct usb_partition *partition,
+                                      struct usb_mount_table *mount_table);
+static void usb_device_list_filter(struct usb_device_list *list,
+                                   const struct usb_filter *filter,
+                                   struct usb_mount_table *mount_table);
+static void usb_filter_push_down(const struct usb_filter *filter, struct udev_enumerate *enumerate);
+static int usb_partition_task_list_add_paths(struct usb_partition_task_list *list,
+                                             struct usb_index *index,
+                                             char *usb_paths[],
+                                             int num_usb_paths,
+                                             struct usb_mount_table *mount_table,
+                                             char *options);
+
+static struct usb_mount_table *usb_mount_table_get();
+static void usb_mount_table_free(struct usb_mount_table *mount_table);
+static void usb_mount_table_load(struct usb_mount_table *mount_table);
+static void usb_mount_table_add(struct usb_mount_table *mount_table,
+                                struct usb_partition *partition,
+                                const char *target);
+static void usb_mount_table_insert(struct usb_mount_table *mount_table,
+                                   dev_t devno,
+                                   const char *source,
+                                   const char *target);
+static void usb_mount_table_remove(struct usb_mount_table *mount_table, const char *target);
+static void usb_mount_table_unlink(struct hash_table *index,
+                                   const void *key,
+                                   size_t key_size,
+                                   struct usb_mount_entry *entry,
+                                   int by_source);
+static int usb_mount_table_is_mounted(struct usb_mount_table *mount_table,
+                                      struct usb_partition *partition,
+                                      const char *target);
+static int usb_mount_table_is_device_mounted(struct usb_mount_table *mount_table,
+                                             struct usb_partition *partition);
+static const char *usb_mount_table_target(struct usb_mount_table *mount_table,
+                                          struct usb_partition *partition);
+static struct usb_mount_entry *usb_mount_table_find(struct usb_mount_table *mount_table,
+                                                    struct usb_partition *partition);
+static int usb_mount_entry_matches(struct usb_mount_entry *entry, struct usb_partition *partition);
+
+static struct usb_table *usb_table_new(struct usb_device_list *list,
+                                       struct usb_mount_table *mount_table,
+                                       int human_readable_mode,
+                                       const int *columns,
+                                       size_t num_columns,
+                                       const struct throughput_request *throughput);
+static void usb_table_free(struct usb_table *table);
+static void usb_table_print(FILE *stream, struct usb_table *table);
+static void usb_json_print_string(FILE *stream, const char *str);
+static void usb_json_print_device(FILE *stream,
+                                  struct usb_device *device,
+                                  struct usb_mount_table *mount_table);
+static void usb_csv_print_string(FILE *stream, const char *str);
+static void usb_table_measure(struct usb_table *table,
+                              size_t index,
+                              const char *str,
+                              size_t indent);
+static const char *usb_table_device_cell(struct usb_table *table,
+                                         size_t index,
+                                         struct usb_device *device);
+static const char *usb_table_partition_cell(struct usb_table *table,
+                                            size_t index,
+                                            struct usb_partition *partition,
+                                            struct usb_mount_table *mount_table);
+static const char *usb_table_size_cell(struct usb_table *table, size_t size);
+static const char *usb_table_number_cell(struct usb_table *table, int number);
+static const char *usb_table_rate_cell(struct usb_table *table, double rate, const char *format);
+static int usb_table_columns_parse(const char *str, int *columns);
+static unsigned int usb_print_columns(const char *columns_str,
+                                      int verbose,
+                                      int output,
+                                      int *columns,
+                                      size_t *num_columns);
+
+static void usb_device_init_from_udev(struct arena *arena,
+                                      struct usb_device *device,
+                                      struct udev_device *usb_device,
+                                      struct udev_device *block_device,
+                                      int lun,
+                                      unsigned int fields);
+static void usb_partition_init_from_udev(struct arena *arena,
+                                         struct usb_partition *partition,
+                                         struct usb_device *device,
+                                         struct udev_device *partition_device,
+                                         unsigned int fields);
+static const char *usb_udev_sysattr(struct udev_device *udev_device,
+                                    const char *name,
+                                    unsigned int fields,
+                                    unsigned int field);
+static long usb_udev_sysattr_number(struct udev_device *udev_device,
+                                    const char *name,
+                                    unsigned int fields,
+                                    unsigned int field);
+static const char *usb_udev_property(struct udev_device *udev_device,
+                                     const char *name,
+                                     unsigned int fields,
+                                     unsigned int field);
+static void usb_probe_target_list_add(struct usb_probe_target_list *list,
+                                      dev_t devnum,
+                                      size_t device,
+                                      size_t partition);
+static void usb_device_list_probe(struct usb_device_list *list,
+                                  struct usb_probe_target_list *targets);
+static int usb_udev_index_compare(const void *a, const void *b);
+static struct usb_udev_index_entry *usb_udev_index_find(struct usb_udev_index_entry *index,
+                                                       size_t num_entries,
+                                                       const char *sys_path);
+static int usb_udev_scsi_lun(struct udev_device *scsi_device);
+static struct usb_device *usb_device_list_add_from_block(struct usb_device_list *list,
+                                                         struct udev_device *block_device,
+                                                         const struct usb_filter *filter);
+static struct usb_device_list *usb_udev_device_list_get(const struct usb_source *source,
+                                                       unsigned int fields,
+                                                       const struct usb_filter *filter);
+static struct usb_device_list *usb_fixture_device_list_get(const struct usb_source *source,
+                                                          unsigned int fields,
+                                                          const struct usb_filter *filter);
+static struct usb_device_list *usb_sysfs_device_list_get(const struct usb_source *source,
+                                                        unsigned int fields,
+                                                        const struct usb_filter *filter);
+static int usb_sysfs_entry_init(struct usb_sysfs *sysfs,
+                                struct arena *arena,
+                                struct usb_sysfs_entry *entry);
+static int usb_sysfs_entry_compare(const void *a, const void *b);
+static struct usb_device *usb_device_list_add_from_sysfs(struct usb_device_list *list,
+                                                         struct usb_sysfs *sysfs,
+                                                         struct usb_sysfs_entry *entry,
+                                                         const struct usb_filter *filter);
+static void usb_device_init_from_sysfs(struct arena *arena,
+                                       struct usb_sysfs *sysfs,
+                                       struct usb_device *device,
+                                       const char *usb_dir,
+                                       struct usb_sysfs_entry *entry,
+                                       int lun,
+                                       unsigned int fields);
+static void usb_partition_init_from_sysfs(struct arena *arena,
+                                          struct usb_sysfs *sysfs,
+                                          struct usb_partition *partition,
+                                          struct usb_device *device,
+                                          struct usb_sysfs_entry *entry,
+                                          unsigned int fields);
+static int usb_sysfs_read(int dir_fd, const char *path, char *buf, size_t size);
+static const char *usb_sysfs_attr_value(struct usb_sysfs *sysfs, const char *dir, const char *name);
+static const char *usb_sysfs_attr(struct usb_sysfs *sysfs,
+                                  const char *dir,
+                                  const char *name,
+                                  unsigned int fields,
+                                  unsigned int field);
+static long usb_sysfs_attr_number(struct usb_sysfs *sysfs,
+                                  const char *dir,
+                                  const char *name,
+                                  unsigned int fields,
+                                  unsigned int field);
+static int usb_sysfs_link_is(struct usb_sysfs *sysfs,
+                             const char *dir,
+                             const char *name,
+                             const char *target);
+static int usb_sysfs_udev_data(struct usb_sysfs *sysfs, dev_t devnum, struct usb_sysfs_fs *fs);
+static const char *usb_sysfs_value(const char *line, const char *key);
+static double usb_seconds_since(const struct timespec *start);
+
+static struct usb_source device_source = {usb_sysfs_device_list_get, 0, 0, "/"};
+
+static char *usb_strdup(struct arena *arena, const char *str);
+static char *usb_intern(struct arena *arena, const char *str);
 
 static char *human_readable_size(size_t num_bytes, int human_readable_mode);
 static char *trim(char *str);
 
-int usb_print(char *usb_path, int verbose, int human_readable)
+int usb_print(char *usb_path,
+              struct usb_filter *filter,
+              int verbose,
+              int human_readable,
+              int output,
+              const char *columns,
+              const char *cache_path)
 {
 	char *usb_paths[1] = {usb_path};
 
-	return usb_print_multiple(usb_paths, 1, verbose, human_readable);
+	return usb_print_multiple(usb_paths,
+	                          1,
+	                          filter,
+	                          verbose,
+	                          human_readable,
+	                          output,
+	                          columns,
+	                          cache_path);
 }
 
-int usb_print_multiple(char *usb_paths[], int num_usb_paths, int verbose, int human_readable)
+int usb_print_multiple(char *usb_paths[],
+                       int num_usb_paths,
+                       struct usb_filter *filter,
+                       int verbose,
+                       int human_readable,
+                       int output,
+                       const char *columns_str,
+                       const char *cache_path)
 {
 	int ret_code = 0;
-	struct usb_device_list *head = usb_device_list_get();
-	struct usb_device_list *list_to_print = usb_device_list_new();
-	struct usb_device_list *list = NULL;
+	int columns[TABLE_MAX_COLUMNS];
+	size_t num_columns = 0;
+	unsigned int fields = usb_print_columns(columns_str, verbose, output, columns, &num_columns)
+	                    | usb_index_fields(usb_paths, num_usb_paths)
+	                    | (filter ? filter->fields : 0);
+	struct usb_cache *cache = NULL;
+	struct usb_device_list *head = usb_device_list_get_cached(cache_path, fields, filter, &cache);
+	struct usb_mount_table *mount_table = fields & FIELD_MOUNTS ? usb_mount_table_get() : NULL;
+	struct usb_device_list *list_to_print = NULL;
+	size_t print_size = 0;
 	char *print_str = NULL;
 
-	for (int i = 0; i < num_usb_paths; i++) {
-		list = head;
-
-		while (list && list->device) {
-			if (strcmp(list->device->dev_path, usb_paths[i]) == 0 ||
-			    strcmp(list->device->node, usb_paths[i]) == 0) {
-				usb_device_list_add(list_to_print, list->device);
+	if (filter)
+		usb_device_list_filter(head, filter, mount_table);
 
-				break;
-			}
+	list_to_print = usb_device_list_select(head, usb_paths, num_usb_paths, &ret_code);
 
-			struct usb_partition_list *partition_list = list->device->partition_list;
+	print_str = usb_device_list_render(list_to_print,
+	                                   mount_table,
+	                                   verbose,
+	                                   human_readable,
+	                                   output,
+	                                   columns,
+	                                   num_columns,
+	                                   &print_size);
 
-			while (partition_list && partition_list->partition) {
-				if (strcmp(partition_list->partition->dev_path, usb_paths[i]) == 0 ||
-				    strcmp(partition_list->partition->node, usb_paths[i]) == 0) {
-					usb_device_list_add(list_to_print, list->device);
+	usb_mount_table_free(mount_table);
+	usb_device_list_free(list_to_print);
+	usb_device_list_release(head, cache);
 
-					break;
-				}
+	fwrite(print_str, 1, print_size, stdout);
 
-				partition_list = partition_list->next;
-			}
+	free(print_str);
 
-			if (partition_list)
-				break;
+	return ret_code;
+}
 
-			list = list->next;
-		}
-	}
+int usb_print_all(struct usb_filter *filter,
+                  int verbose,
+                  int human_readable,
+                  int output,
+                  const char *columns_str,
+                  const char *cache_path)
+{
+	int columns[TABLE_MAX_COLUMNS];
+	size_t num_columns = 0;
+	unsigned int fields = usb_print_columns(columns_str, verbose, output, columns, &num_columns)
+	                    | (filter ? filter->fields : 0);
+	struct usb_cache *cache = NULL;
+	struct usb_device_list *list = usb_device_list_get_cached(cache_path, fields, filter, &cache);
+	struct usb_mount_table *mount_table = fields & FIELD_MOUNTS ? usb_mount_table_get() : NULL;
+	size_t print_size = 0;
+	char *print_str = NULL;
 
-	if (verbose)
-		print_str = usb_device_list_detail_str(list_to_print, human_readable);
+	if (filter)
+		usb_device_list_filter(list, filter, mount_table);
 
-	else
-		print_str = usb_device_list_table_str(list_to_print, human_readable);
+	print_str = usb_device_list_render(list,
+	                                         mount_table,
+	                                         verbose,
+	                                         human_readable,
+	                                         output,
+	                                         columns,
+	                                         num_columns,
+	                                         &print_size);
 
-	usb_device_list_free(head);
+	usb_mount_table_free(mount_table);
+	usb_device_list_release(list, cache);
 
-	printf(print_str);
+	fwrite(print_str, 1, print_size, stdout);
 
 	free(print_str);
 
-	return ret_code;
+	return 0;
 }
 
-int usb_print_all(int verbose, int human_readable)
+/*
+ * Measure the throughput of the devices given by usb_paths, or of all of them
+ * if usb_paths is NULL, and print it next to their inventory. With write, the
+ * first mounted partition of each device is written to as well.
+ */
+int usb_throughput(char *usb_paths[],
+                   int num_usb_paths,
+                   struct usb_filter *filter,
+                   int human_readable,
+                   int write,
+                   size_t size,
+                   unsigned int queue_depth)
 {
-	struct usb_device_list *list = usb_device_list_get();
-	char *print_str = NULL;
+	int ret_code = 0;
+	size_t num_columns = sizeof(TABLE_THROUGHPUT_COLUMNS) / sizeof(TABLE_THROUGHPUT_COLUMNS[0]);
+	unsigned int fields = FIELD_SIZE | FIELD_MANUFACTURER | FIELD_PRODUCT | FIELD_SPEED | FIELD_MOUNTS
+	                    | usb_index_fields(usb_paths, num_usb_paths)
+	                    | (filter ? filter->fields : 0);
+	struct usb_device_list *head = usb_device_list_get(fields, filter);
+	struct usb_mount_table *mount_table = usb_mount_table_get();
+	struct usb_device_list *list = head;
 
-	if (verbose)
-		print_str = usb_device_list_detail_str(list, human_readable);
+	if (filter)
+		usb_device_list_filter(head, filter, mount_table);
 
-	else
-		print_str = usb_device_list_table_str(list, human_readable);
+	if (usb_paths)
+		list = usb_device_list_select(head, usb_paths, num_usb_paths, &ret_code);
 
-	usb_device_list_free(list);
+	struct throughput_request *requests = calloc(list->num_devices + 1, sizeof(struct throughput_request));
 
-	printf(print_str);
+	if (!requests)
+		err(EXIT_FAILURE, NULL);
 
-	free(print_str);
+	for (size_t i = 0; i < list->num_devices; i++) {
+		struct usb_device *device = &list->devices[i];
 
-	return 0;
+		requests[i].node = device->node;
+
+		for (size_t j = 0; write && j < device->num_partitions && !requests[i].scratch_dir; j++)
+			requests[i].scratch_dir = usb_mount_table_target(mount_table, &device->partitions[j]);
+
+		if (write && !requests[i].scratch_dir)
+			warnx("Not writing to %s: No partition is mounted", device->node);
+	}
+
+	throughput_run(requests, list->num_devices, size, queue_depth);
+
+	for (size_t i = 0; i < list->num_devices; i++) {
+		if (requests[i].errnum) {
+			errno = requests[i].errnum;
+
+			warn("Measuring %s failed", requests[i].node);
+
+			ret_code = requests[i].errnum;
+		}
+	}
+
+	struct usb_table *table = usb_table_new(list,
+	                                        mount_table,
+	                                        human_readable,
+	                                        TABLE_THROUGHPUT_COLUMNS,
+	                                        num_columns,
+	                                        requests);
+
+	usb_table_print(stdout, table);
+	usb_table_free(table);
+
+	free(requests);
+
+	if (list != head)
+		usb_device_list_free(list);
+
+	usb_device_list_free(head);
+	usb_mount_table_free(mount_table);
+
+	return ret_code;
 }
 
 static char *usb_get_partition_mount_directory(struct usb_partition *partition)
@@ -218,228 +1202,670 @@ static char *usb_get_partition_mount_directory(struct usb_partition *partition)
 	return mount_path;
 }
 
-static int usb_create_partition_mount_directory(char *mount_path)
+/*
+ * Open MOUNT_DIR_PREFIX, creating it if needed, unless already open. Called
+ * with mount_directory_mutex held.
+ */
+static int usb_mount_directory_open(void)
 {
-	size_t size = strlen(mount_path);
-	int retcode = 0;
-
-	for (int i = 1; i < size; i++) {
-		if (mount_path[i] == '/' || i == (size - 1)) {
-			if (mount_path[i] == '/')
-				mount_path[i] = '\0';
+	if (mount_directory_fd != -1)
+		return 0;
 
-			mode_t mode = umask(0);
-			umask(mode);
+	mount_directory_fd = open(MOUNT_DIR_PREFIX, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-			if ((retcode = mkdir(mount_path, 0777 - mode))) {
-				if (errno == EEXIST) {
-					errno = 0;
-					retcode = 0;
-				} else {
-					return retcode;
-				}
-			}
+	if (mount_directory_fd == -1 && errno == ENOENT) {
+		if (mkdir(MOUNT_DIR_PREFIX, 0777) && errno != EEXIST)
+			return -1;
 
-			if (mount_path[i] == '\0')
-				mount_path[i] = '/';
-		}
+		mount_directory_fd = open(MOUNT_DIR_PREFIX, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 	}
 
-	return retcode;
+	if (mount_directory_fd == -1)
+		return -1;
+
+	mount_directories = hash_table_new(0);
+	errno = 0;
+
+	return 0;
 }
 
-static int usb_delete_partition_mount_directory(char *mount_path)
+/*
+ * Create the partition mount directory and its device directory. Another
+ * invocation may remove the device directory once its last partition is
+ * unmounted, even after it was seen here, so a partition directory failing
+ * with ENOENT has its device directory created again.
+ */
+static int usb_create_partition_mount_directory(struct usb_partition *partition)
 {
-	int size = strlen(mount_path);
+	char device_dir[PATH_MAX];
+	char partition_dir[PATH_MAX];
 	int retcode = 0;
 
-	for (int i = size - 1; i >= 0; i--) {
-		if (mount_path[i] == '/' || i == (size - 1)) {
-			if (mount_path[i] == '/') {
-				mount_path[i] = '\0';
-			}
+	uint64_t start = timing_start();
+
+	snprintf(device_dir, sizeof(device_dir), "usb%s", partition->device->dev_path);
+	snprintf(partition_dir, sizeof(partition_dir), "%s/partition%d", device_dir, partition->num);
+
+	pthread_mutex_lock(&mount_directory_mutex);
+
+	if ((retcode = usb_mount_directory_open())) {
+		pthread_mutex_unlock(&mount_directory_mutex);
 
-			if (strcmp(mount_path, MOUNT_DIR_PREFIX) == 0) {
-				mount_path[i] = '/';
+		return retcode;
+	}
 
+	for (int attempt = 0; attempt < 2; attempt++) {
+		size_t device_dir_size = strlen(device_dir);
+
+		if (!hash_table_get(mount_directories, device_dir, device_dir_size)) {
+			if ((retcode = mkdirat(mount_directory_fd, device_dir, 0777)) && errno != EEXIST)
 				break;
-			}
 
-			if ((retcode = rmdir(mount_path))) {
-				if (errno == ENOENT || errno == ENOTEMPTY) {
-					errno = 0;
-					retcode = 0;
-				} else {
-					return retcode;
-				}
-			}
+			hash_table_put(mount_directories, device_dir, device_dir_size, mount_directories);
+		}
+
+		if (!(retcode = mkdirat(mount_directory_fd, partition_dir, 0777)) || errno == EEXIST) {
+			errno = 0;
+			retcode = 0;
 
-			if (mount_path[i] == '\0')
-				mount_path[i] = '/';
+			break;
 		}
+
+		if (errno != ENOENT)
+			break;
+
+		hash_table_remove(mount_directories, device_dir, device_dir_size);
 	}
 
+	pthread_mutex_unlock(&mount_directory_mutex);
+
+	timing_stop(start, "mkdir", partition->node);
+
 	return retcode;
 }
 
-static int usb_partition_is_mounted(struct usb_partition *partition)
+/*
+ * Remove the partition mount directory and the device directory if left
+ * empty. Sibling partitions of the same device share the device directory,
+ * so the teardown is serialised to let the last sibling to finish remove it.
+ */
+static int usb_delete_partition_mount_directory(struct usb_partition *partition)
 {
-	char *mount_path = usb_get_partition_mount_directory(partition);
-	struct libmnt_context *context = mnt_new_context();
+	char device_dir[PATH_MAX];
+	char partition_dir[PATH_MAX];
+	int retcode = 0;
 
-	if (!context)
-		err(EXIT_FAILURE, NULL);
+	uint64_t start = timing_start();
 
-	if (mnt_context_set_source(context, partition->node)) {
-		free(mount_path);
+	snprintf(device_dir, sizeof(device_dir), "usb%s", partition->device->dev_path);
+	snprintf(partition_dir, sizeof(partition_dir), "%s/partition%d", device_dir, partition->num);
 
-		mnt_free_context(context);
+	pthread_mutex_lock(&mount_directory_mutex);
 
-		return 0;
+	if ((retcode = usb_mount_directory_open())) {
+		pthread_mutex_unlock(&mount_directory_mutex);
+
+		return retcode;
 	}
 
-	if (mnt_context_set_target(context, mount_path)) {
-		free(mount_path);
+	if ((retcode = unlinkat(mount_directory_fd, partition_dir, AT_REMOVEDIR))
+	    && errno != ENOENT && errno != ENOTEMPTY) {
+		pthread_mutex_unlock(&mount_directory_mutex);
 
-		mnt_free_context(context);
+		return retcode;
+	}
 
-		return 0;
+	if (!(retcode = unlinkat(mount_directory_fd, device_dir, AT_REMOVEDIR)))
+		hash_table_remove(mount_directories, device_dir, strlen(device_dir));
+
+	else if (errno == ENOENT || errno == ENOTEMPTY) {
+		errno = 0;
+		retcode = 0;
 	}
 
-	struct libmnt_fs *fs = mnt_context_get_fs(context);
-	int mounted = 0;
+	pthread_mutex_unlock(&mount_directory_mutex);
 
-	if (mnt_context_is_fs_mounted(context, fs, &mounted))
-		mounted = 0;
+	timing_stop(start, "rmdir", partition->node);
 
-	free(mount_path);
+	return retcode;
+}
 
-	mnt_free_context(context);
+static int usb_partition_is_mounted(struct usb_mount_table *mount_table,
+                                    struct usb_partition *partition)
+{
+	char *mount_path = usb_get_partition_mount_directory(partition);
+	int mounted = usb_mount_path_is_mounted(mount_table, partition, mount_path);
+
+	free(mount_path);
 
 	return mounted;
 }
 
-static int usb_mount_partition(struct usb_partition *partition, char *options)
+/*
+ * Whether partition is the topmost mount on mount_path, answered by a statx
+ * of mount_path where that settles it: nothing is mounted on a missing
+ * directory or one that is not the root of a mount, and a mount root on the
+ * partition's device number has it mounted. Anything else, such as a
+ * filesystem whose st_dev is not its device's (e.g., btrfs), or a kernel
+ * without STATX_ATTR_MOUNT_ROOT, is looked up in the mount table, which is
+ * only then read from mountinfo.
+ */
+static int usb_mount_path_is_mounted(struct usb_mount_table *mount_table,
+                                     struct usb_partition *partition,
+                                     const char *mount_path)
 {
-	struct libmnt_context *context = mnt_new_context();
+	struct statx stx;
+	int errnum = errno;
+	int mounted = -1;
+
+	if (statx(AT_FDCWD, mount_path, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE, &stx) == -1) {
+		if (errno == ENOENT)
+			mounted = 0;
+	} else if (stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT) {
+		if (!(stx.stx_attributes & STATX_ATTR_MOUNT_ROOT))
+			mounted = 0;
+
+		else if (makedev(stx.stx_dev_major, stx.stx_dev_minor) == partition->devnum)
+			mounted = 1;
+	}
 
-	if (!context)
-		err(EXIT_FAILURE, NULL);
+	errno = errnum;
+
+	if (mounted == -1)
+		mounted = usb_mount_table_is_mounted(mount_table, partition, mount_path);
 
+	return mounted;
+}
+
+/*
+ * Mount partition on its mount directory, with the kernel's file descriptor
+ * based mount API where it can, and with libmount otherwise.
+ */
+static int usb_mount_partition(struct usb_partition *partition,
+                               struct usb_mount_table *mount_table,
+                               char *options)
+{
 	char *mount_path = usb_get_partition_mount_directory(partition);
 	int retcode = 0;
 
-	if ((retcode = usb_create_partition_mount_directory(mount_path))) {
+	if (usb_mount_path_is_mounted(mount_table, partition, mount_path)) {
 		free(mount_path);
 
-		mnt_free_context(context);
+		errno = EBUSY;
 
-		return retcode;
+		return EBUSY;
 	}
 
-	if ((retcode = mnt_context_set_source(context, partition->node))) {
-		free(mount_path);
+	struct timespec mount_start;
+	uint64_t start = timing_start();
 
-		mnt_free_context(context);
+	clock_gettime(CLOCK_MONOTONIC, &mount_start);
 
-		return retcode;
+	retcode = usb_fs_mount_partition(partition, mount_path, options);
+
+	if (retcode == USB_MOUNT_FALLBACK) {
+		errno = 0;
+		retcode = usb_mnt_mount_partition(partition, mount_path, options);
 	}
 
-	if ((retcode = mnt_context_set_target(context, mount_path))) {
-		free(mount_path);
+	timing_stop(start, "mount", partition->node);
+	metrics_observe("mount",
+	                partition->type,
+	                usb_seconds_since(&mount_start),
+	                !retcode ? 0 : errno ? errno : abs(retcode));
 
-		mnt_free_context(context);
+	if (!retcode)
+		usb_mount_table_add(mount_table, partition, mount_path);
 
-		return retcode;
+	free(mount_path);
+
+	return retcode;
+}
+
+/*
+ * Mount partition with fsopen, fsconfig, fsmount and move_mount. Creating
+ * the superblock is the expensive part and runs first, in whichever worker
+ * thread called this. The mount directory is only created, and the mount
+ * moved onto it, once that has succeeded.
+ *
+ * Returns USB_MOUNT_FALLBACK, having changed nothing, if the kernel lacks the
+ * API, or does not know the filesystem type or an option, which libmount may
+ * still handle (e.g., through a mount helper or as a userspace option).
+ */
+static int usb_fs_mount_partition(struct usb_partition *partition,
+                                  const char *mount_path,
+                                  const char *options)
+{
+	unsigned int attrs = 0;
+	int fs_fd = -1;
+	int mount_fd = -1;
+	int retcode = 0;
+	int errnum = 0;
+
+	if (!*partition->type || __atomic_load_n(&fs_mount_unavailable, __ATOMIC_RELAXED))
+		return USB_MOUNT_FALLBACK;
+
+	if ((fs_fd = syscall(SYS_fsopen, partition->type, FSOPEN_CLOEXEC)) == -1) {
+		if (errno == ENOSYS || errno == EPERM)
+			__atomic_store_n(&fs_mount_unavailable, 1, __ATOMIC_RELAXED);
+
+		return errno == ENOSYS || errno == EPERM || errno == ENODEV ? USB_MOUNT_FALLBACK : -1;
 	}
 
-	if ((retcode = mnt_context_set_options(context, options))) {
-		free(mount_path);
+	if (syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_STRING, "source", partition->node, 0) == -1
+	    || usb_fs_mount_options(fs_fd, options, &attrs) == -1) {
+		close(fs_fd);
 
-		mnt_free_context(context);
+		return USB_MOUNT_FALLBACK;
+	}
 
-		return retcode;
+	if (syscall(SYS_fsconfig, fs_fd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) == -1) {
+		errnum = errno;
+
+		usb_fs_mount_log(fs_fd, partition);
+		close(fs_fd);
+
+		errno = errnum;
+
+		return -1;
 	}
 
-	struct libmnt_fs *fs = mnt_context_get_fs(context);
-	int mounted = 0;
+	mount_fd = syscall(SYS_fsmount, fs_fd, FSMOUNT_CLOEXEC, attrs);
+	errnum = errno;
 
-	if ((retcode = mnt_context_is_fs_mounted(context, fs, &mounted))) {
-		free(mount_path);
+	if (mount_fd == -1)
+		usb_fs_mount_log(fs_fd, partition);
 
-		mnt_free_context(context);
+	close(fs_fd);
 
-		return retcode;
+	if (mount_fd == -1) {
+		errno = errnum;
+
+		return -1;
 	}
 
-	if (mounted){
-		free(mount_path);
+	if ((retcode = usb_create_partition_mount_directory(partition))) {
+		errnum = errno;
 
-		mnt_free_context(context);
+		close(mount_fd);
 
-		errno = EBUSY;
+		errno = errnum;
 
-		return EBUSY;
+		return retcode;
 	}
 
-	free(mount_path);
+	retcode = syscall(SYS_move_mount,
+	                  mount_fd,
+	                  "",
+	                  AT_FDCWD,
+	                  mount_path,
+	                  MOVE_MOUNT_F_EMPTY_PATH);
+	errnum = errno;
 
-	retcode = mnt_context_mount(context);
+	close(mount_fd);
 
-	mnt_free_context(context);
+	if (retcode)
+		usb_delete_partition_mount_directory(partition);
+
+	errno = errnum;
 
 	return retcode;
 }
 
-static int usb_mount_device(struct usb_device *device, char *options)
+/*
+ * Apply a mount options string to a filesystem context. Mount attributes
+ * are collected into attrs, anything else is handed to the filesystem as a
+ * flag or key=value parameter. Returns -1 if the filesystem rejects one.
+ */
+static int usb_fs_mount_options(int fs_fd, const char *options, unsigned int *attrs)
 {
+	char *options_copy = NULL;
+	char *save = NULL;
 	int retcode = 0;
-	int mount_retcode = 0;
-	struct usb_partition_list *list = device->partition_list;
 
-	while (list && list->partition) {
-		if ((mount_retcode = usb_mount_partition(list->partition, options))) {
-			warn("Mounting partition %s failed", list->partition->node);
+	if (!options)
+		return 0;
+
+	if (!(options_copy = strdup(options)))
+		err(EXIT_FAILURE, NULL);
+
+	for (char *option = strtok_r(options_copy, ",", &save);
+	     option && !retcode;
+	     option = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(option, '=');
+		size_t i = 0;
 
-			retcode = mount_retcode;
+		while (i < sizeof(MOUNT_ATTRS) / sizeof(MOUNT_ATTRS[0]) && strcmp(option, MOUNT_ATTRS[i].name))
+			i++;
+
+		if (i < sizeof(MOUNT_ATTRS) / sizeof(MOUNT_ATTRS[0])) {
+			*attrs = (*attrs & ~MOUNT_ATTRS[i].clear) | MOUNT_ATTRS[i].set;
+
+			/*
+			 * A read-only mount of a read-write superblock would
+			 * still write to the device, e.g. to replay a journal.
+			 */
+			if (MOUNT_ATTRS[i].set & MOUNT_ATTR_RDONLY)
+				retcode = syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_FLAG, "ro", NULL, 0);
+
+			continue;
 		}
 
-		list = list->next;
+		if (value) {
+			*value++ = '\0';
+			retcode = syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_STRING, option, value, 0);
+		} else
+			retcode = syscall(SYS_fsconfig, fs_fd, FSCONFIG_SET_FLAG, option, NULL, 0);
 	}
 
-	return retcode;
+	free(options_copy);
+
+	return retcode ? -1 : 0;
+}
+
+/*
+ * Report the error messages the kernel left in a filesystem context, which
+ * explain failures better than errno alone.
+ */
+static void usb_fs_mount_log(int fs_fd, struct usb_partition *partition)
+{
+	char message[256];
+	ssize_t size = 0;
+
+	while ((size = read(fs_fd, message, sizeof(message) - 1)) > 0) {
+		message[size] = '\0';
+		message[strcspn(message, "\n")] = '\0';
+
+		if (strncmp(message, "e ", 2) == 0)
+			warnx("Mounting partition %s: %s", partition->node, message + 2);
+	}
 }
 
-static int usb_umount_partition(struct usb_partition *partition)
+static int usb_mnt_mount_partition(struct usb_partition *partition,
+                                   const char *mount_path,
+                                   char *options)
 {
 	struct libmnt_context *context = mnt_new_context();
 
 	if (!context)
 		err(EXIT_FAILURE, NULL);
 
-	char *mount_path = usb_get_partition_mount_directory(partition);
 	int retcode = 0;
 
-	if ((retcode = mnt_context_set_source(context, partition->node))) {
-		free(mount_path);
-
+	if ((retcode = usb_create_partition_mount_directory(partition))) {
 		mnt_free_context(context);
 
 		return retcode;
 	}
 
-	if ((retcode = mnt_context_set_target(context, mount_path))) {
-		free(mount_path);
+	/*
+	 * The mount directory was just made, so it is removed again if the
+	 * partition could not be mounted on it.
+	 */
+	if (!(retcode = mnt_context_set_source(context, partition->node))
+	    && !(retcode = mnt_context_set_target(context, mount_path))
+	    && !(retcode = mnt_context_set_options(context, options)))
+		retcode = mnt_context_mount(context);
 
-		mnt_free_context(context);
+	mnt_free_context(context);
 
-		return retcode;
+	if (retcode) {
+		int errnum = errno;
+
+		usb_delete_partition_mount_directory(partition);
+
+		errno = errnum;
+	}
+
+	return retcode;
+}
+
+static void usb_partition_task_list_init(struct usb_partition_task_list *list)
+{
+	list->tasks = NULL;
+	list->num_tasks = 0;
+	list->size = 0;
+	list->queued = hash_table_new(0);
+}
+
+static void usb_partition_task_list_free(struct usb_partition_task_list *list)
+{
+	hash_table_free(list->queued);
+
+	free(list->tasks);
+}
+
+/*
+ * Queue an operation on partition. A partition named more than once, directly
+ * or through its device, is only queued the first time so that two workers
+ * never operate on the same mount point.
+ */
+static void usb_partition_task_list_add(struct usb_partition_task_list *list,
+                                        struct usb_partition *partition,
+                                        struct usb_mount_table *mount_table,
+                                        char *options)
+{
+	if (hash_table_get(list->queued, &partition, sizeof(struct usb_partition *)))
+		return;
+
+	hash_table_put(list->queued, &partition, sizeof(struct usb_partition *), partition);
+
+	if (list->num_tasks == list->size) {
+		list->size = list->size ? list->size * 2 : 16;
+		list->tasks = realloc(list->tasks, list->size * sizeof(struct usb_partition_task));
+
+		if (!list->tasks)
+			err(EXIT_FAILURE, NULL);
+	}
+
+	struct usb_partition_task *task = &list->tasks[list->num_tasks++];
+
+	task->partition = partition;
+	task->mount_table = mount_table;
+	task->options = options;
+	task->mounted = 0;
+	task->check_failed = 0;
+	task->retcode = 0;
+	task->errnum = 0;
+}
+
+static void usb_partition_task_list_add_device(struct usb_partition_task_list *list,
+                                               struct usb_device *device,
+                                               struct usb_mount_table *mount_table,
+                                               char *options)
+{
+	for (size_t i = 0; i < device->num_partitions; i++)
+		usb_partition_task_list_add(list, &device->partitions[i], mount_table, options);
+}
+
+static void usb_mount_task_run(void *arg)
+{
+	struct usb_partition_task *task = arg;
+
+	if (task->check_failed)
+		return;
+
+	errno = 0;
+	task->retcode = usb_mount_partition(task->partition, task->mount_table, task->options);
+	task->errnum = errno;
+}
+
+/*
+ * Mount every queued partition using up to jobs worker threads, then report
+ * failures in queue order.
+ */
+static int usb_mount_task_list_run(struct usb_partition_task_list *list, size_t jobs)
+{
+	int retcode = 0;
+
+	struct usb_topology *topology = usb_topology_new(list->num_tasks);
+
+	for (size_t i = 0; i < list->num_tasks; i++)
+		usb_topology_set(topology, i, list->tasks[i].partition->device);
+
+	usb_topology_run(topology,
+	                 list->tasks,
+	                 sizeof(struct usb_partition_task),
+	                 list->num_tasks,
+	                 jobs,
+	                 usb_mount_task_run);
+	usb_topology_free(topology);
+
+	for (size_t i = 0; i < list->num_tasks; i++) {
+		if (list->tasks[i].retcode) {
+			errno = list->tasks[i].errnum;
+
+			if (!list->tasks[i].check_failed)
+				warn("Mounting partition %s failed", list->tasks[i].partition->node);
+
+			retcode = list->tasks[i].retcode;
+		}
+	}
+
+	return retcode;
+}
+
+static void usb_check_task_run(void *arg)
+{
+	struct usb_check_task *task = arg;
+	struct timespec start;
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < task->num_tasks; i++) {
+		struct usb_partition_task *partition_task = task->tasks[i];
+		struct usb_partition *partition = partition_task->partition;
+
+		if (usb_mount_table_is_device_mounted(partition_task->mount_table, partition)
+		    || !check_needed(partition->node, partition->type))
+			continue;
+
+		task->num_checked++;
+
+		errno = 0;
+
+		uint64_t start = timing_start();
+		int status = check_run(partition->node, partition->type);
+
+		timing_stop(start, "check", partition->node);
+
+		if (status == -1 || status > 1) {
+			partition_task->check_failed = 1;
+			partition_task->retcode = status;
+			partition_task->errnum = errno;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	task->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/*
+ * Check the filesystems of the queued partitions that are marked as needing
+ * it, up to jobs devices at a time, then report each device with its time
+ * and each failure. Partitions failing their check are left unmounted.
+ */
+static void usb_check_task_list_run(struct usb_partition_task_list *list, size_t jobs)
+{
+	struct usb_check_task *tasks = calloc(list->num_tasks + 1, sizeof(struct usb_check_task));
+	struct usb_partition_task **partition_tasks = calloc(list->num_tasks + 1,
+	                                                     sizeof(struct usb_partition_task *));
+	struct hash_table *devices = hash_table_new(0);
+	size_t num_tasks = 0;
+
+	if (!tasks || !partition_tasks)
+		err(EXIT_FAILURE, NULL);
+
+	/*
+	 * Count the partitions of each device, then give each device its range
+	 * of partition_tasks, in queue order.
+	 */
+	for (size_t i = 0; i < list->num_tasks; i++) {
+		struct usb_device *device = list->tasks[i].partition->device;
+		struct usb_check_task *task = hash_table_get(devices, &device, sizeof(struct usb_device *));
+
+		if (!task) {
+			task = &tasks[num_tasks++];
+			task->device = device;
+
+			hash_table_put(devices, &device, sizeof(struct usb_device *), task);
+		}
+
+		task->num_tasks++;
+	}
+
+	for (size_t i = 0, offset = 0; i < num_tasks; i++) {
+		tasks[i].tasks = partition_tasks + offset;
+		offset += tasks[i].num_tasks;
+		tasks[i].num_tasks = 0;
+	}
+
+	for (size_t i = 0; i < list->num_tasks; i++) {
+		struct usb_device *device = list->tasks[i].partition->device;
+		struct usb_check_task *task = hash_table_get(devices, &device, sizeof(struct usb_device *));
+
+		task->tasks[task->num_tasks++] = &list->tasks[i];
+	}
+
+	struct usb_topology *topology = usb_topology_new(num_tasks);
+
+	for (size_t i = 0; i < num_tasks; i++)
+		usb_topology_set(topology, i, tasks[i].device);
+
+	usb_topology_run(topology, tasks, sizeof(struct usb_check_task), num_tasks, jobs, usb_check_task_run);
+	usb_topology_free(topology);
+
+	for (size_t i = 0; i < num_tasks; i++) {
+		for (size_t j = 0; j < tasks[i].num_tasks; j++) {
+			struct usb_partition_task *partition_task = tasks[i].tasks[j];
+
+			if (!partition_task->check_failed)
+				continue;
+
+			if (partition_task->retcode == -1) {
+				errno = partition_task->errnum;
+
+				warn("Checking partition %s failed", partition_task->partition->node);
+			} else
+				warnx("Checking partition %s failed: Checker exited with status %d",
+				      partition_task->partition->node,
+				      partition_task->retcode);
+		}
+
+		printf("%s: checked %zu of %zu partitions in %.2fs\n",
+		       tasks[i].device->node,
+		       tasks[i].num_checked,
+		       tasks[i].num_tasks,
+		       tasks[i].seconds);
 	}
 
-	struct libmnt_fs *fs = mnt_context_get_fs(context);
-	int mounted = 0;
+	fflush(stdout);
+
+	hash_table_free(devices);
+
+	free(partition_tasks);
+	free(tasks);
+}
+
+/*
+ * Unmount partition, if mounted as found by usb_partition_is_mounted, and
+ * remove its mount directory.
+ */
+static int usb_umount_partition(struct usb_partition *partition,
+                                struct usb_mount_table *mount_table,
+                                int mounted)
+{
+	struct libmnt_context *context = mnt_new_context();
+
+	if (!context)
+		err(EXIT_FAILURE, NULL);
+
+	char *mount_path = usb_get_partition_mount_directory(partition);
+	int retcode = 0;
 
-	if ((retcode = mnt_context_is_fs_mounted(context, fs, &mounted))) {
+	if ((retcode = mnt_context_set_source(context, partition->node))) {
 		free(mount_path);
 
 		mnt_free_context(context);
@@ -447,10 +1873,28 @@ static int usb_umount_partition(struct usb_partition *partition)
 		return retcode;
 	}
 
-	if (!mounted){
-		warnx("Unmounting partition %s failed: Not mounted", partition->node);
-	} else {
-		retcode = mnt_context_umount(context);
+	if ((retcode = mnt_context_set_target(context, mount_path))) {
+		free(mount_path);
+
+		mnt_free_context(context);
+
+		return retcode;
+	}
+
+	if (mounted) {
+		int fd = open(mount_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+		/*
+		 * Write back dirty pages before detaching, so the flush happens
+		 * here in parallel with other partitions.
+		 */
+		if (fd != -1) {
+			syncfs(fd);
+			close(fd);
+		}
+
+		if (!(retcode = mnt_context_umount(context)))
+			usb_mount_table_remove(mount_table, mount_path);
 	}
 
 	mnt_free_context(context);
@@ -461,27 +1905,112 @@ static int usb_umount_partition(struct usb_partition *partition)
 		return retcode;
 	}
 
-	retcode = usb_delete_partition_mount_directory(mount_path);
+	retcode = usb_delete_partition_mount_directory(partition);
 
 	free(mount_path);
 
 	return retcode;
 }
 
-static int usb_umount_device(struct usb_device *device)
+/*
+ * Lazily unmount a partition whose device has already gone away.
+ */
+static int usb_detach_partition(struct usb_partition *partition,
+                                struct usb_mount_table *mount_table)
 {
+	struct libmnt_context *context = mnt_new_context();
+
+	if (!context)
+		err(EXIT_FAILURE, NULL);
+
+	char *mount_path = usb_get_partition_mount_directory(partition);
 	int retcode = 0;
-	int umount_retcode = 0;
-	struct usb_partition_list *list = device->partition_list;
 
-	while (list && list->partition) {
-		if ((umount_retcode = usb_umount_partition(list->partition))) {
-			warn("Unmounting partition %s failed", list->partition->node);
+	if ((retcode = mnt_context_set_target(context, mount_path))) {
+		free(mount_path);
 
-			retcode = umount_retcode;
-		}
+		mnt_free_context(context);
+
+		return retcode;
+	}
+
+	mnt_context_enable_lazy(context, 1);
 
-		list = list->next;
+	if ((retcode = mnt_context_umount(context))) {
+		free(mount_path);
+
+		mnt_free_context(context);
+
+		return retcode;
+	}
+
+	mnt_free_context(context);
+
+	usb_mount_table_remove(mount_table, mount_path);
+
+	retcode = usb_delete_partition_mount_directory(partition);
+
+	free(mount_path);
+
+	return retcode;
+}
+
+static void usb_umount_task_run(void *arg)
+{
+	struct usb_partition_task *task = arg;
+
+	errno = 0;
+	task->mounted = usb_partition_is_mounted(task->mount_table, task->partition);
+
+	struct timespec umount_start;
+	uint64_t start = timing_start();
+
+	clock_gettime(CLOCK_MONOTONIC, &umount_start);
+
+	task->retcode = usb_umount_partition(task->partition, task->mount_table, task->mounted);
+	task->errnum = errno;
+
+	timing_stop(start, "umount", task->partition->node);
+
+	if (task->mounted)
+		metrics_observe("umount",
+		                task->partition->type,
+		                usb_seconds_since(&umount_start),
+		                !task->retcode ? 0 : task->errnum ? task->errnum : abs(task->retcode));
+}
+
+/*
+ * Unmount every queued partition using up to jobs worker threads, then report
+ * partitions that were not mounted and failures in queue order.
+ */
+static int usb_umount_task_list_run(struct usb_partition_task_list *list, size_t jobs)
+{
+	int retcode = 0;
+
+	struct usb_topology *topology = usb_topology_new(list->num_tasks);
+
+	for (size_t i = 0; i < list->num_tasks; i++)
+		usb_topology_set(topology, i, list->tasks[i].partition->device);
+
+	usb_topology_run(topology,
+	                 list->tasks,
+	                 sizeof(struct usb_partition_task),
+	                 list->num_tasks,
+	                 jobs,
+	                 usb_umount_task_run);
+	usb_topology_free(topology);
+
+	for (size_t i = 0; i < list->num_tasks; i++) {
+		if (!list->tasks[i].mounted)
+			warnx("Unmounting partition %s failed: Not mounted", list->tasks[i].partition->node);
+
+		if (list->tasks[i].retcode) {
+			errno = list->tasks[i].errnum;
+
+			warn("Unmounting partition %s failed", list->tasks[i].partition->node);
+
+			retcode = list->tasks[i].retcode;
+		}
 	}
 
 	return retcode;
@@ -491,65 +2020,76 @@ int usb_mount(char *usb_path, char *options)
 {
 	char *usb_paths[1] = {usb_path};
 
-	return usb_mount_multiple(usb_paths, 1, options);
+	return usb_mount_multiple(usb_paths, 1, NULL, options, 1, 0);
 }
 
-int usb_mount_multiple(char *usb_paths[], int num_usb_paths, char *options)
+int usb_mount_multiple(char *usb_paths[],
+                       int num_usb_paths,
+                       struct usb_filter *filter,
+                       char *options,
+                       size_t jobs,
+                       int check)
 {
-	struct usb_device_list *list = usb_device_list_get();
-	struct usb_device_list *head = list;
+	struct usb_device_list *head = usb_device_list_get(FIELD_ALL, filter);
+	struct usb_mount_table *mount_table = usb_mount_table_get();
+	struct usb_index *index = NULL;
+	struct usb_partition_task_list task_list;
 	int retcode = 0;
 	int mount_retcode = 0;
 
-	while (list && list->device) {
-		for (int i = 0; i < num_usb_paths; i++) {
-			if (strcmp(list->device->dev_path, usb_paths[i]) == 0 ||
-			    strcmp(list->device->node, usb_paths[i]) == 0) {
-				if ((mount_retcode = usb_mount_device(list->device, options)))
-					retcode = mount_retcode;
+	if (filter)
+		usb_device_list_filter(head, filter, mount_table);
 
-				break;
-			} else {
-				struct usb_partition_list *partition_list = list->device->partition_list;
+	index = usb_index_new(head);
 
-				while (partition_list && partition_list->partition) {
-					if (strcmp(partition_list->partition->dev_path, usb_paths[i]) == 0 ||
-					    strcmp(partition_list->partition->node, usb_paths[i]) == 0) {
-						if ((mount_retcode = usb_mount_partition(partition_list->partition, options))) {
-							warn("Mounting partition %s failed", partition_list->partition->node);
+	usb_partition_task_list_init(&task_list);
 
-							retcode = mount_retcode;
-						}
-					}
+	if (usb_partition_task_list_add_paths(&task_list,
+	                                      index,
+	                                      usb_paths,
+	                                      num_usb_paths,
+	                                      mount_table,
+	                                      options))
+		retcode = ENODEV;
 
-					partition_list = partition_list->next;
-				}
-			}
-		}
+	usb_index_free(index);
 
-		list = list->next;
-	}
+	if (check)
+		usb_check_task_list_run(&task_list, jobs);
 
+	if ((mount_retcode = usb_mount_task_list_run(&task_list, jobs)))
+		retcode = mount_retcode;
+
+	usb_partition_task_list_free(&task_list);
+	usb_mount_table_free(mount_table);
 	usb_device_list_free(head);
 
 	return retcode;
 }
 
-int usb_mount_all(char *options)
+int usb_mount_all(struct usb_filter *filter, char *options, size_t jobs, int check)
 {
 	int retcode = 0;
-	int mount_retcode = 0;
-	struct usb_device_list *list = usb_device_list_get();
-	struct usb_device_list *head = list;
+	struct usb_device_list *list = usb_device_list_get(FIELD_ALL, filter);
+	struct usb_mount_table *mount_table = usb_mount_table_get();
+	struct usb_partition_task_list task_list;
 
-	while (list && list->device) {
-		if ((mount_retcode = usb_mount_device(list->device, options)))
-			retcode = mount_retcode;
+	if (filter)
+		usb_device_list_filter(list, filter, mount_table);
 
-		list = list->next;
-	}
+	usb_partition_task_list_init(&task_list);
 
-	usb_device_list_free(head);
+	for (size_t i = 0; i < list->num_devices; i++)
+		usb_partition_task_list_add_device(&task_list, &list->devices[i], mount_table, options);
+
+	if (check)
+		usb_check_task_list_run(&task_list, jobs);
+
+	retcode = usb_mount_task_list_run(&task_list, jobs);
+
+	usb_partition_task_list_free(&task_list);
+	usb_mount_table_free(mount_table);
+	usb_device_list_free(list);
 
 	return retcode;
 }
@@ -558,884 +2098,4228 @@ int usb_umount(char *usb_path)
 {
 	char *usb_paths[1] = {usb_path};
 
-	return usb_umount_multiple(usb_paths, 1);
+	return usb_umount_multiple(usb_paths, 1, NULL, 1);
 }
 
-int usb_umount_multiple(char *usb_paths[], int num_usb_paths)
+int usb_umount_multiple(char *usb_paths[], int num_usb_paths, struct usb_filter *filter, size_t jobs)
 {
 	int retcode = 0;
 	int umount_retcode = 0;
-	struct usb_device_list *list = usb_device_list_get();
-	struct usb_device_list *head = list;
+	struct usb_device_list *head = usb_device_list_get(FIELD_ALL, filter);
+	struct usb_mount_table *mount_table = usb_mount_table_get();
+	struct usb_index *index = NULL;
+	struct usb_partition_task_list task_list;
 
-	while (list && list->device) {
-		for (int i = 0; i < num_usb_paths; i++) {
-			if (strcmp(list->device->dev_path, usb_paths[i]) == 0 ||
-			    strcmp(list->device->node, usb_paths[i]) == 0) {
-				if ((umount_retcode = usb_umount_device(list->device)))
-					retcode = umount_retcode;
+	if (filter)
+		usb_device_list_filter(head, filter, mount_table);
 
-				break;
-			} else {
-				struct usb_partition_list *partition_list = list->device->partition_list;
+	index = usb_index_new(head);
 
-				while (partition_list && partition_list->partition) {
-					if (strcmp(partition_list->partition->dev_path, usb_paths[i]) == 0 ||
-					    strcmp(partition_list->partition->node, usb_paths[i]) == 0) {
-						if ((umount_retcode = usb_umount_partition(partition_list->partition))) {
-							warn("Unmounting partition %s failed", partition_list->partition->node);
+	usb_partition_task_list_init(&task_list);
 
-							retcode = umount_retcode;
-						}
-					}
+	if (usb_partition_task_list_add_paths(&task_list,
+	                                      index,
+	                                      usb_paths,
+	                                      num_usb_paths,
+	                                      mount_table,
+	                                      NULL))
+		retcode = ENODEV;
 
-					partition_list = partition_list->next;
-				}
-			}
+	usb_index_free(index);
+
+	if ((umount_retcode = usb_umount_task_list_run(&task_list, jobs)))
+		retcode = umount_retcode;
+
+	usb_partition_task_list_free(&task_list);
+	usb_mount_table_free(mount_table);
+	usb_device_list_free(head);
+
+	return retcode;
+}
+
+int usb_umount_all(struct usb_filter *filter, size_t jobs)
+{
+	int retcode = 0;
+	struct usb_device_list *list = usb_device_list_get(FIELD_ALL, filter);
+	struct usb_mount_table *mount_table = usb_mount_table_get();
+	struct usb_partition_task_list task_list;
+
+	if (filter)
+		usb_device_list_filter(list, filter, mount_table);
+
+	usb_partition_task_list_init(&task_list);
+
+	for (size_t i = 0; i < list->num_devices; i++)
+		usb_partition_task_list_add_device(&task_list, &list->devices[i], mount_table, NULL);
+
+	retcode = usb_umount_task_list_run(&task_list, jobs);
+
+	usb_partition_task_list_free(&task_list);
+	usb_mount_table_free(mount_table);
+	usb_device_list_free(list);
+
+	return retcode;
+}
+
+/*
+ * Queue every partition selected by usb_paths: all partitions of a matching
+ * device, or just the matching partition. Returns nonzero if any path matched
+ * nothing.
+ */
+static int usb_partition_task_list_add_paths(struct usb_partition_task_list *list,
+                                             struct usb_index *index,
+                                             char *usb_paths[],
+                                             int num_usb_paths,
+                                             struct usb_mount_table *mount_table,
+                                             char *options)
+{
+	int unmatched = 0;
+
+	for (int i = 0; i < num_usb_paths; i++) {
+		struct usb_index_entry *entry = usb_index_find(index, usb_paths[i]);
+
+		if (!entry) {
+			warnx("No USB device matches %s", usb_paths[i]);
+
+			unmatched = 1;
+		}
+
+		for (; entry; entry = entry->next) {
+			if (entry->partition)
+				usb_partition_task_list_add(list, entry->partition, mount_table, options);
+
+			else
+				usb_partition_task_list_add_device(list, entry->device, mount_table, options);
+		}
+	}
+
+	return unmatched;
+}
+
+static struct usb_index *usb_index_new(struct usb_device_list *list)
+{
+	struct usb_index *index = malloc(sizeof(struct usb_index));
+
+	if (!index)
+		err(EXIT_FAILURE, NULL);
+
+	index->table = hash_table_new(0);
+	index->entries = NULL;
+
+	for (size_t i = 0; i < list->num_devices; i++) {
+		struct usb_device *device = &list->devices[i];
+
+		usb_index_add(index, "", device->node, device, NULL);
+		usb_index_add(index, "", device->dev_path, device, NULL);
+		usb_index_add(index, SELECTOR_SERIAL, device->serial, device, NULL);
+		usb_index_add(index, SELECTOR_LABEL, device->label, device, NULL);
+		usb_index_add(index, SELECTOR_UUID, device->uuid, device, NULL);
+
+		for (size_t j = 0; j < device->num_partitions; j++) {
+			struct usb_partition *partition = &device->partitions[j];
+
+			usb_index_add(index, "", partition->node, device, partition);
+			usb_index_add(index, "", partition->dev_path, device, partition);
+			usb_index_add(index, SELECTOR_LABEL, partition->label, device, partition);
+			usb_index_add(index, SELECTOR_UUID, partition->uuid, device, partition);
+		}
+	}
+
+	return index;
+}
+
+static void usb_index_free(struct usb_index *index)
+{
+	if (!index)
+		return;
+
+	struct usb_index_entry *entry = index->entries;
+
+	while (entry) {
+		struct usb_index_entry *next = entry->next_entry;
+
+		free(entry);
+
+		entry = next;
+	}
+
+	hash_table_free(index->table);
+
+	free(index);
+}
+
+/*
+ * Record that selector followed by value selects the device, or the partition
+ * when one is given. Matches under the same key are kept in list order.
+ */
+static void usb_index_add(struct usb_index *index,
+                          const char *selector,
+                          const char *value,
+                          struct usb_device *device,
+                          struct usb_partition *partition)
+{
+	if (!value || value[0] == '\0')
+		return;
+
+	size_t selector_size = strlen(selector);
+	size_t value_size = strlen(value);
+	char *key = malloc(selector_size + value_size);
+
+	if (!key)
+		err(EXIT_FAILURE, NULL);
+
+	memcpy(key, selector, selector_size);
+	memcpy(key + selector_size, value, value_size);
+
+	struct usb_index_entry *head = hash_table_get(index->table, key, selector_size + value_size);
+	struct usb_index_entry *tail = head;
+
+	while (tail) {
+		if (tail->device == device && tail->partition == partition) {
+			free(key);
+
+			return;
 		}
 
-		list = list->next;
-	}
+		if (!tail->next)
+			break;
+
+		tail = tail->next;
+	}
+
+	struct usb_index_entry *entry = malloc(sizeof(struct usb_index_entry));
+
+	if (!entry)
+		err(EXIT_FAILURE, NULL);
+
+	entry->device = device;
+	entry->partition = partition;
+	entry->next = NULL;
+	entry->next_entry = index->entries;
+	index->entries = entry;
+
+	if (tail)
+		tail->next = entry;
+
+	else
+		hash_table_put(index->table, key, selector_size + value_size, entry);
+
+	free(key);
+}
+
+static struct usb_index_entry *usb_index_find(struct usb_index *index, const char *usb_path)
+{
+	return hash_table_get(index->table, usb_path, strlen(usb_path));
+}
+
+/*
+ * The fields the index needs loaded to resolve the given paths. Partitions
+ * are always needed, as any path may name one.
+ */
+static unsigned int usb_index_fields(char *usb_paths[], int num_usb_paths)
+{
+	unsigned int fields = FIELD_PARTITIONS;
+
+	for (int i = 0; i < num_usb_paths; i++) {
+		if (strncmp(usb_paths[i], SELECTOR_LABEL, strlen(SELECTOR_LABEL)) == 0
+		    || strncmp(usb_paths[i], SELECTOR_UUID, strlen(SELECTOR_UUID)) == 0)
+			fields |= FIELD_FS;
+
+		else if (strncmp(usb_paths[i], SELECTOR_SERIAL, strlen(SELECTOR_SERIAL)) == 0)
+			fields |= FIELD_SERIAL;
+	}
+
+	return fields;
+}
+
+/*
+ * Compile a --where expression: comma separated terms of the form FIELD OP
+ * VALUE, all of which must hold. Returns NULL if the expression is invalid.
+ */
+struct usb_filter *usb_filter_new(const char *where)
+{
+	struct usb_filter *filter = calloc(1, sizeof(struct usb_filter));
+
+	if (!filter)
+		err(EXIT_FAILURE, NULL);
+
+	filter->fields = FIELD_PARTITIONS;
+
+	while (1) {
+		size_t length = strcspn(where, ",");
+		char *term_str = strndup(where, length);
+
+		if (!term_str)
+			err(EXIT_FAILURE, NULL);
+
+		filter->terms = realloc(filter->terms, (filter->num_terms + 1) * sizeof(struct usb_filter_term));
+
+		if (!filter->terms)
+			err(EXIT_FAILURE, NULL);
+
+		int parsed = usb_filter_term_parse(&filter->terms[filter->num_terms], term_str);
+
+		free(term_str);
+
+		if (parsed == -1) {
+			usb_filter_free(filter);
+
+			return NULL;
+		}
+
+		filter->fields |= FILTER_FIELDS[filter->terms[filter->num_terms].field].fields;
+
+		if (!FILTER_FIELDS[filter->terms[filter->num_terms].field].device)
+			filter->partition_terms = 1;
+
+		filter->num_terms++;
+
+		if (where[length] == '\0')
+			return filter;
+
+		where += length + 1;
+	}
+}
+
+void usb_filter_free(struct usb_filter *filter)
+{
+	if (!filter)
+		return;
+
+	for (size_t i = 0; i < filter->num_terms; i++)
+		free(filter->terms[i].pattern);
+
+	free(filter->terms);
+	free(filter);
+}
+
+/*
+ * Parse a single FIELD OP VALUE term. String fields take shell patterns and
+ * only = and !=, so dev_path=1.2* selects a subtree. Sizes take an optional
+ * K, M, G or T suffix, in powers of 1024.
+ */
+static int usb_filter_term_parse(struct usb_filter_term *term, const char *str)
+{
+	size_t length = strspn(str, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_");
+	const char *value = str + length;
+	int field = 0;
+
+	while (field < FILTER_NUM_FIELDS &&
+	       (strlen(FILTER_FIELDS[field].name) != length ||
+	        strncasecmp(str, FILTER_FIELDS[field].name, length)))
+		field++;
+
+	if (field == FILTER_NUM_FIELDS)
+		return -1;
+
+	term->field = field;
+	term->pattern = NULL;
+	term->number = 0;
+
+	if (strncmp(value, "!=", 2) == 0)
+		term->op = FILTER_NE;
+
+	else if (strncmp(value, "<=", 2) == 0)
+		term->op = FILTER_LE;
+
+	else if (strncmp(value, ">=", 2) == 0)
+		term->op = FILTER_GE;
+
+	else if (*value == '=')
+		term->op = FILTER_EQ;
+
+	else if (*value == '<')
+		term->op = FILTER_LT;
+
+	else if (*value == '>')
+		term->op = FILTER_GT;
+
+	else
+		return -1;
+
+	value += term->op == FILTER_EQ || term->op == FILTER_LT || term->op == FILTER_GT ? 1 : 2;
+
+	switch (FILTER_FIELDS[field].type) {
+		case FILTER_TYPE_STRING:
+			if (term->op != FILTER_EQ && term->op != FILTER_NE)
+				return -1;
+
+			term->pattern = strdup(value);
+
+			if (!term->pattern)
+				err(EXIT_FAILURE, NULL);
+
+			return 0;
+
+		case FILTER_TYPE_BOOLEAN:
+			if (term->op != FILTER_EQ && term->op != FILTER_NE)
+				return -1;
+
+			if (strcasecmp(value, "yes") == 0)
+				term->number = 1;
+
+			else if (strcasecmp(value, "no") != 0)
+				return -1;
+
+			return 0;
+
+		default: {
+			char *end = NULL;
+			unsigned long long number = 0;
+
+			errno = 0;
+			number = strtoull(value, &end, 10);
+
+			if (errno || !isdigit((unsigned char)*value) || number > LLONG_MAX)
+				return -1;
+
+			if (FILTER_FIELDS[field].type == FILTER_TYPE_SIZE && *end) {
+				const char *suffix = strchr("KMGT", toupper((unsigned char)*end));
+
+				if (!suffix || end[1])
+					return -1;
+
+				int shift = 10 * (suffix - "KMGT" + 1);
+
+				if (number > (unsigned long long)LLONG_MAX >> shift)
+					return -1;
+
+				number <<= shift;
+			} else if (*end)
+				return -1;
+
+			term->number = number;
+
+			return 0;
+		}
+	}
+}
+
+static int usb_filter_term_match(const struct usb_filter_term *term,
+                                 const char *str,
+                                 long long number)
+{
+	int cmp = 0;
+
+	if (term->pattern)
+		cmp = fnmatch(term->pattern, str ? str : "", 0) != 0;
+
+	else
+		cmp = (number > term->number) - (number < term->number);
+
+	switch (term->op) {
+		case FILTER_EQ:
+			return cmp == 0;
+
+		case FILTER_NE:
+			return cmp != 0;
+
+		case FILTER_LT:
+			return cmp < 0;
+
+		case FILTER_LE:
+			return cmp <= 0;
+
+		case FILTER_GT:
+			return cmp > 0;
+
+		default:
+			return cmp >= 0;
+	}
+}
+
+/*
+ * Whether device satisfies the terms on device fields. Terms on partition
+ * fields are ignored.
+ */
+static int usb_filter_match_device(const struct usb_filter *filter, const struct usb_device *device)
+{
+	for (size_t i = 0; i < filter->num_terms; i++) {
+		const struct usb_filter_term *term = &filter->terms[i];
+		int match = 1;
+
+		switch (term->field) {
+			case FILTER_BUS:
+				match = usb_filter_term_match(term, NULL, device->bus);
+
+				break;
+
+			case FILTER_DEV_PATH:
+				match = usb_filter_term_match(term, device->dev_path, 0);
+
+				break;
+
+			case FILTER_SERIAL:
+				match = usb_filter_term_match(term, device->serial, 0);
+
+				break;
+
+			case FILTER_MANUFACTURER:
+				match = usb_filter_term_match(term, device->manufacturer, 0);
+
+				break;
+
+			case FILTER_PRODUCT:
+				match = usb_filter_term_match(term, device->product, 0);
+
+				break;
+		}
+
+		if (!match)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Whether partition satisfies the terms on partition fields. Terms on device
+ * fields are ignored.
+ */
+static int usb_filter_match_partition(const struct usb_filter *filter,
+                                      struct usb_partition *partition,
+                                      struct usb_mount_table *mount_table)
+{
+	for (size_t i = 0; i < filter->num_terms; i++) {
+		const struct usb_filter_term *term = &filter->terms[i];
+		int match = 1;
+
+		switch (term->field) {
+			case FILTER_SIZE:
+				match = usb_filter_term_match(term, NULL, partition->size);
+
+				break;
+
+			case FILTER_TYPE:
+				match = usb_filter_term_match(term, partition->type, 0);
+
+				break;
+
+			case FILTER_LABEL:
+				match = usb_filter_term_match(term, partition->label, 0);
+
+				break;
+
+			case FILTER_UUID:
+				match = usb_filter_term_match(term, partition->uuid, 0);
+
+				break;
+
+			case FILTER_MOUNTED:
+				match = usb_filter_term_match(term,
+				                              NULL,
+				                              usb_partition_is_mounted(mount_table, partition));
+
+				break;
+		}
+
+		if (!match)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Drop the devices and partitions the filter does not select, keeping the
+ * order of the rest. With terms on partition fields, only the matching
+ * partitions are kept, and devices left with none are dropped.
+ */
+static void usb_device_list_filter(struct usb_device_list *list,
+                                   const struct usb_filter *filter,
+                                   struct usb_mount_table *mount_table)
+{
+	size_t num_devices = 0;
+
+	for (size_t i = 0; i < list->num_devices; i++) {
+		struct usb_device *device = &list->devices[num_devices];
+		size_t num_partitions = 0;
+
+		if (!usb_filter_match_device(filter, &list->devices[i]))
+			continue;
+
+		*device = list->devices[i];
+
+		for (size_t j = 0; j < device->num_partitions; j++) {
+			if (filter->partition_terms
+			    && !usb_filter_match_partition(filter, &device->partitions[j], mount_table))
+				continue;
+
+			device->partitions[num_partitions] = device->partitions[j];
+			device->partitions[num_partitions++].device = device;
+		}
+
+		device->num_partitions = num_partitions;
+
+		if (!filter->partition_terms || num_partitions)
+			num_devices++;
+	}
+
+	list->num_devices = num_devices;
+}
+
+/*
+ * Narrow the block device scan with udev matches implied by the filter, so
+ * that devices it cannot select are never read. Property matches are ORed
+ * by udev, and so only one kind is pushed down. A serial pattern selects
+ * disks and their partitions by ID_SERIAL_SHORT, which udev derives from
+ * the USB serial by replacing characters outside a safe set, so it is only
+ * used when the pattern is made of those and cannot match an empty serial.
+ * Otherwise a filesystem type pattern selects partitions by ID_FS_TYPE, with
+ * all disks kept as their parents.
+ */
+static void usb_filter_push_down(const struct usb_filter *filter, struct udev_enumerate *enumerate)
+{
+	const struct usb_filter_term *type_term = NULL;
+
+	for (size_t i = 0; i < filter->num_terms; i++) {
+		const struct usb_filter_term *term = &filter->terms[i];
+
+		if (term->op != FILTER_EQ || !term->pattern || !term->pattern[strspn(term->pattern, "*")])
+			continue;
+
+		if (term->field == FILTER_SERIAL
+		    && strspn(term->pattern, FILTER_SERIAL_SAFE) == strlen(term->pattern)) {
+			udev_enumerate_add_match_property(enumerate, "ID_SERIAL_SHORT", term->pattern);
+
+			return;
+		}
+
+		if (term->field == FILTER_TYPE && !type_term)
+			type_term = term;
+	}
+
+	if (type_term) {
+		udev_enumerate_add_match_property(enumerate, "ID_FS_TYPE", type_term->pattern);
+		udev_enumerate_add_match_property(enumerate, "DEVTYPE", "disk");
+	}
+}
+
+/*
+ * Get the device list, from the inventory cache at cache_path when it is
+ * enabled and still current. Otherwise the list is enumerated and the cache
+ * rewritten. The seqnum is read before enumerating, so a uevent arriving
+ * meanwhile leaves the cache stale rather than wrongly current.
+ *
+ * The filter is only pushed into enumeration when there is no cache, and
+ * the list is to be filtered either way.
+ */
+static struct usb_device_list *usb_device_list_get_cached(const char *cache_path,
+                                                         unsigned int fields,
+                                                         const struct usb_filter *filter,
+                                                         struct usb_cache **cache)
+{
+	*cache = NULL;
+
+	/*
+	 * The cache is validated against device events, so it never holds
+	 * fixtures.
+	 */
+	if (!cache_path || device_source.list_get == usb_fixture_device_list_get)
+		return usb_device_list_get(fields, filter);
+
+	unsigned long long seqnum = usb_uevent_seqnum();
+
+	uint64_t start = timing_start();
+
+	*cache = seqnum ? usb_cache_load(cache_path, seqnum) : NULL;
+
+	timing_stop(start, "cache load", NULL);
+
+	if (*cache)
+		return &(*cache)->list;
+
+	/*
+	 * The cache holds every field, whatever this listing needs.
+	 */
+	struct usb_device_list *list = usb_device_list_get(FIELD_ALL, NULL);
+
+	if (seqnum) {
+		start = timing_start();
+
+		usb_cache_store(cache_path, list, seqnum);
+
+		timing_stop(start, "cache store", NULL);
+	}
+
+	return list;
+}
+
+static void usb_device_list_release(struct usb_device_list *list, struct usb_cache *cache)
+{
+	if (cache)
+		usb_cache_free(cache);
+
+	else
+		usb_device_list_free(list);
+}
+
+static unsigned long long usb_uevent_seqnum()
+{
+	unsigned long long seqnum = 0;
+	FILE *file = fopen(UEVENT_SEQNUM_PATH, "re");
+
+	if (!file)
+		return 0;
+
+	if (fscanf(file, "%llu", &seqnum) != 1)
+		seqnum = 0;
+
+	fclose(file);
+
+	return seqnum;
+}
+
+/*
+ * Map the cache file and build a device list on top of it, or return NULL if
+ * the file is missing, malformed, stamped with a different seqnum, or could
+ * have been written by someone other than us or root.
+ */
+static struct usb_cache *usb_cache_load(const char *cache_path, unsigned long long seqnum)
+{
+	struct stat st;
+	int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) ||
+	    (st.st_uid != 0 && st.st_uid != geteuid()) ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+	    st.st_size < sizeof(struct usb_cache_header)) {
+		close(fd);
+
+		return NULL;
+	}
+
+	/*
+	 * Mapped privately and writable, as rendering trims strings in place.
+	 */
+	void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	struct usb_cache_header *header = map;
+	struct usb_cache_device *cache_devices = (struct usb_cache_device *)(header + 1);
+	struct usb_cache_partition *cache_partitions =
+		(struct usb_cache_partition *)(cache_devices + header->num_devices);
+	char *strings = (char *)(cache_partitions + header->num_partitions);
+
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) ||
+	    header->version != CACHE_VERSION ||
+	    header->seqnum != seqnum ||
+	    header->strings_size == 0 ||
+	    st.st_size != sizeof(struct usb_cache_header) +
+	                   header->num_devices * (size_t)sizeof(struct usb_cache_device) +
+	                   header->num_partitions * (size_t)sizeof(struct usb_cache_partition) +
+	                   header->strings_size ||
+	    strings[header->strings_size - 1] != '\0') {
+		munmap(map, st.st_size);
+
+		return NULL;
+	}
+
+	struct usb_cache *cache = malloc(sizeof(struct usb_cache));
+
+	if (!cache)
+		err(EXIT_FAILURE, NULL);
+
+	cache->map = map;
+	cache->map_size = st.st_size;
+	cache->devices = calloc(header->num_devices + 1, sizeof(struct usb_device));
+	cache->partitions = calloc(header->num_partitions + 1, sizeof(struct usb_partition));
+
+	if (!cache->devices || !cache->partitions)
+		err(EXIT_FAILURE, NULL);
+
+	cache->list.devices = cache->devices;
+	cache->list.num_devices = header->num_devices;
+	cache->list.size = header->num_devices;
+	cache->list.fields = FIELD_ALL;
+	cache->list.arena = NULL;
+
+	size_t strings_size = header->strings_size;
+
+#define CACHE_STRING(offset) ((offset) < strings_size ? strings + (offset) : strings + strings_size - 1)
+
+	for (uint32_t i = 0; i < header->num_devices; i++) {
+		struct usb_cache_device *cache_device = &cache_devices[i];
+		struct usb_device *device = &cache->devices[i];
+
+		if (cache_device->first_partition > header->num_partitions ||
+		    cache_device->num_partitions > header->num_partitions - cache_device->first_partition) {
+			usb_cache_free(cache);
+
+			return NULL;
+		}
+
+		device->node = CACHE_STRING(cache_device->node);
+		device->manufacturer = CACHE_STRING(cache_device->manufacturer);
+		device->product = CACHE_STRING(cache_device->product);
+		device->serial = CACHE_STRING(cache_device->serial);
+		device->dev_path = CACHE_STRING(cache_device->dev_path);
+		device->label = CACHE_STRING(cache_device->label);
+		device->uuid = CACHE_STRING(cache_device->uuid);
+		device->type = CACHE_STRING(cache_device->type);
+		device->sys_path = CACHE_STRING(cache_device->sys_path);
+		device->version = CACHE_STRING(cache_device->version);
+		device->speed = CACHE_STRING(cache_device->speed);
+		device->bus = cache_device->bus;
+		device->lun = cache_device->lun;
+		device->size = cache_device->size;
+		device->max_children = cache_device->max_children;
+		device->partitions = &cache->partitions[cache_device->first_partition];
+		device->num_partitions = cache_device->num_partitions;
+
+		for (uint32_t j = 0; j < cache_device->num_partitions; j++) {
+			struct usb_cache_partition *cache_partition =
+				&cache_partitions[cache_device->first_partition + j];
+			struct usb_partition *partition =
+				&cache->partitions[cache_device->first_partition + j];
+
+			partition->device = device;
+			partition->node = CACHE_STRING(cache_partition->node);
+			partition->num = cache_partition->num;
+			partition->dev_path = CACHE_STRING(cache_partition->dev_path);
+			partition->label = CACHE_STRING(cache_partition->label);
+			partition->uuid = CACHE_STRING(cache_partition->uuid);
+			partition->type = CACHE_STRING(cache_partition->type);
+			partition->sys_path = CACHE_STRING(cache_partition->sys_path);
+			partition->devnum = cache_partition->devnum;
+			partition->size = cache_partition->size;
+		}
+	}
+
+#undef CACHE_STRING
+
+	return cache;
+}
+
+/*
+ * Write list to the cache file, stamped with seqnum. The file is written
+ * under a temporary name and renamed into place, so readers never see a
+ * partial cache. Failures are ignored, the cache being only an optimisation.
+ */
+static void usb_cache_store(const char *cache_path,
+                            struct usb_device_list *list,
+                            unsigned long long seqnum)
+{
+	struct usb_cache_header header = {{0}};
+	struct usb_cache_strings strings = {NULL, 0, 0, hash_table_new(0)};
+	struct usb_cache_device *cache_devices = NULL;
+	struct usb_cache_partition *cache_partitions = NULL;
+
+	header.num_devices = list->num_devices;
+
+	for (size_t i = 0; i < list->num_devices; i++)
+		header.num_partitions += list->devices[i].num_partitions;
+
+	cache_devices = calloc(header.num_devices + 1, sizeof(struct usb_cache_device));
+	cache_partitions = calloc(header.num_partitions + 1, sizeof(struct usb_cache_partition));
+
+	if (!cache_devices || !cache_partitions)
+		err(EXIT_FAILURE, NULL);
+
+	usb_cache_strings_add(&strings, "");
+
+	uint32_t num_devices = 0;
+	uint32_t num_partitions = 0;
+
+	for (size_t i = 0; i < list->num_devices; i++) {
+		struct usb_device *device = &list->devices[i];
+		struct usb_cache_device *cache_device = &cache_devices[num_devices++];
+
+		cache_device->node = usb_cache_strings_add(&strings, device->node);
+		cache_device->manufacturer = usb_cache_strings_add(&strings, device->manufacturer);
+		cache_device->product = usb_cache_strings_add(&strings, device->product);
+		cache_device->serial = usb_cache_strings_add(&strings, device->serial);
+		cache_device->dev_path = usb_cache_strings_add(&strings, device->dev_path);
+		cache_device->label = usb_cache_strings_add(&strings, device->label);
+		cache_device->uuid = usb_cache_strings_add(&strings, device->uuid);
+		cache_device->type = usb_cache_strings_add(&strings, device->type);
+		cache_device->sys_path = usb_cache_strings_add(&strings, device->sys_path);
+		cache_device->version = usb_cache_strings_add(&strings, device->version);
+		cache_device->speed = usb_cache_strings_add(&strings, device->speed);
+		cache_device->bus = device->bus;
+		cache_device->lun = device->lun;
+		cache_device->size = device->size;
+		cache_device->max_children = device->max_children;
+		cache_device->first_partition = num_partitions;
+
+		for (size_t j = 0; j < device->num_partitions; j++) {
+			struct usb_partition *partition = &device->partitions[j];
+			struct usb_cache_partition *cache_partition = &cache_partitions[num_partitions++];
+
+			cache_partition->node = usb_cache_strings_add(&strings, partition->node);
+			cache_partition->dev_path = usb_cache_strings_add(&strings, partition->dev_path);
+			cache_partition->label = usb_cache_strings_add(&strings, partition->label);
+			cache_partition->uuid = usb_cache_strings_add(&strings, partition->uuid);
+			cache_partition->type = usb_cache_strings_add(&strings, partition->type);
+			cache_partition->sys_path = usb_cache_strings_add(&strings, partition->sys_path);
+			cache_partition->num = partition->num;
+			cache_partition->devnum = partition->devnum;
+			cache_partition->size = partition->size;
+		}
+
+		cache_device->num_partitions = num_partitions - cache_device->first_partition;
+	}
+
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+
+	header.version = CACHE_VERSION;
+	header.strings_size = strings.size;
+	header.seqnum = seqnum;
+
+	char *tmp_path = NULL;
+	char *dir_path = strdup(cache_path);
+
+	if (!dir_path || asprintf(&tmp_path, "%s.XXXXXX", cache_path) == -1)
+		err(EXIT_FAILURE, NULL);
+
+	mkdir(dirname(dir_path), 0755);
+
+	int fd = mkostemp(tmp_path, O_CLOEXEC);
+
+	if (fd != -1) {
+		FILE *file = fdopen(fd, "w");
+
+		if (file &&
+		    fchmod(fd, 0644) == 0 &&
+		    fwrite(&header, sizeof(header), 1, file) == 1 &&
+		    fwrite(cache_devices, sizeof(struct usb_cache_device), header.num_devices, file)
+		    == header.num_devices &&
+		    fwrite(cache_partitions, sizeof(struct usb_cache_partition), header.num_partitions, file)
+		    == header.num_partitions &&
+		    fwrite(strings.data, 1, strings.size, file) == strings.size &&
+		    fclose(file) == 0) {
+			if (rename(tmp_path, cache_path))
+				unlink(tmp_path);
+		} else {
+			if (file)
+				fclose(file);
+
+			else
+				close(fd);
+
+			unlink(tmp_path);
+		}
+	}
+
+	errno = 0;
+
+	free(tmp_path);
+	free(dir_path);
+	free(cache_devices);
+	free(cache_partitions);
+	free(strings.data);
+
+	hash_table_free(strings.offsets);
+}
+
+static void usb_cache_free(struct usb_cache *cache)
+{
+	if (!cache)
+		return;
+
+	munmap(cache->map, cache->map_size);
+
+	free(cache->devices);
+	free(cache->partitions);
+	free(cache);
+}
+
+/*
+ * Append str to the string table unless already present, returning its
+ * offset.
+ */
+static uint32_t usb_cache_strings_add(struct usb_cache_strings *strings, const char *str)
+{
+	if (!str)
+		str = "";
+
+	size_t size = strlen(str) + 1;
+	void *offset = hash_table_get(strings->offsets, str, size);
+
+	if (offset)
+		return (uintptr_t)offset - 1;
+
+	while (strings->size + size > strings->capacity) {
+		strings->capacity = strings->capacity ? strings->capacity * 2 : 4096;
+		strings->data = realloc(strings->data, strings->capacity);
+
+		if (!strings->data)
+			err(EXIT_FAILURE, NULL);
+	}
+
+	uint32_t new_offset = strings->size;
+
+	memcpy(strings->data + strings->size, str, size);
+	strings->size += size;
+
+	/*
+	 * Offsets are stored biased by one, as a NULL value means not found.
+	 */
+	hash_table_put(strings->offsets, str, size, (void *)(uintptr_t)(new_offset + 1));
+
+	return new_offset;
+}
+
+/*
+ * Watch for USB mass storage devices coming and going, keeping the device
+ * model in memory and applying each udev event to it incrementally. New
+ * partitions are mounted when mount is set, and partitions of removed devices
+ * are lazily unmounted when umount is set. Runs until SIGINT or SIGTERM.
+ */
+int usb_watch(char *options, int mount, int umount, int verbose)
+{
+	struct usb_watch watch = {0};
+	struct epoll_event event = {0};
+	struct epoll_event events[3];
+	sigset_t signals;
+	int running = 1;
+
+	watch.options = options;
+	watch.mount = mount;
+	watch.umount = umount;
+	watch.verbose = verbose;
+	watch.udev = udev_new();
+
+	if (!watch.udev)
+		err(EXIT_FAILURE, NULL);
+
+	/*
+	 * Subscribe before enumerating, so that no event falls in between.
+	 */
+	watch.monitor = udev_monitor_new_from_netlink(watch.udev, "udev");
+
+	if (!watch.monitor)
+		err(EXIT_FAILURE, "Creating udev monitor failed");
+
+	udev_monitor_filter_add_match_subsystem_devtype(watch.monitor, "block", NULL);
+
+	if (udev_monitor_enable_receiving(watch.monitor))
+		err(EXIT_FAILURE, "Receiving udev events failed");
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+
+	if (sigprocmask(SIG_BLOCK, &signals, NULL))
+		err(EXIT_FAILURE, NULL);
+
+	int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+	int mount_info_fd = open(MOUNT_INFO_PATH, O_RDONLY | O_CLOEXEC);
+	int monitor_fd = udev_monitor_get_fd(watch.monitor);
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (signal_fd == -1 || mount_info_fd == -1 || epoll_fd == -1)
+		err(EXIT_FAILURE, NULL);
+
+	event.events = EPOLLIN;
+	event.data.fd = signal_fd;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event))
+		err(EXIT_FAILURE, NULL);
+
+	event.events = EPOLLIN;
+	event.data.fd = monitor_fd;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, monitor_fd, &event))
+		err(EXIT_FAILURE, NULL);
+
+	/*
+	 * The kernel flags mountinfo with POLLPRI whenever the mount table
+	 * changes, which is when the cached snapshot goes stale.
+	 */
+	event.events = EPOLLPRI;
+	event.data.fd = mount_info_fd;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mount_info_fd, &event))
+		err(EXIT_FAILURE, NULL);
+
+	watch.list = usb_device_list_get(FIELD_ALL, NULL);
+	watch.devices = hash_table_new(0);
+	watch.partitions = hash_table_new(0);
+
+	for (size_t i = 0; i < watch.list->num_devices; i++)
+		usb_watch_add_device(&watch, &watch.list->devices[i]);
+
+	while (running) {
+		int num_events = epoll_wait(epoll_fd, events, 3, -1);
+
+		if (num_events == -1) {
+			if (errno == EINTR)
+				continue;
+
+			err(EXIT_FAILURE, NULL);
+		}
+
+		for (int i = 0; i < num_events; i++) {
+			if (events[i].data.fd == signal_fd) {
+				running = 0;
+			} else if (events[i].data.fd == mount_info_fd) {
+				usb_mount_table_free(watch.mount_table);
+
+				watch.mount_table = NULL;
+			} else if (events[i].data.fd == monitor_fd) {
+				struct udev_device *block_device = NULL;
+
+				while ((block_device = udev_monitor_receive_device(watch.monitor))) {
+					usb_watch_event(&watch, block_device);
+
+					udev_device_unref(block_device);
+				}
+			}
+		}
+	}
+
+	close(epoll_fd);
+	close(mount_info_fd);
+	close(signal_fd);
+
+	hash_table_free(watch.partitions);
+	hash_table_free(watch.devices);
+
+	usb_mount_table_free(watch.mount_table);
+	usb_device_list_free(watch.list);
+
+	udev_monitor_unref(watch.monitor);
+	udev_unref(watch.udev);
+
+	return 0;
+}
+
+static struct usb_mount_table *usb_watch_mount_table(struct usb_watch *watch)
+{
+	if (!watch->mount_table)
+		watch->mount_table = usb_mount_table_get();
+
+	return watch->mount_table;
+}
+
+static void usb_watch_event(struct usb_watch *watch, struct udev_device *block_device)
+{
+	const char *action = udev_device_get_action(block_device);
+	const char *dev_type = udev_device_get_devtype(block_device);
+	const char *node = udev_device_get_devnode(block_device);
+
+	if (!action || !dev_type || !node)
+		return;
+
+	int is_partition = strcmp(dev_type, "partition") == 0;
+	struct usb_device *device = hash_table_get(watch->devices, node, strlen(node));
+	struct usb_partition *partition = hash_table_get(watch->partitions, node, strlen(node));
+
+	if (strcmp(action, "add") == 0) {
+		if (is_partition && !partition) {
+			device = usb_watch_parent_device(watch, block_device);
+
+			if (device) {
+				struct usb_partition new_partition;
+
+				watch->garbage += device->num_partitions * sizeof(struct usb_partition);
+
+				usb_partition_init_from_udev(watch->list->arena,
+				                             &new_partition,
+				                             device,
+				                             block_device,
+				                             watch->list->fields);
+
+				partition = usb_device_add_partition(watch->list->arena, device, &new_partition);
+
+				usb_watch_index_device(watch, device);
+				usb_watch_add_partition(watch, partition);
+			}
+		} else if (!is_partition && !device) {
+			device = usb_watch_new_device(watch, block_device);
+
+			if (device)
+				usb_watch_add_device(watch, device);
+		}
+	} else if (strcmp(action, "change") == 0) {
+		/*
+		 * Only refresh what a change can alter. Remounting here would undo
+		 * a deliberate unmount, which itself triggers a change event.
+		 */
+		if (partition)
+			usb_watch_update_fs(watch,
+			                    &partition->label,
+			                    &partition->uuid,
+			                    &partition->type,
+			                    block_device);
+
+		else if (device)
+			usb_watch_update_fs(watch,
+			                    &device->label,
+			                    &device->uuid,
+			                    &device->type,
+			                    block_device);
+	} else if (strcmp(action, "remove") == 0) {
+		if (partition)
+			usb_watch_remove_partition(watch, partition);
+
+		else if (device)
+			usb_watch_remove_device(watch, device);
+	}
+
+	/*
+	 * Removed devices and partitions, replaced strings and outgrown arrays
+	 * stay allocated in the arena until the list is released, so rebuild
+	 * the list once they take up most of it.
+	 */
+	if (watch->garbage >= WATCH_GARBAGE_MIN && 2 * watch->garbage > arena_size(watch->list->arena))
+		usb_watch_compact(watch);
+}
+
+static void usb_watch_compact(struct usb_watch *watch)
+{
+	struct usb_device_list *list = usb_device_list_copy(watch->list);
+
+	usb_device_list_free(watch->list);
+
+	watch->list = list;
+	watch->garbage = 0;
+
+	usb_watch_reindex(watch);
+}
+
+/*
+ * Add the device of a new disk to the list, if it is a USB disk. Growing the
+ * list moves every device, so the watch indexes are rebuilt when it does.
+ */
+static struct usb_device *usb_watch_new_device(struct usb_watch *watch,
+                                               struct udev_device *block_device)
+{
+	struct usb_device *devices = watch->list->devices;
+	size_t size = watch->list->size;
+	struct usb_device *device = usb_device_list_add_from_block(watch->list, block_device, NULL);
+
+	if (device && watch->list->devices != devices) {
+		watch->garbage += size * sizeof(struct usb_device);
+
+		usb_watch_reindex(watch);
+	}
+
+	return device;
+}
+
+/*
+ * Point the indexes and the partitions of a device at where it and its
+ * partitions are now stored.
+ */
+static void usb_watch_index_device(struct usb_watch *watch, struct usb_device *device)
+{
+	hash_table_put(watch->devices, device->node, strlen(device->node), device);
+
+	for (size_t i = 0; i < device->num_partitions; i++) {
+		struct usb_partition *partition = &device->partitions[i];
+
+		partition->device = device;
+
+		hash_table_put(watch->partitions, partition->node, strlen(partition->node), partition);
+	}
+}
+
+static void usb_watch_reindex(struct usb_watch *watch)
+{
+	hash_table_free(watch->devices);
+	hash_table_free(watch->partitions);
+
+	watch->devices = hash_table_new(0);
+	watch->partitions = hash_table_new(0);
+
+	for (size_t i = 0; i < watch->list->num_devices; i++)
+		usb_watch_index_device(watch, &watch->list->devices[i]);
+}
+
+/*
+ * Find the device a new partition belongs to. The disk normally announces
+ * itself first, but is built from the parent if its event was missed.
+ */
+static struct usb_device *usb_watch_parent_device(struct usb_watch *watch,
+                                                  struct udev_device *partition_device)
+{
+	struct udev_device *block_device = udev_device_get_parent(partition_device);
+	const char *node = block_device ? udev_device_get_devnode(block_device) : NULL;
+
+	if (!node)
+		return NULL;
+
+	struct usb_device *device = hash_table_get(watch->devices, node, strlen(node));
+
+	if (device)
+		return device;
+
+	device = usb_watch_new_device(watch, block_device);
+
+	if (device)
+		usb_watch_add_device(watch, device);
+
+	return device;
+}
+
+static void usb_watch_add_device(struct usb_watch *watch, struct usb_device *device)
+{
+	hash_table_put(watch->devices, device->node, strlen(device->node), device);
+
+	if (watch->verbose) {
+		printf("Added device %s (%s)\n", device->node, device->dev_path);
+		fflush(stdout);
+	}
+
+	for (size_t i = 0; i < device->num_partitions; i++)
+		usb_watch_add_partition(watch, &device->partitions[i]);
+}
+
+static void usb_watch_add_partition(struct usb_watch *watch, struct usb_partition *partition)
+{
+	hash_table_put(watch->partitions, partition->node, strlen(partition->node), partition);
+
+	if (watch->verbose) {
+		printf("Added partition %s (%s)\n", partition->node, partition->dev_path);
+		fflush(stdout);
+	}
+
+	if (watch->mount)
+		usb_watch_mount_partition(watch, partition);
+}
+
+static void usb_watch_mount_partition(struct usb_watch *watch, struct usb_partition *partition)
+{
+	struct usb_mount_table *mount_table = usb_watch_mount_table(watch);
+
+	if (usb_partition_is_mounted(mount_table, partition))
+		return;
+
+	errno = 0;
+
+	if (usb_mount_partition(partition, mount_table, watch->options)) {
+		warn("Mounting partition %s failed", partition->node);
+
+		return;
+	}
+
+	if (watch->verbose) {
+		char *mount_path = usb_get_partition_mount_directory(partition);
+
+		printf("Mounted partition %s on %s\n", partition->node, mount_path);
+		fflush(stdout);
+
+		free(mount_path);
+	}
+}
+
+static void usb_watch_remove_partition(struct usb_watch *watch, struct usb_partition *partition)
+{
+	struct usb_mount_table *mount_table = usb_watch_mount_table(watch);
+
+	if (watch->umount && usb_partition_is_mounted(mount_table, partition)) {
+		errno = 0;
+
+		if (usb_detach_partition(partition, mount_table))
+			warn("Unmounting partition %s failed", partition->node);
+
+		else if (watch->verbose)
+			printf("Unmounted partition %s\n", partition->node);
+	}
+
+	if (watch->verbose) {
+		printf("Removed partition %s (%s)\n", partition->node, partition->dev_path);
+		fflush(stdout);
+	}
+
+	hash_table_remove(watch->partitions, partition->node, strlen(partition->node));
+
+	watch->garbage += sizeof(struct usb_partition)
+	                  + strlen(partition->node) + 1
+	                  + strlen(partition->dev_path) + 1
+	                  + strlen(partition->label) + 1
+	                  + strlen(partition->uuid) + 1
+	                  + strlen(partition->sys_path) + 1;
+
+	struct usb_device *device = partition->device;
+
+	usb_device_remove_partition(device, partition);
+	usb_watch_index_device(watch, device);
+}
+
+static void usb_watch_remove_device(struct usb_watch *watch, struct usb_device *device)
+{
+	while (device->num_partitions)
+		usb_watch_remove_partition(watch, &device->partitions[0]);
+
+	if (watch->verbose) {
+		printf("Removed device %s (%s)\n", device->node, device->dev_path);
+		fflush(stdout);
+	}
+
+	hash_table_remove(watch->devices, device->node, strlen(device->node));
+
+	watch->garbage += strlen(device->node) + 1
+	                  + strlen(device->serial) + 1
+	                  + strlen(device->dev_path) + 1
+	                  + strlen(device->label) + 1
+	                  + strlen(device->uuid) + 1
+	                  + strlen(device->sys_path) + 1;
+
+	/*
+	 * The last device is moved into the freed slot.
+	 */
+	struct usb_device *moved = usb_device_list_remove(watch->list, device);
+
+	if (moved)
+		usb_watch_index_device(watch, moved);
+}
+
+static void usb_watch_update_fs(struct usb_watch *watch,
+                                char **label,
+                                char **uuid,
+                                char **type,
+                                struct udev_device *block_device)
+{
+	const char *new_label = udev_device_get_property_value(block_device, "ID_FS_LABEL");
+	const char *new_uuid = udev_device_get_property_value(block_device, "ID_FS_UUID");
+	const char *new_type = udev_device_get_property_value(block_device, "ID_FS_TYPE");
+
+	struct arena *arena = watch->list->arena;
+
+	/*
+	 * The previous strings stay in the arena, and count toward compacting
+	 * it.
+	 */
+	if (strcmp(*label, new_label ? new_label : "")) {
+		watch->garbage += strlen(*label) + 1;
+		*label = usb_strdup(arena, new_label);
+	}
+
+	if (strcmp(*uuid, new_uuid ? new_uuid : "")) {
+		watch->garbage += strlen(*uuid) + 1;
+		*uuid = usb_strdup(arena, new_uuid);
+	}
+
+	*type = usb_intern(arena, new_type);
+}
+
+/*
+ * Parse the mount table once and index it by source device number, source
+ * path and target path, so that every mounted check afterwards is a hash
+ * lookup. Filesystems such as btrfs report an anonymous device number
+ * rather than their block device's, so a partition is matched on its device
+ * node as well.
+ */
+static struct usb_mount_table *usb_mount_table_get()
+{
+	struct usb_mount_table *mount_table = malloc(sizeof(struct usb_mount_table));
+
+	if (!mount_table)
+		err(EXIT_FAILURE, NULL);
+
+	mount_table->entries = NULL;
+	mount_table->by_devno = hash_table_new(0);
+	mount_table->by_source = hash_table_new(0);
+	mount_table->by_target = hash_table_new(0);
+	mount_table->loaded = 0;
+
+	pthread_mutex_init(&mount_table->mutex, NULL);
+
+	return mount_table;
+}
+
+/*
+ * Read mountinfo into the table, unless that has been done. Called with the
+ * table locked.
+ */
+static void usb_mount_table_load(struct usb_mount_table *mount_table)
+{
+	if (mount_table->loaded)
+		return;
+
+	mount_table->loaded = 1;
+
+	uint64_t start = timing_start();
+	struct libmnt_table *table = mnt_new_table_from_file(MOUNT_INFO_PATH);
+
+	if (!table)
+		err(EXIT_FAILURE, "Reading %s failed", MOUNT_INFO_PATH);
+
+	struct libmnt_iter *iter = mnt_new_iter(MNT_ITER_FORWARD);
+
+	if (!iter)
+		err(EXIT_FAILURE, NULL);
+
+	struct libmnt_fs *fs = NULL;
+
+	while (mnt_table_next_fs(table, iter, &fs) == 0) {
+		const char *target = mnt_fs_get_target(fs);
+
+		if (target)
+			usb_mount_table_insert(mount_table,
+			                       mnt_fs_get_devno(fs),
+			                       mnt_fs_get_srcpath(fs),
+			                       target);
+	}
+
+	mnt_free_iter(iter);
+	mnt_unref_table(table);
+
+	timing_stop(start, "mountinfo", NULL);
+}
+
+static void usb_mount_table_free(struct usb_mount_table *mount_table)
+{
+	if (!mount_table)
+		return;
+
+	struct usb_mount_entry *entry = mount_table->entries;
+
+	while (entry) {
+		struct usb_mount_entry *next = entry->next;
+
+		free(entry->source);
+		free(entry->target);
+		free(entry);
+
+		entry = next;
+	}
+
+	hash_table_free(mount_table->by_devno);
+	hash_table_free(mount_table->by_source);
+	hash_table_free(mount_table->by_target);
+
+	pthread_mutex_destroy(&mount_table->mutex);
+
+	free(mount_table);
+}
+
+/*
+ * Record a mount of partition on target, once the table has been read, and
+ * unless reading it already found the mount.
+ */
+static void usb_mount_table_add(struct usb_mount_table *mount_table,
+                                struct usb_partition *partition,
+                                const char *target)
+{
+	pthread_mutex_lock(&mount_table->mutex);
+
+	struct usb_mount_entry *top = hash_table_get(mount_table->by_target, target, strlen(target));
+
+	if (mount_table->loaded && !(top && usb_mount_entry_matches(top, partition)))
+		usb_mount_table_insert(mount_table, partition->devnum, partition->node, target);
+
+	pthread_mutex_unlock(&mount_table->mutex);
+}
+
+/*
+ * Insert a mount of devno from source on target, with the table locked.
+ * Mounts stack, so the entry previously visible on target is remembered and
+ * becomes visible again once this one is removed. source may be NULL.
+ */
+static void usb_mount_table_insert(struct usb_mount_table *mount_table,
+                                   dev_t devno,
+                                   const char *source,
+                                   const char *target)
+{
+	struct usb_mount_entry *entry = malloc(sizeof(struct usb_mount_entry));
+
+	if (!entry)
+		err(EXIT_FAILURE, NULL);
+
+	entry->devno = devno;
+	entry->source = source ? strdup(source) : NULL;
+	entry->target = strdup(target);
+
+	if (!entry->target || (source && !entry->source))
+		err(EXIT_FAILURE, NULL);
+
+	entry->below = hash_table_get(mount_table->by_target, target, strlen(target));
+	entry->next_devno = hash_table_get(mount_table->by_devno, &devno, sizeof(dev_t));
+	entry->next_source = source ? hash_table_get(mount_table->by_source, source, strlen(source)) : NULL;
+	entry->next = mount_table->entries;
+	mount_table->entries = entry;
+
+	hash_table_put(mount_table->by_target, target, strlen(target), entry);
+	hash_table_put(mount_table->by_devno, &devno, sizeof(dev_t), entry);
+
+	if (source)
+		hash_table_put(mount_table->by_source, source, strlen(source), entry);
+}
+
+static void usb_mount_table_remove(struct usb_mount_table *mount_table, const char *target)
+{
+	pthread_mutex_lock(&mount_table->mutex);
+
+	struct usb_mount_entry *entry = hash_table_get(mount_table->by_target, target, strlen(target));
+
+	if (!entry) {
+		pthread_mutex_unlock(&mount_table->mutex);
+
+		return;
+	}
+
+	if (entry->below)
+		hash_table_put(mount_table->by_target, target, strlen(target), entry->below);
+
+	else
+		hash_table_remove(mount_table->by_target, target, strlen(target));
+
+	usb_mount_table_unlink(mount_table->by_devno, &entry->devno, sizeof(dev_t), entry, 0);
+
+	if (entry->source)
+		usb_mount_table_unlink(mount_table->by_source,
+		                       entry->source,
+		                       strlen(entry->source),
+		                       entry,
+		                       1);
+
+	pthread_mutex_unlock(&mount_table->mutex);
+}
+
+/*
+ * Take entry out of the chain of mounts under key in index, the chain by
+ * source path if by_source is set, and by device number otherwise.
+ */
+static void usb_mount_table_unlink(struct hash_table *index,
+                                   const void *key,
+                                   size_t key_size,
+                                   struct usb_mount_entry *entry,
+                                   int by_source)
+{
+	struct usb_mount_entry *head = hash_table_get(index, key, key_size);
+	struct usb_mount_entry *next = by_source ? entry->next_source : entry->next_devno;
+
+	if (head == entry) {
+		if (next)
+			hash_table_put(index, key, key_size, next);
+
+		else
+			hash_table_remove(index, key, key_size);
+
+		return;
+	}
+
+	while (head) {
+		struct usb_mount_entry **link = by_source ? &head->next_source : &head->next_devno;
+
+		if (*link == entry) {
+			*link = next;
+
+			break;
+		}
+
+		head = *link;
+	}
+}
+
+static struct usb_topology *usb_topology_new(size_t num_tasks)
+{
+	struct usb_topology *topology = calloc(1, sizeof(struct usb_topology));
+
+	if (!topology || !(topology->groups = calloc(2 * num_tasks + 1, sizeof(size_t))))
+		err(EXIT_FAILURE, NULL);
+
+	topology->keys = hash_table_new(0);
+
+	return topology;
+}
+
+/*
+ * Put task into the groups of the root bus and hub of device.
+ */
+static void usb_topology_set(struct usb_topology *topology, size_t task, struct usb_device *device)
+{
+	const char *port = strrchr(device->dev_path, '.');
+	int hub_path_size = port ? port - device->dev_path : 0;
+	double speed = atof(device->speed);
+	char *key = NULL;
+
+	if (asprintf(&key, "%d", device->bus) == -1)
+		err(EXIT_FAILURE, NULL);
+
+	topology->groups[2 * task] = usb_topology_group(topology, key, speed);
+
+	free(key);
+
+	if (asprintf(&key, "%d-%.*s", device->bus, hub_path_size, device->dev_path) == -1)
+		err(EXIT_FAILURE, NULL);
+
+	topology->groups[2 * task + 1] = usb_topology_group(topology, key, speed);
+
+	free(key);
+}
+
+/*
+ * Look up the group for key, creating it if needed, and account for a device
+ * with link speed in it.
+ */
+static size_t usb_topology_group(struct usb_topology *topology, const char *key, double speed)
+{
+	void *value = hash_table_get(topology->keys, key, strlen(key));
+	size_t group;
+
+	if (value) {
+		group = (uintptr_t)value - 1;
+	} else {
+		if (topology->num_groups == topology->size) {
+			topology->size = topology->size ? topology->size * 2 : 16;
+			topology->speeds = realloc(topology->speeds, topology->size * sizeof(double));
+
+			if (!topology->speeds)
+				err(EXIT_FAILURE, NULL);
+		}
+
+		group = topology->num_groups++;
+		topology->speeds[group] = 0;
+
+		hash_table_put(topology->keys, key, strlen(key), (void *)(uintptr_t)(group + 1));
+	}
+
+	if (speed > topology->speeds[group])
+		topology->speeds[group] = speed;
+
+	return group;
+}
+
+/*
+ * Run the tasks with up to jobs at once, and within the limits of the groups
+ * of their root buses and hubs.
+ */
+static void usb_topology_run(struct usb_topology *topology,
+                             void *tasks,
+                             size_t task_size,
+                             size_t num_tasks,
+                             size_t jobs,
+                             void (*run)(void *task))
+{
+	topology->limits = calloc(topology->num_groups + 1, sizeof(size_t));
+
+	if (!topology->limits)
+		err(EXIT_FAILURE, NULL);
+
+	/*
+	 * Groups come in pairs of root bus and hub, so whether a group is a
+	 * bus follows from its first task.
+	 */
+	for (size_t i = 0; i < 2 * num_tasks; i++) {
+		size_t group = topology->groups[i];
+		size_t j = 0;
+
+		while (j + 1 < sizeof(LINK_LIMITS) / sizeof(LINK_LIMITS[0])
+		       && LINK_LIMITS[j + 1].speed <= topology->speeds[group])
+			j++;
+
+		topology->limits[group] = i % 2 ? LINK_LIMITS[j].hub : LINK_LIMITS[j].bus;
+	}
+
+	pool_run_limited(tasks,
+	                 task_size,
+	                 num_tasks,
+	                 jobs,
+	                 topology->groups,
+	                 2,
+	                 topology->limits,
+	                 topology->num_groups,
+	                 run);
+}
+
+static void usb_topology_free(struct usb_topology *topology)
+{
+	hash_table_free(topology->keys);
+
+	free(topology->groups);
+	free(topology->limits);
+	free(topology->speeds);
+	free(topology);
+}
+
+/*
+ * Whether entry is a mount of partition, by device number or by device node.
+ */
+static int usb_mount_entry_matches(struct usb_mount_entry *entry, struct usb_partition *partition)
+{
+	return entry->devno == partition->devnum
+	       || (entry->source && partition->node && !strcmp(entry->source, partition->node));
+}
+
+/*
+ * The latest mount of partition, by device number or by device node, with the
+ * table locked.
+ */
+static struct usb_mount_entry *usb_mount_table_find(struct usb_mount_table *mount_table,
+                                                    struct usb_partition *partition)
+{
+	struct usb_mount_entry *entry = hash_table_get(mount_table->by_devno,
+	                                               &partition->devnum,
+	                                               sizeof(dev_t));
+
+	if (!entry && partition->node)
+		entry = hash_table_get(mount_table->by_source, partition->node, strlen(partition->node));
+
+	return entry;
+}
+
+/*
+ * Whether partition is mounted anywhere, by us or not.
+ */
+static int usb_mount_table_is_device_mounted(struct usb_mount_table *mount_table,
+                                             struct usb_partition *partition)
+{
+	pthread_mutex_lock(&mount_table->mutex);
+	usb_mount_table_load(mount_table);
+
+	int mounted = usb_mount_table_find(mount_table, partition) != NULL;
+
+	pthread_mutex_unlock(&mount_table->mutex);
+
+	return mounted;
+}
+
+/*
+ * Where partition was last mounted, or NULL if it is not mounted.
+ */
+static const char *usb_mount_table_target(struct usb_mount_table *mount_table,
+                                          struct usb_partition *partition)
+{
+	pthread_mutex_lock(&mount_table->mutex);
+	usb_mount_table_load(mount_table);
+
+	struct usb_mount_entry *entry = usb_mount_table_find(mount_table, partition);
+
+	pthread_mutex_unlock(&mount_table->mutex);
+
+	return entry ? entry->target : NULL;
+}
+
+/*
+ * Whether the topmost mount on target is partition.
+ */
+static int usb_mount_table_is_mounted(struct usb_mount_table *mount_table,
+                                      struct usb_partition *partition,
+                                      const char *target)
+{
+	pthread_mutex_lock(&mount_table->mutex);
+	usb_mount_table_load(mount_table);
+
+	struct usb_mount_entry *top = hash_table_get(mount_table->by_target, target, strlen(target));
+	int mounted = top && usb_mount_entry_matches(top, partition);
+
+	pthread_mutex_unlock(&mount_table->mutex);
+
+	return mounted;
+}
+
+static char *human_readable_size(size_t num_bytes, int human_readable_mode)
+{
+	char *human_readable_size;
+	int retcode = 0;
+
+	if (human_readable_mode == 0) {
+		retcode = asprintf(&human_readable_size, "%lu", num_bytes);
+
+		if (retcode == -1)
+			err(EXIT_FAILURE, NULL);
+
+		return human_readable_size;
+	}
+
+	int power;
+	char *suffixes[] = {
+		"K",
+		"M",
+		"G",
+		"T",
+		"P",
+		"E",
+		"Z",
+		"Y",
+		NULL
+	};
+
+	if (human_readable_mode == 1)
+		power = 1024;
+
+	else
+		power = 1000;
+
+	if (num_bytes < power) {
+		retcode = asprintf(&human_readable_size, "%lu", num_bytes);
+
+		if (retcode == -1)
+			err(EXIT_FAILURE, NULL);
+
+		return human_readable_size;
+	}
+
+	int i = 0;
+	long double size = num_bytes;
+
+	while (suffixes[i] != NULL) {
+		size /= power;
+
+		if (size < power || suffixes[i + 1] == NULL)
+			break;
+
+		i++;
+	}
+
+	retcode = asprintf(&human_readable_size, "%lu%s", (size_t)size, suffixes[i]);
+
+	if (retcode == -1)
+		err(EXIT_FAILURE, NULL);
+
+	return human_readable_size;
+}
+
+static char *trim(char *str)
+{
+	char *end;
+
+	while (isspace(*str))
+		str++;
+
+	if (*str == 0)
+		return str;
+
+	end = str + strlen(str) - 1;
+
+	while (end > str && isspace(*end))
+		end--;
+
+	*(end + 1) = 0;
+
+	return str;
+}
+
+/*
+ * Append a copy of device to the list, returning where it is stored. The
+ * list grows by doubling, which moves every device and leaves the device
+ * pointers of their partitions to the caller to update.
+ */
+static struct usb_device *usb_device_list_add(struct usb_device_list *list,
+                                              const struct usb_device *device)
+{
+	if (list->num_devices == list->size) {
+		size_t size = list->size ? list->size * 2 : 16;
+		struct usb_device *devices = arena_alloc(list->arena, size * sizeof(struct usb_device));
+
+		if (list->num_devices)
+			memcpy(devices, list->devices, list->num_devices * sizeof(struct usb_device));
+
+		list->devices = devices;
+		list->size = size;
+	}
+
+	list->devices[list->num_devices] = *device;
+
+	return &list->devices[list->num_devices++];
+}
+
+/*
+ * Remove device by moving the last device into its place. Returns the moved
+ * device, whose partitions still point at its old location, or NULL if device
+ * was the last one.
+ */
+static struct usb_device *usb_device_list_remove(struct usb_device_list *list,
+                                                 struct usb_device *device)
+{
+	struct usb_device *last = &list->devices[--list->num_devices];
+
+	if (device == last)
+		return NULL;
+
+	*device = *last;
+
+	return device;
+}
+
+static struct usb_device_list *usb_device_list_new(struct arena *arena)
+{
+	struct usb_device_list *list = arena_alloc(arena, sizeof(struct usb_device_list));
+
+	memset(list, 0, sizeof(struct usb_device_list));
+
+	list->arena = arena;
+
+	return list;
+}
+
+/*
+ * Deep copy a device list into a fresh arena, leaving behind whatever was
+ * removed from the original.
+ */
+static struct usb_device_list *usb_device_list_copy(struct usb_device_list *list)
+{
+	struct usb_device_list *copy = usb_device_list_new(arena_new());
+	struct arena *arena = copy->arena;
+	size_t num_partitions = 0;
+
+	for (size_t i = 0; i < list->num_devices; i++)
+		num_partitions += list->devices[i].num_partitions;
+
+	struct usb_partition *partitions = arena_alloc(arena,
+	                                               num_partitions * sizeof(struct usb_partition));
+
+	copy->devices = arena_alloc(arena, list->num_devices * sizeof(struct usb_device));
+	copy->fields = list->fields;
+	copy->num_devices = list->num_devices;
+	copy->size = list->num_devices;
+
+	for (size_t i = 0; i < list->num_devices; i++) {
+		struct usb_device *device = &copy->devices[i];
+
+		*device = list->devices[i];
+		device->node = arena_strdup(arena, device->node);
+		device->manufacturer = arena_intern(arena, device->manufacturer);
+		device->product = arena_intern(arena, device->product);
+		device->serial = arena_strdup(arena, device->serial);
+		device->dev_path = arena_strdup(arena, device->dev_path);
+		device->label = arena_strdup(arena, device->label);
+		device->uuid = arena_strdup(arena, device->uuid);
+		device->type = arena_intern(arena, device->type);
+		device->sys_path = arena_strdup(arena, device->sys_path);
+		device->version = arena_intern(arena, device->version);
+		device->speed = arena_intern(arena, device->speed);
+
+		for (size_t j = 0; j < device->num_partitions; j++) {
+			struct usb_partition *partition = &partitions[j];
+
+			*partition = device->partitions[j];
+			partition->device = device;
+			partition->node = arena_strdup(arena, partition->node);
+			partition->dev_path = arena_strdup(arena, partition->dev_path);
+			partition->label = arena_strdup(arena, partition->label);
+			partition->uuid = arena_strdup(arena, partition->uuid);
+			partition->type = arena_intern(arena, partition->type);
+			partition->sys_path = arena_strdup(arena, partition->sys_path);
+		}
+
+		device->partitions = partitions;
+		partitions += device->num_partitions;
+	}
+
+	return copy;
+}
+
+/*
+ * Append a copy of partition to the partitions of device, returning where it
+ * is stored. The partitions are moved to a new range one larger.
+ */
+static struct usb_partition *usb_device_add_partition(struct arena *arena,
+                                                     struct usb_device *device,
+                                                     const struct usb_partition *partition)
+{
+	struct usb_partition *partitions = arena_alloc(arena,
+	                                               (device->num_partitions + 1) *
+	                                               sizeof(struct usb_partition));
+
+	if (device->num_partitions)
+		memcpy(partitions, device->partitions, device->num_partitions * sizeof(struct usb_partition));
+
+	partitions[device->num_partitions] = *partition;
+
+	device->partitions = partitions;
+
+	return &partitions[device->num_partitions++];
+}
+
+static void usb_device_remove_partition(struct usb_device *device,
+                                        struct usb_partition *partition)
+{
+	size_t num_after = device->num_partitions - (partition - device->partitions) - 1;
+
+	memmove(partition, partition + 1, num_after * sizeof(struct usb_partition));
+
+	device->num_partitions--;
+}
+
+/*
+ * Build the table of the given columns of list, formatting every cell once
+ * and measuring the column widths in the same pass. Cells point into the
+ * list or the arena of the table, and each distinct size is formatted only
+ * once. throughput, if not NULL, holds the results of the throughput columns
+ * for each device of list in turn.
+ */
+static struct usb_table *usb_table_new(struct usb_device_list *list,
+                                       struct usb_mount_table *mount_table,
+                                       int human_readable_mode,
+                                       const int *columns,
+                                       size_t num_columns,
+                                       const struct throughput_request *throughput)
+{
+	struct usb_table *table = malloc(sizeof(struct usb_table));
+
+	if (!table)
+		err(EXIT_FAILURE, NULL);
+
+	table->arena = arena_new();
+	table->sizes = hash_table_new(0);
+	table->human_readable_mode = human_readable_mode;
+	table->devices = list->devices;
+	table->throughput = throughput;
+	table->num_columns = num_columns;
+	table->num_rows = 0;
+
+	for (size_t i = 0; i < list->num_devices; i++)
+		table->num_rows += 1 + list->devices[i].num_partitions;
+
+	table->rows = arena_alloc(table->arena, table->num_rows * sizeof(struct usb_table_row));
+
+	const char **cells = arena_alloc(table->arena,
+	                                 table->num_rows * num_columns * sizeof(const char *));
+
+	for (size_t i = 0; i < num_columns; i++) {
+		table->columns[i] = columns[i];
+		table->widths[i] = strlen(TABLE_COLUMNS[columns[i]].name);
+
+		switch (columns[i]) {
+			case TABLE_MOUNTED:
+				usb_table_measure(table, i, CELL_YES, 4);
+				usb_table_measure(table, i, CELL_NO, 4);
+
+				break;
+
+			case TABLE_LABEL:
+			case TABLE_UUID:
+				usb_table_measure(table, i, CELL_NONE, 0);
+
+				break;
+
+			case TABLE_TYPE:
+				usb_table_measure(table, i, CELL_UNKNOWN, 0);
+
+				break;
+
+			case TABLE_READ:
+			case TABLE_WRITE:
+			case TABLE_RANDOM_READ:
+				usb_table_measure(table, i, CELL_NONE, 0);
+				usb_table_measure(table, i, CELL_NA, 0);
+
+				break;
+
+			default:
+				if (TABLE_COLUMNS[columns[i]].device_only)
+					usb_table_measure(table, i, CELL_NA, 0);
+
+				break;
+		}
+	}
+
+	struct usb_table_row *row = table->rows;
+
+	for (size_t i = 0; i < list->num_devices; i++) {
+		struct usb_device *device = &list->devices[i];
+
+		row->indicator = NULL;
+		row->cells = cells;
+		cells += num_columns;
+
+		for (size_t j = 0; j < num_columns; j++)
+			row->cells[j] = usb_table_device_cell(table, j, device);
+
+		row++;
+
+		for (size_t j = 0; j < device->num_partitions; j++) {
+			struct usb_partition *partition = &device->partitions[j];
+
+			if (j + 1 < device->num_partitions)
+				row->indicator = " ├─ ";
+
+			else
+				row->indicator = " ╰─ ";
+
+			row->cells = cells;
+			cells += num_columns;
+
+			for (size_t k = 0; k < num_columns; k++)
+				row->cells[k] = usb_table_partition_cell(table, k, partition, mount_table);
+
+			row++;
+		}
+	}
+
+	return table;
+}
+
+static void usb_table_free(struct usb_table *table)
+{
+	if (!table)
+		return;
+
+	hash_table_free(table->sizes);
+	arena_free(table->arena);
+
+	free(table);
+}
+
+/*
+ * Widen the column at index to fit str, indented by indent columns.
+ */
+static void usb_table_measure(struct usb_table *table,
+                              size_t index,
+                              const char *str,
+                              size_t indent)
+{
+	size_t width = strlen(str) + indent;
+
+	if (width > table->widths[index])
+		table->widths[index] = width;
+}
+
+/*
+ * Format the cell of device in the column at index. Empty labels, UUIDs and
+ * types are shown as placeholders, which the column minimums already fit.
+ */
+static const char *usb_table_device_cell(struct usb_table *table,
+                                         size_t index,
+                                         struct usb_device *device)
+{
+	const char *cell = NULL;
+
+	switch (table->columns[index]) {
+		case TABLE_NODE:
+			cell = device->node;
+
+			break;
+
+		case TABLE_DEV_PATH:
+			cell = device->dev_path;
+
+			break;
+
+		case TABLE_MOUNTED:
+			return CELL_NA;
+
+		case TABLE_SIZE:
+			cell = usb_table_size_cell(table, device->size);
+
+			break;
+
+		case TABLE_LABEL:
+			usb_table_measure(table, index, device->label, 0);
+
+			return usb_device_list_table_label_formatter(device->label);
+
+		case TABLE_UUID:
+			usb_table_measure(table, index, device->uuid, 0);
+
+			return usb_device_list_table_label_formatter(device->uuid);
+
+		case TABLE_TYPE:
+			usb_table_measure(table, index, device->type, 0);
+
+			return usb_device_list_table_type_formatter(device->type);
+
+		case TABLE_MANUFACTURER:
+			cell = device->manufacturer;
+
+			break;
+
+		case TABLE_PRODUCT:
+			cell = device->product;
+
+			break;
+
+		case TABLE_SERIAL:
+			cell = device->serial;
+
+			break;
+
+		case TABLE_BUS:
+			cell = usb_table_number_cell(table, device->bus);
+
+			break;
+
+		case TABLE_SYS_PATH:
+			cell = device->sys_path;
+
+			break;
+
+		case TABLE_VERSION:
+			cell = trim(device->version);
+
+			break;
+
+		case TABLE_SPEED:
+			cell = device->speed;
+
+			break;
+
+		case TABLE_READ:
+			cell = usb_table_rate_cell(table,
+			                           table->throughput[device - table->devices].read_rate / 1e6,
+			                           "%.1f MB/s");
+
+			break;
+
+		case TABLE_WRITE:
+			cell = usb_table_rate_cell(table,
+			                           table->throughput[device - table->devices].write_rate / 1e6,
+			                           "%.1f MB/s");
+
+			break;
+
+		case TABLE_RANDOM_READ:
+			cell = usb_table_rate_cell(table,
+			                           table->throughput[device - table->devices].random_iops,
+			                           "%.0f IOPS");
+
+			break;
+	}
+
+	usb_table_measure(table, index, cell, 0);
+
+	return cell;
+}
+
+/*
+ * Format the cell of partition in the column at index, measured as indented
+ * by the tree indicator. Columns describing only devices are not applicable.
+ */
+static const char *usb_table_partition_cell(struct usb_table *table,
+                                            size_t index,
+                                            struct usb_partition *partition,
+                                            struct usb_mount_table *mount_table)
+{
+	const char *cell = NULL;
+
+	if (TABLE_COLUMNS[table->columns[index]].device_only)
+		return CELL_NA;
+
+	switch (table->columns[index]) {
+		case TABLE_NODE:
+			cell = partition->node;
+
+			break;
+
+		case TABLE_DEV_PATH:
+			cell = partition->dev_path;
+
+			break;
+
+		case TABLE_MOUNTED:
+			return usb_partition_is_mounted(mount_table, partition) ? CELL_YES : CELL_NO;
+
+		case TABLE_SIZE:
+			cell = usb_table_size_cell(table, partition->size);
+
+			break;
+
+		case TABLE_LABEL:
+			usb_table_measure(table, index, partition->label, 4);
+
+			return usb_device_list_table_label_formatter(partition->label);
+
+		case TABLE_UUID:
+			usb_table_measure(table, index, partition->uuid, 4);
+
+			return usb_device_list_table_label_formatter(partition->uuid);
+
+		case TABLE_TYPE:
+			usb_table_measure(table, index, partition->type, 4);
+
+			return usb_device_list_table_type_formatter(partition->type);
+
+		case TABLE_SYS_PATH:
+			cell = partition->sys_path;
+
+			break;
+	}
+
+	usb_table_measure(table, index, cell, 4);
+
+	return cell;
+}
+
+static const char *usb_table_size_cell(struct usb_table *table, size_t size)
+{
+	char *cell = hash_table_get(table->sizes, &size, sizeof(size));
+
+	if (cell)
+		return cell;
+
+	char *size_str = human_readable_size(size, table->human_readable_mode);
+
+	cell = arena_strdup(table->arena, size_str);
+
+	free(size_str);
+
+	hash_table_put(table->sizes, &size, sizeof(size), cell);
+
+	return cell;
+}
+
+static const char *usb_table_number_cell(struct usb_table *table, int number)
+{
+	char *cell = arena_alloc(table->arena, 12);
+
+	sprintf(cell, "%d", number);
+
+	return cell;
+}
+
+/*
+ * Format a measured rate, or a placeholder if it was not measured.
+ */
+static const char *usb_table_rate_cell(struct usb_table *table, double rate, const char *format)
+{
+	if (rate <= 0)
+		return CELL_NONE;
+
+	char *cell = arena_alloc(table->arena, 32);
+
+	snprintf(cell, 32, format, rate);
+
+	return cell;
+}
+
+/*
+ * Parse a comma separated list of column names into columns, which has room
+ * for TABLE_MAX_COLUMNS. Returns the number of columns, or -1 if a name is
+ * unknown or there are too many.
+ */
+static int usb_table_columns_parse(const char *str, int *columns)
+{
+	int num_columns = 0;
+
+	while (1) {
+		size_t length = strcspn(str, ",");
+		int column = 0;
+
+		while (column < TABLE_NUM_COLUMNS &&
+		       (TABLE_COLUMNS[column].throughput ||
+		        strlen(TABLE_COLUMNS[column].name) != length ||
+		        strncasecmp(str, TABLE_COLUMNS[column].name, length)))
+			column++;
+
+		if (column == TABLE_NUM_COLUMNS || num_columns == TABLE_MAX_COLUMNS)
+			return -1;
+
+		columns[num_columns++] = column;
+
+		if (str[length] == '\0')
+			return num_columns;
+
+		str += length + 1;
+	}
+}
+
+int usb_columns_valid(const char *columns)
+{
+	int parsed[TABLE_MAX_COLUMNS];
+
+	return usb_table_columns_parse(columns, parsed) != -1;
+}
+
+/*
+ * Resolve the columns to print, the defaults when columns_str is NULL, and
+ * return the fields they need loaded. Anything other than the table prints
+ * every field.
+ */
+static unsigned int usb_print_columns(const char *columns_str,
+                                      int verbose,
+                                      int output,
+                                      int *columns,
+                                      size_t *num_columns)
+{
+	unsigned int fields = 0;
+	int parsed = columns_str ? usb_table_columns_parse(columns_str, columns) : -1;
+
+	if (parsed == -1) {
+		*num_columns = sizeof(TABLE_DEFAULT_COLUMNS) / sizeof(TABLE_DEFAULT_COLUMNS[0]);
+
+		memcpy(columns, TABLE_DEFAULT_COLUMNS, sizeof(TABLE_DEFAULT_COLUMNS));
+	} else
+		*num_columns = parsed;
+
+	if (verbose || output != USB_OUTPUT_TEXT)
+		return FIELD_ALL;
+
+	for (size_t i = 0; i < *num_columns; i++) {
+		fields |= TABLE_COLUMNS[columns[i]].fields;
+
+		if (!TABLE_COLUMNS[columns[i]].device_only)
+			fields |= FIELD_PARTITIONS;
+	}
+
+	return fields;
+}
+
+static void usb_device_list_print_detail(FILE *stream,
+                                         struct usb_device_list *list,
+                                         struct usb_mount_table *mount_table,
+                                         int human_readable_mode)
+{
+	for (size_t i = 0; i < list->num_devices; i++) {
+		struct usb_device *device = &list->devices[i];
+		char *size = human_readable_size(device->size, human_readable_mode);
+
+		if (i > 0)
+			fputc('\n', stream);
+
+		fprintf(stream,
+		        "%s:        \t%s\n"
+		        "%s:         \t%d\n"
+		        "%s:    \t%s\n"
+		        "%s:        \t%s\n"
+		        "%s:       \t%s\n"
+		        "%s:        \t%s\n"
+		        "%s:        \t%s\n"
+		        "%s:\t%s\n"
+		        "%s:     \t%s\n"
+		        "%s:      \t%s\n"
+		        "%s:    \t%s\n"
+		        "%s:     \t%s\n"
+		        "%s:       \t%s\n",
+		        HEADER_NODE,
+		        device->node,
+		        HEADER_BUS,
+		        device->bus,
+		        HEADER_DEV_PATH,
+		        device->dev_path,
+		        HEADER_SIZE,
+		        size,
+		        HEADER_LABEL,
+		        device->label,
+		        HEADER_UUID,
+		        device->uuid,
+		        HEADER_TYPE,
+		        device->type,
+		        HEADER_MANUFACTURER,
+		        device->manufacturer,
+		        HEADER_PRODUCT,
+		        device->product,
+		        HEADER_SERIAL,
+		        device->serial,
+		        HEADER_SYS_PATH,
+		        device->sys_path,
+		        HEADER_VERSION,
+		        trim(device->version),
+		        HEADER_SPEED,
+		        device->speed);
+
+		free(size);
+
+		for (size_t j = 0; j < device->num_partitions; j++) {
+			struct usb_partition *partition = &device->partitions[j];
+
+			size = human_readable_size(partition->size, human_readable_mode);
+
+			fprintf(stream,
+			        "%s:   \t%d\n"
+			        "    %s:    \t    %s\n"
+			        "    %s: \t    %s\n"
+			        "    %s:    \t    %s\n"
+			        "    %s:   \t    %s\n"
+			        "    %s:    \t    %s\n"
+			        "    %s:    \t    %s\n"
+			        "    %s:\t    %s\n",
+			        HEADER_PARTITION,
+			        partition->num,
+			        HEADER_NODE,
+			        partition->node,
+			        HEADER_MOUNTED,
+			        usb_partition_is_mounted(mount_table, partition) ? CELL_YES : CELL_NO,
+			        HEADER_SIZE,
+			        size,
+			        HEADER_LABEL,
+			        partition->label,
+			        HEADER_UUID,
+			        partition->uuid,
+			        HEADER_TYPE,
+			        partition->type,
+			        HEADER_SYS_PATH,
+			        partition->sys_path);
+
+			free(size);
+		}
+	}
+}
+
+static char *usb_device_list_table_label_formatter(const char *str)
+{
+	if (strlen(str) == 0)
+		return (char *)CELL_NONE;
+
+	else
+		return (char *)str;
+}
+
+static char *usb_device_list_table_type_formatter(const char *str)
+{
+	if (strlen(str) == 0)
+		return (char *)CELL_UNKNOWN;
+
+	else
+		return (char *)str;
+}
+
+static void usb_device_list_print_table(FILE *stream,
+                                        struct usb_device_list *list,
+                                        struct usb_mount_table *mount_table,
+                                        int human_readable_mode,
+                                        const int *columns,
+                                        size_t num_columns)
+{
+	struct usb_table *table = usb_table_new(list,
+	                                        mount_table,
+	                                        human_readable_mode,
+	                                        columns,
+	                                        num_columns,
+	                                        NULL);
+
+	usb_table_print(stream, table);
+	usb_table_free(table);
+}
+
+static void usb_table_print(FILE *stream, struct usb_table *table)
+{
+	size_t num_columns = table->num_columns;
+
+	for (size_t i = 0; i < num_columns; i++)
+		fprintf(stream,
+		        i + 1 < num_columns ? "%-*s\t" : "%-*s\n",
+		        (int)table->widths[i],
+		        TABLE_COLUMNS[table->columns[i]].name);
+
+	for (size_t i = 0; i < table->num_rows; i++) {
+		struct usb_table_row *row = &table->rows[i];
+
+		for (size_t j = 0; j < num_columns; j++) {
+			int width = table->widths[j];
+
+			if (row->indicator) {
+				fputs(row->indicator, stream);
+
+				width -= 4;
+			}
+
+			fprintf(stream, j + 1 < num_columns ? "%-*s\t" : "%-*s\n", width, row->cells[j]);
+		}
+	}
+}
+
+/*
+ * Write str as a JSON string, escaping it on the fly.
+ */
+static void usb_json_print_string(FILE *stream, const char *str)
+{
+	const char *run = str;
+
+	fputc('"', stream);
+
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		fwrite(run, 1, str - run, stream);
+
+		switch (c) {
+			case '"':
+				fputs("\\\"", stream);
+
+				break;
+
+			case '\\':
+				fputs("\\\\", stream);
+
+				break;
+
+			case '\n':
+				fputs("\\n", stream);
+
+				break;
+
+			case '\t':
+				fputs("\\t", stream);
+
+				break;
+
+			default:
+				fprintf(stream, "\\u%04x", c);
+
+				break;
+		}
+
+		run = str + 1;
+	}
+
+	fwrite(run, 1, str - run, stream);
+	fputc('"', stream);
+}
+
+static void usb_json_print_device(FILE *stream,
+                                  struct usb_device *device,
+                                  struct usb_mount_table *mount_table)
+{
+	fputs("{\"node\":", stream);
+	usb_json_print_string(stream, device->node);
+	fprintf(stream, ",\"bus\":%d,\"lun\":%d,\"dev_path\":", device->bus, device->lun);
+	usb_json_print_string(stream, device->dev_path);
+	fprintf(stream, ",\"size\":%zu,\"label\":", device->size);
+	usb_json_print_string(stream, device->label);
+	fputs(",\"uuid\":", stream);
+	usb_json_print_string(stream, device->uuid);
+	fputs(",\"type\":", stream);
+	usb_json_print_string(stream, device->type);
+	fputs(",\"manufacturer\":", stream);
+	usb_json_print_string(stream, device->manufacturer);
+	fputs(",\"product\":", stream);
+	usb_json_print_string(stream, device->product);
+	fputs(",\"serial\":", stream);
+	usb_json_print_string(stream, device->serial);
+	fputs(",\"sys_path\":", stream);
+	usb_json_print_string(stream, device->sys_path);
+	fputs(",\"version\":", stream);
+	usb_json_print_string(stream, trim(device->version));
+	fputs(",\"speed\":", stream);
+	usb_json_print_string(stream, device->speed);
+	fprintf(stream, ",\"max_children\":%zu,\"partitions\":[", device->max_children);
+
+	for (size_t i = 0; i < device->num_partitions; i++) {
+		struct usb_partition *partition = &device->partitions[i];
+
+		fprintf(stream, "%s{\"partition\":%d,\"node\":", i > 0 ? "," : "", partition->num);
+		usb_json_print_string(stream, partition->node);
+		fputs(",\"dev_path\":", stream);
+		usb_json_print_string(stream, partition->dev_path);
+		fprintf(stream,
+		        ",\"mounted\":%s,\"size\":%zu,\"label\":",
+		        usb_partition_is_mounted(mount_table, partition) ? "true" : "false",
+		        partition->size);
+		usb_json_print_string(stream, partition->label);
+		fputs(",\"uuid\":", stream);
+		usb_json_print_string(stream, partition->uuid);
+		fputs(",\"type\":", stream);
+		usb_json_print_string(stream, partition->type);
+		fputs(",\"sys_path\":", stream);
+		usb_json_print_string(stream, partition->sys_path);
+		fputc('}', stream);
+	}
+
+	fputs("]}", stream);
+}
+
+/*
+ * Print the list as a JSON array of devices, or with ndjson set, as one
+ * device object per line.
+ */
+static void usb_device_list_print_json(FILE *stream,
+                                       struct usb_device_list *list,
+                                       struct usb_mount_table *mount_table,
+                                       int ndjson)
+{
+	if (!ndjson)
+		fputc('[', stream);
+
+	for (size_t i = 0; i < list->num_devices; i++) {
+		if (!ndjson)
+			fputs(i > 0 ? ",\n" : "\n", stream);
+
+		usb_json_print_device(stream, &list->devices[i], mount_table);
+
+		if (ndjson)
+			fputc('\n', stream);
+	}
+
+	if (!ndjson)
+		fputs(list->num_devices ? "\n]\n" : "]\n", stream);
+}
+
+/*
+ * Write str as a CSV field, quoting it only when it needs to be.
+ */
+static void usb_csv_print_string(FILE *stream, const char *str)
+{
+	if (!str[strcspn(str, ",\"\r\n")]) {
+		fputs(str, stream);
+
+		return;
+	}
+
+	fputc('"', stream);
+
+	for (const char *quote; (quote = strchr(str, '"')); str = quote + 1) {
+		fwrite(str, 1, quote + 1 - str, stream);
+		fputc('"', stream);
+	}
+
+	fputs(str, stream);
+	fputc('"', stream);
+}
+
+/*
+ * Print the list as CSV, one record per device followed by one per
+ * partition. Partition records name their device in the parent field and
+ * leave the fields only devices have empty, and the other way around.
+ */
+static void usb_device_list_print_csv(FILE *stream,
+                                      struct usb_device_list *list,
+                                      struct usb_mount_table *mount_table)
+{
+	fputs("node,parent,partition,bus,lun,dev_path,mounted,size,label,uuid,type,"
+	      "manufacturer,product,serial,sys_path,version,speed,max_children\n",
+	      stream);
+
+	for (size_t i = 0; i < list->num_devices; i++) {
+		struct usb_device *device = &list->devices[i];
+
+		usb_csv_print_string(stream, device->node);
+		fprintf(stream, ",,,%d,%d,", device->bus, device->lun);
+		usb_csv_print_string(stream, device->dev_path);
+		fprintf(stream, ",,%zu,", device->size);
+		usb_csv_print_string(stream, device->label);
+		fputc(',', stream);
+		usb_csv_print_string(stream, device->uuid);
+		fputc(',', stream);
+		usb_csv_print_string(stream, device->type);
+		fputc(',', stream);
+		usb_csv_print_string(stream, device->manufacturer);
+		fputc(',', stream);
+		usb_csv_print_string(stream, device->product);
+		fputc(',', stream);
+		usb_csv_print_string(stream, device->serial);
+		fputc(',', stream);
+		usb_csv_print_string(stream, device->sys_path);
+		fputc(',', stream);
+		usb_csv_print_string(stream, trim(device->version));
+		fputc(',', stream);
+		usb_csv_print_string(stream, device->speed);
+		fprintf(stream, ",%zu\n", device->max_children);
+
+		for (size_t j = 0; j < device->num_partitions; j++) {
+			struct usb_partition *partition = &device->partitions[j];
+
+			usb_csv_print_string(stream, partition->node);
+			fputc(',', stream);
+			usb_csv_print_string(stream, device->node);
+			fprintf(stream, ",%d,,,", partition->num);
+			usb_csv_print_string(stream, partition->dev_path);
+			fprintf(stream,
+			        ",%s,%zu,",
+			        usb_partition_is_mounted(mount_table, partition) ? "yes" : "no",
+			        partition->size);
+			usb_csv_print_string(stream, partition->label);
+			fputc(',', stream);
+			usb_csv_print_string(stream, partition->uuid);
+			fputc(',', stream);
+			usb_csv_print_string(stream, partition->type);
+			fputs(",,,,", stream);
+			usb_csv_print_string(stream, partition->sys_path);
+			fputs(",,,\n", stream);
+		}
+	}
+}
+
+/*
+ * Render the list in a single pass into a growable memory buffer, returning
+ * it and its length in size. Callers write it out with one fwrite.
+ */
+static char *usb_device_list_render(struct usb_device_list *list,
+                                    struct usb_mount_table *mount_table,
+                                    int verbose,
+                                    int human_readable_mode,
+                                    int output,
+                                    const int *columns,
+                                    size_t num_columns,
+                                    size_t *size)
+{
+	uint64_t start = timing_start();
+	char *buffer = NULL;
+	FILE *stream = open_memstream(&buffer, size);
+
+	if (!stream)
+		err(EXIT_FAILURE, NULL);
+
+	switch (output) {
+		case USB_OUTPUT_JSON:
+		case USB_OUTPUT_NDJSON:
+			usb_device_list_print_json(stream, list, mount_table, output == USB_OUTPUT_NDJSON);
+
+			break;
+
+		case USB_OUTPUT_CSV:
+			usb_device_list_print_csv(stream, list, mount_table);
+
+			break;
+
+		default:
+			if (verbose)
+				usb_device_list_print_detail(stream, list, mount_table, human_readable_mode);
+
+			else
+				usb_device_list_print_table(stream,
+				                            list,
+				                            mount_table,
+				                            human_readable_mode,
+				                            columns,
+				                            num_columns);
+
+			break;
+	}
+
+	if (fclose(stream))
+		err(EXIT_FAILURE, NULL);
+
+	timing_stop(start, "render", NULL);
+
+	return buffer;
+}
+
+/*
+ * Queue a disk or partition for probing, for when udev has not processed it
+ * and so has no filesystem data for it.
+ */
+static void usb_probe_target_list_add(struct usb_probe_target_list *list,
+                                      dev_t devnum,
+                                      size_t device,
+                                      size_t partition)
+{
+	if (list->num_targets == list->size) {
+		list->size = list->size ? list->size * 2 : 16;
+		list->targets = realloc(list->targets, list->size * sizeof(struct usb_probe_target));
+
+		if (!list->targets)
+			err(EXIT_FAILURE, NULL);
+	}
+
+	list->targets[list->num_targets].device = device;
+	list->targets[list->num_targets].partition = partition;
+	list->targets[list->num_targets].devnum = devnum;
+	list->num_targets++;
+}
+
+/*
+ * Probe the queued disks and partitions in parallel, filling in their label,
+ * UUID and type.
+ */
+static void usb_device_list_probe(struct usb_device_list *list,
+                                  struct usb_probe_target_list *targets)
+{
+	if (!targets->num_targets)
+		return;
+
+	uint64_t start = timing_start();
+	struct probe_request *requests = calloc(targets->num_targets, sizeof(struct probe_request));
+
+	if (!requests)
+		err(EXIT_FAILURE, NULL);
+
+	for (size_t i = 0; i < targets->num_targets; i++) {
+		struct usb_probe_target *target = &targets->targets[i];
+		struct usb_device *device = &list->devices[target->device];
+
+		requests[i].node = target->partition == SIZE_MAX ? device->node
+		                                                 : device->partitions[target->partition].node;
+		requests[i].devnum = target->devnum;
+	}
+
+	probe_run(requests, targets->num_targets, PROBE_CACHE_PATH, usb_uevent_seqnum());
+
+	for (size_t i = 0; i < targets->num_targets; i++) {
+		struct usb_probe_target *target = &targets->targets[i];
+		struct usb_device *device = &list->devices[target->device];
+		char **label = &device->label;
+		char **uuid = &device->uuid;
+		char **type = &device->type;
+
+		if (target->partition != SIZE_MAX) {
+			label = &device->partitions[target->partition].label;
+			uuid = &device->partitions[target->partition].uuid;
+			type = &device->partitions[target->partition].type;
+		}
+
+		*label = usb_strdup(list->arena, requests[i].label);
+		*uuid = usb_strdup(list->arena, requests[i].uuid);
+		*type = usb_intern(list->arena, requests[i].type);
+
+		free(requests[i].label);
+		free(requests[i].uuid);
+		free(requests[i].type);
+	}
+
+	free(requests);
+
+	timing_stop(start, "probe", NULL);
+}
+
+static int usb_udev_index_compare(const void *a, const void *b)
+{
+	const struct usb_udev_index_entry *entry_a = a;
+	const struct usb_udev_index_entry *entry_b = b;
+
+	return strcmp(entry_a->sys_path, entry_b->sys_path);
+}
+
+static struct usb_udev_index_entry *usb_udev_index_find(struct usb_udev_index_entry *index,
+                                                       size_t num_entries,
+                                                       const char *sys_path)
+{
+	struct usb_udev_index_entry key = {(char *)sys_path, 0};
+
+	return bsearch(&key,
+	               index,
+	               num_entries,
+	               sizeof(struct usb_udev_index_entry),
+	               usb_udev_index_compare);
+}
+
+static int usb_udev_scsi_lun(struct udev_device *scsi_device)
+{
+	const char *sys_name = udev_device_get_sysname(scsi_device);
+	const char *lun = strrchr(sys_name, ':');
+
+	if (!lun)
+		return 0;
+
+	return atoi(lun + 1);
+}
+
+static void usb_device_init_from_udev(struct arena *arena,
+                                      struct usb_device *device,
+                                      struct udev_device *usb_device,
+                                      struct udev_device *block_device,
+                                      int lun,
+                                      unsigned int fields)
+{
+	device->node = usb_strdup(arena, udev_device_get_devnode(block_device));
+	device->manufacturer = usb_intern(arena, usb_udev_sysattr(usb_device,
+	                                                          "manufacturer",
+	                                                          fields,
+	                                                          FIELD_MANUFACTURER));
+	device->product = usb_intern(arena,
+	                             usb_udev_sysattr(usb_device, "product", fields, FIELD_PRODUCT));
+	device->serial = usb_strdup(arena,
+	                            usb_udev_sysattr(usb_device, "serial", fields, FIELD_SERIAL));
+
+	const char *dev_path = udev_device_get_sysattr_value(usb_device, "devpath");
+
+	if (lun == 0) {
+		device->dev_path = usb_strdup(arena, dev_path);
+	} else {
+		device->dev_path = arena_alloc(arena, strlen(dev_path) + 12);
+
+		sprintf(device->dev_path, "%s:%d", dev_path, lun);
+	}
+
+	device->label = usb_strdup(arena,
+	                           usb_udev_property(block_device, "ID_FS_LABEL", fields, FIELD_FS));
+	device->uuid = usb_strdup(arena,
+	                          usb_udev_property(block_device, "ID_FS_UUID", fields, FIELD_FS));
+	device->type = usb_intern(arena,
+	                          usb_udev_property(block_device, "ID_FS_TYPE", fields, FIELD_FS));
+	device->sys_path = usb_strdup(arena, udev_device_get_syspath(usb_device));
+	device->speed = usb_intern(arena,
+	                           usb_udev_sysattr(usb_device, "speed", fields, FIELD_SPEED));
+	device->version = usb_intern(arena,
+	                             usb_udev_sysattr(usb_device, "version", fields, FIELD_VERSION));
+	device->max_children = usb_udev_sysattr_number(usb_device,
+	                                               "maxchild",
+	                                               fields,
+	                                               FIELD_MAX_CHILDREN);
+	device->bus = usb_udev_sysattr_number(usb_device, "busnum", fields, FIELD_BUS);
+	device->lun = lun;
+	device->size = usb_udev_sysattr_number(block_device, "size", fields, FIELD_SIZE) * (size_t)512;
+	device->partitions = NULL;
+	device->num_partitions = 0;
+}
+
+static void usb_partition_init_from_udev(struct arena *arena,
+                                         struct usb_partition *partition,
+                                         struct usb_device *device,
+                                         struct udev_device *partition_device,
+                                         unsigned int fields)
+{
+	char *partition_num = (char *)udev_device_get_sysattr_value(partition_device, "partition");
+	partition->device = device;
+	partition->node = usb_strdup(arena, udev_device_get_devnode(partition_device));
+	partition->sys_path = usb_strdup(arena, udev_device_get_syspath(partition_device));
+	partition->devnum = udev_device_get_devnum(partition_device);
+	partition->num = atoi(partition_num);
+	partition->dev_path = arena_alloc(arena, strlen(device->dev_path) + strlen(partition_num) + 2);
+
+	sprintf(partition->dev_path, "%s-%s", device->dev_path, partition_num);
+
+	partition->size = usb_udev_sysattr_number(partition_device, "size", fields, FIELD_SIZE)
+	                * (size_t)512;
+	partition->label = usb_strdup(arena, usb_udev_property(partition_device,
+	                                                       "ID_FS_LABEL",
+	                                                       fields,
+	                                                       FIELD_FS));
+	partition->uuid = usb_strdup(arena, usb_udev_property(partition_device,
+	                                                      "ID_FS_UUID",
+	                                                      fields,
+	                                                      FIELD_FS));
+	partition->type = usb_intern(arena, usb_udev_property(partition_device,
+	                                                      "ID_FS_TYPE",
+	                                                      fields,
+	                                                      FIELD_FS));
+}
+
+/*
+ * Read a sysfs attribute, or nothing unless field is among the fields to
+ * load.
+ */
+static const char *usb_udev_sysattr(struct udev_device *udev_device,
+                                    const char *name,
+                                    unsigned int fields,
+                                    unsigned int field)
+{
+	if (!(fields & field))
+		return NULL;
+
+	return udev_device_get_sysattr_value(udev_device, name);
+}
+
+static long usb_udev_sysattr_number(struct udev_device *udev_device,
+                                    const char *name,
+                                    unsigned int fields,
+                                    unsigned int field)
+{
+	const char *value = usb_udev_sysattr(udev_device, name, fields, field);
+
+	return value ? atol(value) : 0;
+}
+
+/*
+ * Like usb_udev_sysattr, for properties from the udev database.
+ */
+static const char *usb_udev_property(struct udev_device *udev_device,
+                                     const char *name,
+                                     unsigned int fields,
+                                     unsigned int field)
+{
+	if (!(fields & field))
+		return NULL;
+
+	return udev_device_get_property_value(udev_device, name);
+}
+
+/*
+ * Copy a udev string into the arena, with missing values becoming empty.
+ */
+static char *usb_strdup(struct arena *arena, const char *str)
+{
+	return arena_strdup(arena, str ? str : "");
+}
+
+/*
+ * Like usb_strdup, for values shared by many devices.
+ */
+static char *usb_intern(struct arena *arena, const char *str)
+{
+	return arena_intern(arena, str ? str : "");
+}
+
+/*
+ * Add the device of a block disk to the list, or return NULL if the disk is
+ * not a SCSI disk behind a USB mass storage device, or filter is given and
+ * rejects the device.
+ */
+static struct usb_device *usb_device_list_add_from_block(struct usb_device_list *list,
+                                                         struct udev_device *block_device,
+                                                         const struct usb_filter *filter)
+{
+	struct udev_device *scsi_device = udev_device_get_parent_with_subsystem_devtype(block_device,
+	                                                                               "scsi",
+	                                                                               "scsi_device");
+	const char *driver = scsi_device ? udev_device_get_driver(scsi_device) : NULL;
+	struct udev_device *usb_device = NULL;
+
+	if (driver && strcmp(driver, "sd") == 0)
+		usb_device = udev_device_get_parent_with_subsystem_devtype(scsi_device,
+		                                                           "usb",
+		                                                           "usb_device");
+
+	if (!usb_device)
+		return NULL;
+
+	struct usb_device device;
+
+	usb_device_init_from_udev(list->arena,
+	                          &device,
+	                          usb_device,
+	                          block_device,
+	                          usb_udev_scsi_lun(scsi_device),
+	                          list->fields);
+
+	if (filter && !usb_filter_match_device(filter, &device))
+		return NULL;
+
+	return usb_device_list_add(list, &device);
+}
+
+/*
+ * Build the device list through the selected source, with only the given
+ * fields loaded. Devices filter rejects are left out along with their
+ * partitions, which are still to be filtered with usb_device_list_filter.
+ */
+static struct usb_device_list *usb_device_list_get(unsigned int fields,
+                                                  const struct usb_filter *filter)
+{
+	uint64_t start = timing_start();
+	struct usb_device_list *list = device_source.list_get(&device_source, fields, filter);
+
+	timing_stop(start, "enumerate", NULL);
+
+	return list;
+}
+
+/*
+ * Enumerate through libudev, the fallback for when sysfs cannot be read
+ * directly, from a single scan of the block subsystem.
+ *
+ * Every USB disk (one per LUN) and every partition is visited exactly once.
+ * Disks are recorded in an index keyed by their sysfs path, and partitions
+ * are attached to their parent disk afterwards by looking up the directory
+ * containing the partition in that index. Partitions are counted per disk
+ * first, so that they all go into a single array, each disk owning a range.
+ *
+ * Only the given fields are loaded, and partitions are skipped altogether
+ * unless FIELD_PARTITIONS is among them. Filesystems of devices udev has not
+ * processed, as in containers without a udev database, are probed directly.
+ * A filter is pushed down into the scan, and devices it rejects are left out
+ * along with their partitions.
+ */
+static struct usb_device_list *usb_udev_device_list_get(const struct usb_source *source,
+                                                       unsigned int fields,
+                                                       const struct usb_filter *filter)
+{
+	struct udev *udev = udev_new();
+
+	if (!udev)
+		err(EXIT_FAILURE, NULL);
+
+	struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+
+	udev_enumerate_add_match_subsystem(enumerate, "block");
+
+	if (filter)
+		usb_filter_push_down(filter, enumerate);
+
+	udev_enumerate_scan_devices(enumerate);
+
+	struct udev_list_entry *device_entry = udev_enumerate_get_list_entry(enumerate);
+	struct usb_device_list *list = usb_device_list_new(arena_new());
+	struct arena *scratch = arena_new();
+
+	list->fields = fields;
+
+	struct usb_udev_index_entry *index = NULL;
+	struct usb_probe_target_list probe_targets = {NULL, 0, 0};
+	struct udev_device **partition_devices = NULL;
+	struct usb_udev_index_entry **partition_parents = NULL;
+	size_t num_index_entries = 0;
+	size_t num_partition_devices = 0;
+	size_t size_index = 0;
+	size_t size_partition_devices = 0;
+
+	while (device_entry) {
+		const char *device_name = udev_list_entry_get_name(device_entry);
+		struct udev_device *block_device = udev_device_new_from_syspath(udev, device_name);
+		const char *dev_type = block_device ? udev_device_get_devtype(block_device) : NULL;
+
+		device_entry = udev_list_entry_get_next(device_entry);
+
+		if (dev_type && strcmp(dev_type, "partition") == 0 && (fields & FIELD_PARTITIONS)) {
+			if (num_partition_devices == size_partition_devices) {
+				size_partition_devices = size_partition_devices ? size_partition_devices * 2 : 16;
+				partition_devices = realloc(partition_devices,
+				                            size_partition_devices * sizeof(struct udev_device *));
+
+				if (!partition_devices)
+					err(EXIT_FAILURE, NULL);
+			}
+
+			partition_devices[num_partition_devices++] = block_device;
+
+			continue;
+		}
+
+		if (!dev_type || strcmp(dev_type, "disk") != 0) {
+			udev_device_unref(block_device);
+
+			continue;
+		}
+
+		struct usb_device *device = usb_device_list_add_from_block(list, block_device, filter);
+
+		errno = 0;
+
+		if (device) {
+			if (num_index_entries == size_index) {
+				size_index = size_index ? size_index * 2 : 16;
+				index = realloc(index, size_index * sizeof(struct usb_udev_index_entry));
+
+				if (!index)
+					err(EXIT_FAILURE, NULL);
+			}
+
+			index[num_index_entries].sys_path = arena_strdup(scratch,
+			                                                 udev_device_get_syspath(block_device));
+			index[num_index_entries].device = device - list->devices;
+			num_index_entries++;
+
+			if ((fields & FIELD_FS) && !udev_device_get_is_initialized(block_device))
+				usb_probe_target_list_add(&probe_targets,
+				                          udev_device_get_devnum(block_device),
+				                          device - list->devices,
+				                          SIZE_MAX);
+		}
+
+		udev_device_unref(block_device);
+	}
+
+	qsort(index, num_index_entries, sizeof(struct usb_udev_index_entry), usb_udev_index_compare);
+
+	partition_parents = malloc((num_partition_devices + 1) * sizeof(struct usb_udev_index_entry *));
+
+	if (!partition_parents)
+		err(EXIT_FAILURE, NULL);
+
+	size_t num_partitions = 0;
+
+	for (size_t i = 0; i < num_partition_devices; i++) {
+		char *parent_sys_path = arena_strdup(scratch, udev_device_get_syspath(partition_devices[i]));
+		char *separator = strrchr(parent_sys_path, '/');
+
+		if (separator)
+			*separator = '\0';
+
+		partition_parents[i] = usb_udev_index_find(index, num_index_entries, parent_sys_path);
+
+		if (partition_parents[i]) {
+			list->devices[partition_parents[i]->device].num_partitions++;
+			num_partitions++;
+		}
+	}
+
+	struct usb_partition *partitions = arena_alloc(list->arena,
+	                                               num_partitions * sizeof(struct usb_partition));
+
+	for (size_t i = 0; i < list->num_devices; i++) {
+		list->devices[i].partitions = partitions;
+		partitions += list->devices[i].num_partitions;
+		list->devices[i].num_partitions = 0;
+	}
+
+	for (size_t i = 0; i < num_partition_devices; i++) {
+		if (partition_parents[i]) {
+			struct usb_device *device = &list->devices[partition_parents[i]->device];
+
+			if ((fields & FIELD_FS) && !udev_device_get_is_initialized(partition_devices[i]))
+				usb_probe_target_list_add(&probe_targets,
+				                          udev_device_get_devnum(partition_devices[i]),
+				                          partition_parents[i]->device,
+				                          device->num_partitions);
+
+			usb_partition_init_from_udev(list->arena,
+			                             &device->partitions[device->num_partitions++],
+			                             device,
+			                             partition_devices[i],
+			                             list->fields);
+		}
+
+		udev_device_unref(partition_devices[i]);
+	}
+
+	usb_device_list_probe(list, &probe_targets);
+
+	arena_free(scratch);
+
+	free(index);
+	free(partition_parents);
+	free(partition_devices);
+	free(probe_targets.targets);
 
-	usb_device_list_free(head);
+	udev_enumerate_unref(enumerate);
 
-	return retcode;
+	udev_unref(udev);
+
+	return list;
 }
 
-int usb_umount_all()
+/*
+ * Enumerate by walking /sys/class/block on held directory fds, without
+ * libudev. Attributes come from sysfs and, for filesystem data only, from
+ * the udev database files, and block devices are visited in the order udev
+ * enumerates them, so the list is the one usb_udev_device_list_get builds,
+ * from the same single pass with the same index, probing and filtering.
+ * Falls back to libudev when sysfs cannot be opened under the source root.
+ */
+static struct usb_device_list *usb_sysfs_device_list_get(const struct usb_source *source,
+                                                        unsigned int fields,
+                                                        const struct usb_filter *filter)
 {
-	int retcode = 0;
-	int umount_retcode = 0;
-	struct usb_device_list *list = usb_device_list_get();
-	struct usb_device_list *head = list;
+	struct usb_sysfs *sysfs = malloc(sizeof(struct usb_sysfs));
+	int root_fd = open(source->root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	int block_fd = -1;
 
-	while (list && list->device) {
-		if ((umount_retcode = usb_umount_device(list->device)))
-			retcode = umount_retcode;
+	if (!sysfs)
+		err(EXIT_FAILURE, NULL);
 
-		list = list->next;
-	}
+	sysfs->sys_fd = -1;
+	sysfs->udev_fd = -1;
 
-	usb_device_list_free(head);
+	if (root_fd != -1) {
+		sysfs->sys_fd = openat(root_fd, SYSFS_PATH, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		sysfs->udev_fd = openat(root_fd, UDEV_DATA_PATH, O_PATH | O_DIRECTORY | O_CLOEXEC);
 
-	return retcode;
-}
+		close(root_fd);
+	}
 
-static char *human_readable_size(size_t num_bytes, int human_readable_mode)
-{
-	char *human_readable_size;
-	int retcode = 0;
+	if (sysfs->sys_fd != -1)
+		block_fd = openat(sysfs->sys_fd, SYSFS_BLOCK_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-	if (human_readable_mode == 0) {
-		retcode = asprintf(&human_readable_size, "%lu", num_bytes);
+	if (block_fd == -1) {
+		if (sysfs->sys_fd != -1)
+			close(sysfs->sys_fd);
 
-		if (retcode == -1)
-			err(EXIT_FAILURE, NULL);
+		if (sysfs->udev_fd != -1)
+			close(sysfs->udev_fd);
 
-		return human_readable_size;
+		free(sysfs);
+
+		return usb_udev_device_list_get(source, fields, filter);
 	}
 
-	int power;
-	char *suffixes[] = {
-		"K",
-		"M",
-		"G",
-		"T",
-		"P",
-		"E",
-		"Z",
-		"Y",
-		NULL
-	};
+	struct usb_device_list *list = usb_device_list_new(arena_new());
+	struct arena *scratch = arena_new();
 
-	if (human_readable_mode == 1)
-		power = 1024;
+	list->fields = fields;
 
-	else
-		power = 1000;
+	struct usb_sysfs_entry *entries = NULL;
+	struct usb_udev_index_entry *index = NULL;
+	struct usb_probe_target_list probe_targets = {NULL, 0, 0};
+	struct usb_sysfs_entry **partition_entries = NULL;
+	struct usb_udev_index_entry **partition_parents = NULL;
+	size_t num_entries = 0;
+	size_t num_index_entries = 0;
+	size_t num_partition_entries = 0;
+	size_t size_entries = 0;
+	char buffer[8192];
+	char link[PATH_MAX];
+	long num_read = 0;
 
-	if (num_bytes < power) {
-		retcode = asprintf(&human_readable_size, "%lu", num_bytes);
+	while ((num_read = syscall(SYS_getdents64, block_fd, buffer, sizeof(buffer))) > 0) {
+		for (long offset = 0; offset < num_read;) {
+			struct usb_sysfs_dirent *dirent = (struct usb_sysfs_dirent *)(buffer + offset);
+			ssize_t link_size = 0;
 
-		if (retcode == -1)
-			err(EXIT_FAILURE, NULL);
+			offset += dirent->d_reclen;
 
-		return human_readable_size;
-	}
+			if (dirent->d_name[0] == '.')
+				continue;
 
-	int i = 0;
-	long double size = num_bytes;
+			link_size = readlinkat(block_fd, dirent->d_name, link, sizeof(link) - 1);
 
-	while (suffixes[i] != NULL) {
-		size /= power;
+			timing_count(TIMING_SYSFS);
 
-		if (size < power || suffixes[i + 1] == NULL)
-			break;
+			/*
+			 * Entries link to ../../devices/..., which is
+			 * devices/... relative to /sys.
+			 */
+			if (link_size < 6 || strncmp(link, "../../", 6) != 0)
+				continue;
 
-		i++;
-	}
+			link[link_size] = '\0';
 
-	retcode = asprintf(&human_readable_size, "%lu%s", (size_t)size, suffixes[i]);
+			if (num_entries == size_entries) {
+				size_entries = size_entries ? size_entries * 2 : 16;
+				entries = realloc(entries, size_entries * sizeof(struct usb_sysfs_entry));
 
-	if (retcode == -1)
-		err(EXIT_FAILURE, NULL);
+				if (!entries)
+					err(EXIT_FAILURE, NULL);
+			}
 
-	return human_readable_size;
-}
+			entries[num_entries].path = arena_strdup(scratch, link + 6);
 
-static char *trim(char *str)
-{
-	char *end;
+			if (usb_sysfs_entry_init(sysfs, scratch, &entries[num_entries]) == 0)
+				num_entries++;
+		}
+	}
 
-	while (isspace(*str))
-		str++;
+	close(block_fd);
 
-	if (*str == 0)
-		return str;
+	qsort(entries, num_entries, sizeof(struct usb_sysfs_entry), usb_sysfs_entry_compare);
 
-	end = str + strlen(str) - 1;
+	index = malloc((num_entries + 1) * sizeof(struct usb_udev_index_entry));
+	partition_entries = malloc((num_entries + 1) * sizeof(struct usb_sysfs_entry *));
+	partition_parents = malloc((num_entries + 1) * sizeof(struct usb_udev_index_entry *));
 
-	while (end > str && isspace(*end))
-		end--;
+	if (!index || !partition_entries || !partition_parents)
+		err(EXIT_FAILURE, NULL);
 
-	*(end + 1) = 0;
+	for (size_t i = 0; i < num_entries; i++) {
+		struct usb_sysfs_entry *entry = &entries[i];
 
-	return str;
-}
+		if (entry->is_partition) {
+			if (fields & FIELD_PARTITIONS)
+				partition_entries[num_partition_entries++] = entry;
 
-static void usb_device_list_add(struct usb_device_list *list, struct usb_device *device)
-{
-	if (!list->device) {
-		list->device = device;
-	} else {
-		while (list->next) {
-			list = list->next;
+			continue;
 		}
 
-		list->next = usb_device_list_new();
-		list->next->device = device;
+		struct usb_device *device = usb_device_list_add_from_sysfs(list, sysfs, entry, filter);
+
+		if (!device)
+			continue;
+
+		index[num_index_entries].sys_path = entry->path;
+		index[num_index_entries].device = device - list->devices;
+		num_index_entries++;
+
+		if ((fields & FIELD_FS) && !entry->is_initialized)
+			usb_probe_target_list_add(&probe_targets, entry->devnum, device - list->devices, SIZE_MAX);
 	}
-}
 
-static struct usb_device_list *usb_device_list_new()
-{
-	struct usb_device_list *list = malloc(sizeof(struct usb_device_list));
+	qsort(index, num_index_entries, sizeof(struct usb_udev_index_entry), usb_udev_index_compare);
 
-	if (!list)
-		err(EXIT_FAILURE, NULL);
+	size_t num_partitions = 0;
 
-	memset(list, 0, sizeof(struct usb_device_list));
+	for (size_t i = 0; i < num_partition_entries; i++) {
+		char *parent_sys_path = arena_strdup(scratch, partition_entries[i]->path);
+		char *separator = strrchr(parent_sys_path, '/');
 
-	return list;
-}
+		if (separator)
+			*separator = '\0';
 
-static size_t usb_device_list_table_max_width_node(struct usb_device_list *list)
-{
-	size_t max = strlen(HEADER_NODE);
+		partition_parents[i] = usb_udev_index_find(index, num_index_entries, parent_sys_path);
 
-	while (list && list->device) {
-		size_t size = strlen(list->device->node);
+		if (partition_parents[i]) {
+			list->devices[partition_parents[i]->device].num_partitions++;
+			num_partitions++;
+		}
+	}
 
-		if (size > max)
-			max = size;
+	struct usb_partition *partitions = arena_alloc(list->arena,
+	                                               num_partitions * sizeof(struct usb_partition));
 
-		struct usb_partition_list *partition_list = list->device->partition_list;
+	for (size_t i = 0; i < list->num_devices; i++) {
+		list->devices[i].partitions = partitions;
+		partitions += list->devices[i].num_partitions;
+		list->devices[i].num_partitions = 0;
+	}
 
-		while (partition_list && partition_list->partition) {
-			size = strlen(partition_list->partition->node) + 4;
+	for (size_t i = 0; i < num_partition_entries; i++) {
+		if (!partition_parents[i])
+			continue;
 
-			if (size > max)
-				max = size;
+		struct usb_device *device = &list->devices[partition_parents[i]->device];
 
-			partition_list = partition_list->next;
-		}
+		usb_partition_init_from_sysfs(list->arena,
+		                              sysfs,
+		                              &device->partitions[device->num_partitions],
+		                              device,
+		                              partition_entries[i],
+		                              list->fields);
 
-		list = list->next;
-	}
+		if ((fields & FIELD_FS) && !partition_entries[i]->is_initialized)
+			usb_probe_target_list_add(&probe_targets,
+			                          partition_entries[i]->devnum,
+			                          partition_parents[i]->device,
+			                          device->num_partitions);
 
-	return max;
-}
+		device->num_partitions++;
+	}
 
-static size_t usb_device_list_table_max_width_manufacturer(struct usb_device_list *list)
-{
-	size_t max = strlen(HEADER_MANUFACTURER);
-	size_t size = strlen(CELL_NA);
+	usb_device_list_probe(list, &probe_targets);
 
-	if (size > max)
-		max = size;
+	close(sysfs->sys_fd);
 
-	while (list && list->device) {
-		size = strlen(list->device->manufacturer);
+	if (sysfs->udev_fd != -1)
+		close(sysfs->udev_fd);
 
-		if (size > max)
-			max = size;
+	arena_free(scratch);
 
-		list = list->next;
-	}
+	free(sysfs);
+	free(entries);
+	free(index);
+	free(partition_entries);
+	free(partition_parents);
+	free(probe_targets.targets);
 
-	return max;
+	return list;
 }
 
-static size_t usb_device_list_table_max_width_product(struct usb_device_list *list)
+/*
+ * Fill in the node, number and type of the block device at entry->path from
+ * its uevent file, returning -1 if it has no node.
+ */
+static int usb_sysfs_entry_init(struct usb_sysfs *sysfs,
+                                struct arena *arena,
+                                struct usb_sysfs_entry *entry)
 {
-	size_t max = strlen(HEADER_PRODUCT);
-	size_t size = strlen(CELL_NA);
+	char path[PATH_MAX];
+	char *line = NULL;
+	char *save = NULL;
+	unsigned int major_num = 0;
+	unsigned int minor_num = 0;
+
+	entry->node = NULL;
+	entry->is_partition = 0;
+	entry->is_initialized = 0;
+
+	snprintf(path, sizeof(path), "%s/uevent", entry->path);
+
+	if (usb_sysfs_read(sysfs->sys_fd, path, sysfs->value, sizeof(sysfs->value)) == -1)
+		return -1;
+
+	for (line = strtok_r(sysfs->value, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		const char *value = NULL;
+
+		if ((value = usb_sysfs_value(line, "DEVNAME"))) {
+			entry->node = arena_alloc(arena, strlen(value) + 6);
+
+			sprintf(entry->node, "/dev/%s", value);
+		} else if ((value = usb_sysfs_value(line, "DEVTYPE"))) {
+			entry->is_partition = strcmp(value, "partition") == 0;
+		} else if ((value = usb_sysfs_value(line, "MAJOR"))) {
+			major_num = atoi(value);
+		} else if ((value = usb_sysfs_value(line, "MINOR"))) {
+			minor_num = atoi(value);
+		}
+	}
 
-	if (size > max)
-		max = size;
+	entry->devnum = makedev(major_num, minor_num);
 
-	while (list && list->device) {
-		size = strlen(list->device->product);
+	return entry->node ? 0 : -1;
+}
 
-		if (size > max)
-			max = size;
+/*
+ * Order entries by path as udev does, comparing component by component so
+ * that a device sorts right before its children.
+ */
+static int usb_sysfs_entry_compare(const void *a, const void *b)
+{
+	const unsigned char *path_a = (const unsigned char *)((const struct usb_sysfs_entry *)a)->path;
+	const unsigned char *path_b = (const unsigned char *)((const struct usb_sysfs_entry *)b)->path;
 
-		list = list->next;
+	while (*path_a && *path_a == *path_b) {
+		path_a++;
+		path_b++;
 	}
 
-	return max;
+	return (*path_a == '/' ? 1 : *path_a ? *path_a + 1 : 0)
+	     - (*path_b == '/' ? 1 : *path_b ? *path_b + 1 : 0);
 }
 
-static size_t usb_device_list_table_max_width_size(struct usb_device_list *list,
-                                                   int human_readable_mode)
+/*
+ * Like usb_device_list_add_from_block, for the disk at entry. The SCSI device
+ * is the parent of the disk's block directory, and the USB device the closest
+ * ancestor of that in the usb subsystem with a devpath.
+ */
+static struct usb_device *usb_device_list_add_from_sysfs(struct usb_device_list *list,
+                                                         struct usb_sysfs *sysfs,
+                                                         struct usb_sysfs_entry *entry,
+                                                         const struct usb_filter *filter)
 {
-	size_t max = strlen(HEADER_SIZE);
-	char *size_str = NULL;
-
-	while (list && list->device) {
-		size_str = human_readable_size(list->device->size, human_readable_mode);
-		size_t size = strlen(size_str);
-		free(size_str);
+	char scsi_dir[PATH_MAX];
+	char usb_dir[PATH_MAX];
+	char *separator = NULL;
 
-		if (size > max)
-			max = size;
+	snprintf(scsi_dir, sizeof(scsi_dir), "%s", entry->path);
 
-		struct usb_partition_list *partition_list = list->device->partition_list;
+	if (!(separator = strrchr(scsi_dir, '/')))
+		return NULL;
 
-		while (partition_list && partition_list->partition) {
-			size_str = human_readable_size(partition_list->partition->size, human_readable_mode);
-			size = strlen(size_str) + 4;
-			free(size_str);
+	*separator = '\0';
 
-			if (size > max)
-				max = size;
+	if (!(separator = strrchr(scsi_dir, '/')) || strcmp(separator, "/block") != 0)
+		return NULL;
 
-			partition_list = partition_list->next;
-		}
+	*separator = '\0';
 
-		list = list->next;
-	}
+	if (!usb_sysfs_link_is(sysfs, scsi_dir, "subsystem", "scsi")
+	    || !usb_sysfs_link_is(sysfs, scsi_dir, "driver", "sd"))
+		return NULL;
 
-	return max;
-}
+	snprintf(usb_dir, sizeof(usb_dir), "%s", scsi_dir);
 
-static size_t usb_device_list_table_max_width_label(struct usb_device_list *list)
-{
-	size_t max = strlen(HEADER_LABEL);
-	size_t size = strlen(CELL_NONE);
+	while ((separator = strrchr(usb_dir, '/'))) {
+		*separator = '\0';
 
-	if (size > max)
-		max = size;
+		if (usb_sysfs_link_is(sysfs, usb_dir, "subsystem", "usb")
+		    && usb_sysfs_attr_value(sysfs, usb_dir, "devpath"))
+			break;
+	}
 
-	while (list && list->device) {
-		size = strlen(list->device->label);
+	if (!separator)
+		return NULL;
 
-		if (size > max)
-			max = size;
+	struct usb_device device;
+	const char *lun = strrchr(scsi_dir, ':');
 
-		struct usb_partition_list *partition_list = list->device->partition_list;
+	usb_device_init_from_sysfs(list->arena,
+	                           sysfs,
+	                           &device,
+	                           usb_dir,
+	                           entry,
+	                           lun ? atoi(lun + 1) : 0,
+	                           list->fields);
 
-		while (partition_list && partition_list->partition) {
-			size = strlen(partition_list->partition->label) + 4;
+	if (filter && !usb_filter_match_device(filter, &device))
+		return NULL;
 
-			if (size > max)
-				max = size;
+	return usb_device_list_add(list, &device);
+}
 
-			partition_list = partition_list->next;
-		}
+static void usb_device_init_from_sysfs(struct arena *arena,
+                                       struct usb_sysfs *sysfs,
+                                       struct usb_device *device,
+                                       const char *usb_dir,
+                                       struct usb_sysfs_entry *entry,
+                                       int lun,
+                                       unsigned int fields)
+{
+	struct usb_sysfs_fs fs = {NULL, NULL, NULL};
+	const char *dev_path = NULL;
+
+	device->node = usb_strdup(arena, entry->node);
+	device->manufacturer = usb_intern(arena, usb_sysfs_attr(sysfs,
+	                                                        usb_dir,
+	                                                        "manufacturer",
+	                                                        fields,
+	                                                        FIELD_MANUFACTURER));
+	device->product = usb_intern(arena,
+	                             usb_sysfs_attr(sysfs, usb_dir, "product", fields, FIELD_PRODUCT));
+	device->serial = usb_strdup(arena,
+	                            usb_sysfs_attr(sysfs, usb_dir, "serial", fields, FIELD_SERIAL));
+
+	dev_path = usb_sysfs_attr_value(sysfs, usb_dir, "devpath");
+
+	if (!dev_path)
+		dev_path = "";
+
+	if (lun == 0) {
+		device->dev_path = usb_strdup(arena, dev_path);
+	} else {
+		device->dev_path = arena_alloc(arena, strlen(dev_path) + 12);
 
-		list = list->next;
+		sprintf(device->dev_path, "%s:%d", dev_path, lun);
 	}
 
-	return max;
+	if (fields & FIELD_FS)
+		entry->is_initialized = usb_sysfs_udev_data(sysfs, entry->devnum, &fs);
+
+	device->label = usb_strdup(arena, fs.label);
+	device->uuid = usb_strdup(arena, fs.uuid);
+	device->type = usb_intern(arena, fs.type);
+	device->sys_path = arena_alloc(arena, strlen(usb_dir) + 6);
+
+	sprintf(device->sys_path, "/sys/%s", usb_dir);
+
+	device->speed = usb_intern(arena, usb_sysfs_attr(sysfs, usb_dir, "speed", fields, FIELD_SPEED));
+	device->version = usb_intern(arena,
+	                             usb_sysfs_attr(sysfs, usb_dir, "version", fields, FIELD_VERSION));
+	device->max_children = usb_sysfs_attr_number(sysfs,
+	                                             usb_dir,
+	                                             "maxchild",
+	                                             fields,
+	                                             FIELD_MAX_CHILDREN);
+	device->bus = usb_sysfs_attr_number(sysfs, usb_dir, "busnum", fields, FIELD_BUS);
+	device->lun = lun;
+	device->size = usb_sysfs_attr_number(sysfs, entry->path, "size", fields, FIELD_SIZE)
+	             * (size_t)512;
+	device->partitions = NULL;
+	device->num_partitions = 0;
 }
 
-static size_t usb_device_list_table_max_width_type(struct usb_device_list *list)
+static void usb_partition_init_from_sysfs(struct arena *arena,
+                                          struct usb_sysfs *sysfs,
+                                          struct usb_partition *partition,
+                                          struct usb_device *device,
+                                          struct usb_sysfs_entry *entry,
+                                          unsigned int fields)
 {
-	size_t max = strlen(HEADER_TYPE);
-	size_t size = strlen(CELL_UNKNOWN);
+	struct usb_sysfs_fs fs = {NULL, NULL, NULL};
+	const char *partition_num = usb_sysfs_attr_value(sysfs, entry->path, "partition");
 
-	if (size > max)
-		max = size;
+	if (!partition_num)
+		partition_num = "0";
 
-	while (list && list->device) {
-		size = strlen(list->device->type);
+	partition->device = device;
+	partition->node = usb_strdup(arena, entry->node);
+	partition->sys_path = arena_alloc(arena, strlen(entry->path) + 6);
 
-		if (size > max)
-			max = size;
+	sprintf(partition->sys_path, "/sys/%s", entry->path);
 
-		struct usb_partition_list *partition_list = list->device->partition_list;
+	partition->devnum = entry->devnum;
+	partition->num = atoi(partition_num);
+	partition->dev_path = arena_alloc(arena, strlen(device->dev_path) + strlen(partition_num) + 2);
 
-		while (partition_list && partition_list->partition) {
-			size = strlen(partition_list->partition->type) + 4;
+	sprintf(partition->dev_path, "%s-%s", device->dev_path, partition_num);
 
-			if (size > max)
-				max = size;
+	partition->size = usb_sysfs_attr_number(sysfs, entry->path, "size", fields, FIELD_SIZE)
+	                * (size_t)512;
 
-			partition_list = partition_list->next;
-		}
-
-		list = list->next;
-	}
+	if (fields & FIELD_FS)
+		entry->is_initialized = usb_sysfs_udev_data(sysfs, entry->devnum, &fs);
 
-	return max;
+	partition->label = usb_strdup(arena, fs.label);
+	partition->uuid = usb_strdup(arena, fs.uuid);
+	partition->type = usb_intern(arena, fs.type);
 }
 
-static size_t usb_device_list_table_max_width_dev_path(struct usb_device_list *list)
+/*
+ * Read the file at path relative to dir_fd into buf with a single pread,
+ * dropping trailing newlines as udev does, and return its length or -1.
+ */
+static int usb_sysfs_read(int dir_fd, const char *path, char *buf, size_t size)
 {
-	size_t max = strlen(HEADER_DEV_PATH);
+	int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+	ssize_t num_read = 0;
 
-	while (list && list->device) {
-		size_t size = strlen(list->device->dev_path);
+	timing_count(TIMING_SYSFS);
 
-		if (size > max)
-			max = size;
+	if (fd == -1)
+		return -1;
 
-		struct usb_partition_list *partition_list = list->device->partition_list;
+	num_read = pread(fd, buf, size - 1, 0);
 
-		while (partition_list && partition_list->partition) {
-			size = strlen(partition_list->partition->dev_path) + 4;
+	close(fd);
 
-			if (size > max)
-				max = size;
+	if (num_read < 0)
+		return -1;
 
-			partition_list = partition_list->next;
-		}
+	while (num_read > 0 && buf[num_read - 1] == '\n')
+		num_read--;
 
-		list = list->next;
-	}
+	buf[num_read] = '\0';
 
-	return max;
+	return num_read;
 }
 
-static size_t usb_device_list_table_max_width_mounted(struct usb_device_list *list)
+/*
+ * Read the attribute name of the device at dir. The value lives until the
+ * next attribute is read.
+ */
+static const char *usb_sysfs_attr_value(struct usb_sysfs *sysfs, const char *dir, const char *name)
 {
-	size_t max = strlen(HEADER_MOUNTED);
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
 
-	max = strlen(CELL_YES) + 4 > max ? strlen(CELL_YES) + 4 : max;
-	max = strlen(CELL_NO) + 4 > max ? strlen(CELL_NO) + 4 : max;
+	if (usb_sysfs_read(sysfs->sys_fd, path, sysfs->value, sizeof(sysfs->value)) == -1)
+		return NULL;
 
-	return max;
+	return sysfs->value;
 }
 
-static char *usb_device_list_detail_str(struct usb_device_list *list, int human_readable_mode)
+/*
+ * Like usb_udev_sysattr, for the sysfs source.
+ */
+static const char *usb_sysfs_attr(struct usb_sysfs *sysfs,
+                                  const char *dir,
+                                  const char *name,
+                                  unsigned int fields,
+                                  unsigned int field)
 {
-	char *old_detail_str = NULL;
-	char *size = NULL;
-	int retcode = 0;
-	char *detail_str = malloc(1);
+	if (!(fields & field))
+		return NULL;
 
-	if (!detail_str)
-		err(EXIT_FAILURE, NULL);
+	return usb_sysfs_attr_value(sysfs, dir, name);
+}
 
-	detail_str[0] = '\0';
-
-	while (list && list->device) {
-		size = human_readable_size(list->device->size, human_readable_mode);
-		old_detail_str = detail_str;
-
-		retcode = asprintf(&detail_str,
-		                   "%s"
-		                   "%s:        \t%s\n"
-		                   "%s:         \t%d\n"
-		                   "%s:    \t%s\n"
-		                   "%s:        \t%s\n"
-		                   "%s:       \t%s\n"
-		                   "%s:        \t%s\n"
-		                   "%s:\t%s\n"
-		                   "%s:     \t%s\n"
-		                   "%s:      \t%s\n"
-		                   "%s:    \t%s\n"
-		                   "%s:     \t%s\n"
-		                   "%s:       \t%s",
-		                   old_detail_str,
-		                   HEADER_NODE,
-		                   list->device->node,
-		                   HEADER_BUS,
-		                   list->device->bus,
-		                   HEADER_DEV_PATH,
-		                   list->device->dev_path,
-		                   HEADER_SIZE,
-		                   size,
-		                   HEADER_LABEL,
-		                   list->device->label,
-		                   HEADER_TYPE,
-		                   list->device->type,
-		                   HEADER_MANUFACTURER,
-		                   list->device->manufacturer,
-		                   HEADER_PRODUCT,
-		                   list->device->product,
-		                   HEADER_SERIAL,
-		                   list->device->serial,
-		                   HEADER_SYS_PATH,
-		                   list->device->sys_path,
-		                   HEADER_VERSION,
-		                   trim(list->device->version),
-		                   HEADER_SPEED,
-		                   list->device->speed);
+static long usb_sysfs_attr_number(struct usb_sysfs *sysfs,
+                                  const char *dir,
+                                  const char *name,
+                                  unsigned int fields,
+                                  unsigned int field)
+{
+	const char *value = usb_sysfs_attr(sysfs, dir, name, fields, field);
 
-		if (retcode == -1)
-			err(EXIT_FAILURE, NULL);
+	return value ? atol(value) : 0;
+}
 
-		free(old_detail_str);
-		free(size);
+/*
+ * Whether the link name of the device at dir, such as its subsystem or
+ * driver, points at a directory called target.
+ */
+static int usb_sysfs_link_is(struct usb_sysfs *sysfs,
+                             const char *dir,
+                             const char *name,
+                             const char *target)
+{
+	char path[PATH_MAX];
+	char link[PATH_MAX];
+	ssize_t link_size = 0;
 
-		struct usb_partition_list *partition_list = list->device->partition_list;
-
-		while (partition_list && partition_list->partition) {
-			size = human_readable_size(partition_list->partition->size, human_readable_mode);
-			old_detail_str = detail_str;
-
-			retcode = asprintf(&detail_str,
-			                   "%s\n"
-			                   "%s:   \t%d\n"
-			                   "    %s:    \t    %s\n"
-			                   "    %s: \t    %s\n"
-			                   "    %s:    \t    %s\n"
-			                   "    %s:   \t    %s\n"
-			                   "    %s:    \t    %s\n"
-			                   "    %s:\t    %s",
-			                   old_detail_str,
-			                   HEADER_PARTITION,
-			                   partition_list->partition->num,
-			                   HEADER_NODE,
-			                   partition_list->partition->node,
-			                   HEADER_MOUNTED,
-			                   usb_partition_is_mounted(partition_list->partition) ? CELL_YES : CELL_NO,
-			                   HEADER_SIZE,
-			                   size,
-			                   HEADER_LABEL,
-			                   partition_list->partition->label,
-			                   HEADER_TYPE,
-			                   partition_list->partition->type,
-			                   HEADER_SYS_PATH,
-			                   partition_list->partition->sys_path);
-
-			if (retcode == -1)
-				err(EXIT_FAILURE, NULL);
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	timing_count(TIMING_SYSFS);
 
-			free(old_detail_str);
-			free(size);
+	if ((link_size = readlinkat(sysfs->sys_fd, path, link, sizeof(link) - 1)) == -1)
+		return 0;
 
-			partition_list = partition_list->next;
-		}
+	link[link_size] = '\0';
 
-		if (list->next) {
-			old_detail_str = detail_str;
+	const char *base = strrchr(link, '/');
 
-			retcode = asprintf(&detail_str,
-			                   "%s\n\n",
-			                   old_detail_str);
+	return strcmp(base ? base + 1 : link, target) == 0;
+}
 
-			if (retcode == -1)
-				err(EXIT_FAILURE, NULL);
+/*
+ * Point fs at the filesystem properties in the udev database file of the
+ * block device devnum, which live until the next file is read. Returns
+ * whether udev has processed the device, that is, whether the file exists.
+ */
+static int usb_sysfs_udev_data(struct usb_sysfs *sysfs, dev_t devnum, struct usb_sysfs_fs *fs)
+{
+	char name[32];
+	char *line = NULL;
+	char *save = NULL;
 
-			free(old_detail_str);
-		}
+	if (sysfs->udev_fd == -1)
+		return 0;
 
-		list = list->next;
-	}
+	snprintf(name, sizeof(name), "b%u:%u", major(devnum), minor(devnum));
 
-	if (strlen(detail_str) > 0) {
-		old_detail_str = detail_str;
+	if (usb_sysfs_read(sysfs->udev_fd, name, sysfs->data, sizeof(sysfs->data)) == -1)
+		return 0;
 
-		retcode = asprintf(&detail_str,
-		                   "%s\n",
-		                   old_detail_str);
+	for (line = strtok_r(sysfs->data, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		const char *value = NULL;
 
-		if (retcode == -1)
-			err(EXIT_FAILURE, NULL);
+		if (line[0] != 'E' || line[1] != ':')
+			continue;
 
-		free(old_detail_str);
-	}
+		if ((value = usb_sysfs_value(line + 2, "ID_FS_LABEL")))
+			fs->label = value;
 
-	return detail_str;
-}
+		else if ((value = usb_sysfs_value(line + 2, "ID_FS_UUID")))
+			fs->uuid = value;
 
-static char *usb_device_list_table_label_formatter(const char *str)
-{
-	if (strlen(str) == 0)
-		return (char *)CELL_NONE;
+		else if ((value = usb_sysfs_value(line + 2, "ID_FS_TYPE")))
+			fs->type = value;
+	}
 
-	else
-		return (char *)str;
+	return 1;
 }
 
-static char *usb_device_list_table_type_formatter(const char *str)
+/*
+ * The value of a KEY=value line if its key is key, or NULL.
+ */
+static const char *usb_sysfs_value(const char *line, const char *key)
 {
-	if (strlen(str) == 0)
-		return (char *)CELL_UNKNOWN;
+	size_t key_size = strlen(key);
 
-	else
-		return (char *)str;
+	if (strncmp(line, key, key_size) != 0 || line[key_size] != '=')
+		return NULL;
+
+	return line + key_size + 1;
 }
 
-static char *usb_device_list_table_str(struct usb_device_list *list, int human_readable_mode)
-{
-	size_t width_node = usb_device_list_table_max_width_node(list);
-	size_t width_size = usb_device_list_table_max_width_size(list, human_readable_mode);
-	size_t width_manufacturer = usb_device_list_table_max_width_manufacturer(list);
-	size_t width_product = usb_device_list_table_max_width_product(list);
-	size_t width_label = usb_device_list_table_max_width_label(list);
-	size_t width_type = usb_device_list_table_max_width_type(list);
-	size_t width_dev_path = usb_device_list_table_max_width_dev_path(list);
-	size_t width_mounted = usb_device_list_table_max_width_mounted(list);
-	size_t list_size = usb_device_and_partition_list_size(list);
-	size_t table_line_str_size = width_node + 1 +
-	                             width_dev_path + 1 +
-	                             width_mounted + 1 +
-	                             width_size + 1 +
-	                             width_label + 1 +
-	                             width_type + 1 +
-	                             width_manufacturer + 1 +
-	                             width_product + 1;
-	char *table_fmt_str = NULL;
-	char *table_partition_fmt_str = NULL;
-
-	int retcode = asprintf(&table_fmt_str,
-	                       "%%-%lus\t%%-%lus\t%%-%lus\t%%-%lus\t%%-%lus\t%%-%lus\t%%-%lus\t%%-%lus",
-	                       width_node,
-	                       width_dev_path,
-	                       width_mounted,
-	                       width_size,
-	                       width_label,
-	                       width_type,
-	                       width_manufacturer,
-	                       width_product);
+/*
+ * Generate the fixture of source, num_devices disks with num_partitions
+ * partitions each, sixteen to a root port behind two tiers of four port hubs,
+ * with root ports spread over four buses.
+ * Values are derived from the position of each device, so every run yields
+ * the same list.
+ */
+static struct usb_device_list *usb_fixture_device_list_get(const struct usb_source *source,
+                                                          unsigned int fields,
+                                                          const struct usb_filter *filter)
+{
+	struct usb_device_list *list = usb_device_list_new(arena_new());
+	char name[64];
+	char suffix[16];
 
-	if (retcode == -1)
-		err(EXIT_FAILURE, NULL);
+	list->fields = fields;
 
-	char *child_indicator = " ├─ ";
-	char *child_indicator_final = " ╰─ ";
+	for (size_t i = 0; i < source->num_devices; i++) {
+		struct usb_device device;
+		char *letters = suffix + sizeof(suffix) - 1;
+		int bus = 1 + i / 16 % 4;
 
-	retcode = asprintf(&table_partition_fmt_str,
-	                   "%%s%%-%lus\t%%s%%-%lus\t%%s%%-%lus\t%%s%%-%lus\t%%s%%-%lus\t%%s%%-%lus\t%%s%%-%lus\t%%s%%-%lus",
-	                   width_node - 4,
-	                   width_dev_path - 4,
-	                   width_mounted - 4,
-	                   width_size - 4,
-	                   width_label - 4,
-	                   width_type - 4,
-	                   width_manufacturer - 4,
-	                   width_product - 4);
+		/*
+		 * Disks are named like the kernel names them: sda to sdz, then
+		 * sdaa onwards.
+		 */
+		*letters = '\0';
 
-	if (retcode == -1)
-		err(EXIT_FAILURE, NULL);
+		for (size_t n = i + 1; n; n = (n - 1) / 26)
+			*--letters = 'a' + (n - 1) % 26;
 
-	size_t table_str_size = table_line_str_size * (list_size + 1) + (list_size * 28) + 2;
-	char *table_str = malloc(table_str_size);
+		memset(&device, 0, sizeof(struct usb_device));
 
-	if (!table_str)
-		err(EXIT_FAILURE, NULL);
+		snprintf(name, sizeof(name), "/dev/sd%s", letters);
 
-	table_str[0] = '\0';
-
-	sprintf(table_str,
-	        table_fmt_str,
-	        HEADER_NODE,
-	        HEADER_DEV_PATH,
-	        HEADER_MOUNTED,
-	        HEADER_SIZE,
-	        HEADER_LABEL,
-	        HEADER_TYPE,
-	        HEADER_MANUFACTURER,
-	        HEADER_PRODUCT);
-
-	while (list && list->device) {
-		char *size = human_readable_size(list->device->size, human_readable_mode);
-		sprintf(table_str + strlen(table_str), "\n");
-
-		sprintf(table_str + strlen(table_str),
-		        table_fmt_str,
-		        list->device->node,
-		        list->device->dev_path,
-		        "(n/a)",
-		        size,
-		        usb_device_list_table_label_formatter(list->device->label),
-		        usb_device_list_table_type_formatter(list->device->type),
-		        list->device->manufacturer,
-		        list->device->product);
+		device.node = arena_strdup(list->arena, name);
+		device.manufacturer = usb_intern(list->arena,
+		                                 fields & FIELD_MANUFACTURER ? "Sally" : NULL);
+		device.product = usb_intern(list->arena, fields & FIELD_PRODUCT ? "Fixture Disk" : NULL);
 
-		free(size);
+		snprintf(name, sizeof(name), "FIX%08zu", i);
 
-		struct usb_partition_list *partition_list = list->device->partition_list;
-		char *indicator = NULL;
+		device.serial = usb_strdup(list->arena, fields & FIELD_SERIAL ? name : NULL);
 
-		while (partition_list && partition_list->partition) {
-			size = human_readable_size(partition_list->partition->size, human_readable_mode);
-			sprintf(table_str + strlen(table_str), "\n");
+		snprintf(name, sizeof(name), "%zu.%zu.%zu", i / 16 + 1, i / 4 % 4 + 1, i % 4 + 1);
 
-			if (partition_list->next)
-				indicator = child_indicator;
+		device.dev_path = arena_strdup(list->arena, name);
+		device.label = usb_strdup(list->arena, NULL);
+		device.uuid = usb_strdup(list->arena, NULL);
+		device.type = usb_intern(list->arena, NULL);
 
-			else
-				indicator = child_indicator_final;
-
-			sprintf(table_str + strlen(table_str),
-			        table_partition_fmt_str,
-			        indicator,
-			        partition_list->partition->node,
-			        indicator,
-			        partition_list->partition->dev_path,
-			        indicator,
-			        usb_partition_is_mounted(partition_list->partition) ? CELL_YES : CELL_NO,
-			        indicator,
-			        size,
-			        indicator,
-			        usb_device_list_table_label_formatter(partition_list->partition->label),
-			        indicator,
-			        usb_device_list_table_type_formatter(partition_list->partition->type),
-			        indicator,
-			        "(n/a)",
-			        indicator,
-			        "(n/a)");
+		snprintf(name, sizeof(name), "/sys/devices/fixture/usb%d/%d-%s", bus, bus, device.dev_path);
 
-			free(size);
+		device.sys_path = arena_strdup(list->arena, name);
+		device.version = usb_intern(list->arena,
+		                            fields & FIELD_VERSION ? (i % 2 ? " 2.00" : " 3.00") : NULL);
+		device.speed = usb_intern(list->arena,
+		                          fields & FIELD_SPEED ? (i % 2 ? "480" : "5000") : NULL);
+		device.bus = fields & FIELD_BUS ? bus : 0;
+		device.size = fields & FIELD_SIZE ? (size_t)64 << 30 : 0;
 
-			partition_list = partition_list->next;
-		}
+		if (filter && !usb_filter_match_device(filter, &device))
+			continue;
 
-		list = list->next;
+		usb_device_list_add(list, &device);
 	}
 
-	sprintf(table_str + strlen(table_str), "\n");
-
-	free(table_partition_fmt_str);
-	free(table_fmt_str);
+	if (!(fields & FIELD_PARTITIONS))
+		return list;
 
-	return table_str;
-}
-
-static size_t usb_device_and_partition_list_size(struct usb_device_list *list)
-{
-	size_t size = 0;
+	static const char *const types[] = {"vfat", "exfat", "ext4"};
+	size_t num_partitions = source->num_partitions;
+	struct usb_partition *partitions = arena_alloc(list->arena,
+	                                               list->num_devices * num_partitions
+	                                               * sizeof(struct usb_partition));
 
-	while (list && list->device) {
-		size++;
-		struct usb_partition_list *partition_list = list->device->partition_list;
+	for (size_t i = 0; i < list->num_devices; i++) {
+		struct usb_device *device = &list->devices[i];
 
-		while (partition_list && partition_list->partition) {
-			size++;
+		device->partitions = partitions + i * num_partitions;
+		device->num_partitions = num_partitions;
 
-			partition_list = partition_list->next;
-		}
+		for (size_t j = 0; j < num_partitions; j++) {
+			struct usb_partition *partition = &device->partitions[j];
+			int num = j + 1;
 
-		list = list->next;
-	}
+			partition->device = device;
+			partition->num = num;
 
-	return size;
-}
+			snprintf(name, sizeof(name), "%s%d", device->node, num);
 
-static struct udev_device *usb_udev_device_get_child(struct udev *udev,
-                                                     struct udev_device *parent_device,
-                                                     const char *subsystem)
-{
-	struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+			partition->node = arena_strdup(list->arena, name);
 
-	udev_enumerate_add_match_parent(enumerate, parent_device);
-	udev_enumerate_add_match_subsystem(enumerate, subsystem);
-	udev_enumerate_scan_devices(enumerate);
+			snprintf(name, sizeof(name), "%s-%d", device->dev_path, num);
 
-	struct udev_list_entry *device_entry = udev_enumerate_get_list_entry(enumerate);
-	const char *device_name = udev_list_entry_get_name(device_entry);
-	struct udev_device *child_device = udev_device_new_from_syspath(udev, device_name);
+			partition->dev_path = arena_strdup(list->arena, name);
 
-	udev_enumerate_unref(enumerate);
+			snprintf(name, sizeof(name), "%s/part%d", device->sys_path, num);
 
-	return child_device;
-}
+			partition->sys_path = arena_strdup(list->arena, name);
+			partition->devnum = makedev(FIXTURE_MAJOR, i * (num_partitions + 1) + num);
+			partition->size = fields & FIELD_SIZE ? ((size_t)64 << 30) / num_partitions : 0;
 
-static struct usb_device_list *usb_device_list_get()
-{
-	struct udev *udev = udev_new();
+			snprintf(name, sizeof(name), "FIX%zu_%d", i, num);
 
-	if (!udev)
-		err(EXIT_FAILURE, NULL);
+			partition->label = usb_strdup(list->arena, fields & FIELD_FS ? name : NULL);
 
-	struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+			snprintf(name, sizeof(name), "%04zX-%04X", i & 0xffff, num);
 
-	udev_enumerate_add_match_subsystem(enumerate, "scsi");
-	udev_enumerate_add_match_property(enumerate, "DEVTYPE", "scsi_device");
+			partition->uuid = usb_strdup(list->arena, fields & FIELD_FS ? name : NULL);
+			partition->type = usb_intern(list->arena, fields & FIELD_FS ? types[j % 3] : NULL);
+		}
+	}
 
-	udev_enumerate_scan_devices(enumerate);
-	struct udev_list_entry *device_entry = udev_enumerate_get_list_entry(enumerate);
-	struct usb_device_list *list = usb_device_list_new();
+	return list;
+}
 
-	while (device_entry) {
-		const char *device_name = udev_list_entry_get_name(device_entry);
-		struct udev_device *scsi_device = udev_device_new_from_syspath(udev, device_name);
-		struct udev_device *usb_device = udev_device_get_parent_with_subsystem_devtype(scsi_device,
-		                                                                               "usb",
-		                                                                               "usb_device");
-		struct udev_device *block_device = usb_udev_device_get_child(udev, scsi_device, "block");
-		struct udev_device *scsi_disk_device = usb_udev_device_get_child(udev, scsi_device,
-		                                                                 "scsi_disk");
+/*
+ * Select where device lists come from, sysfs, sysfs:ROOT for a tree under
+ * ROOT, udev or fixture:NxM, returning -1 if source is none of them.
+ */
+int usb_source_set(const char *source)
+{
+	size_t prefix_size = strlen(SOURCE_FIXTURE);
+	char *end = NULL;
 
-		errno = 0;
+	if (strcmp(source, SOURCE_UDEV) == 0) {
+		device_source.list_get = usb_udev_device_list_get;
 
-		if (usb_device && block_device && scsi_disk_device) {
-			struct usb_device *device = usb_device_new();
+		return 0;
+	}
 
-			if (!device)
-				err(EXIT_FAILURE, NULL);
+	if (strncmp(source, SOURCE_SYSFS, strlen(SOURCE_SYSFS)) == 0) {
+		const char *root = source + strlen(SOURCE_SYSFS);
 
-			device->node = strdup((char *)udev_device_get_devnode(block_device));
-			device->manufacturer = strdup((char *)udev_device_get_sysattr_value(usb_device,
-			                                                                    "manufacturer"));
-			device->product = strdup((char *)udev_device_get_sysattr_value(usb_device, "product"));
-			device->serial = strdup((char *)udev_device_get_sysattr_value(usb_device, "serial"));
-			device->dev_path = strdup((char *)udev_device_get_sysattr_value(usb_device, "devpath"));
+		if (*root != '\0' && (*root != ':' || root[1] != '/'))
+			return -1;
 
-			char *label = (char *)udev_device_get_property_value(block_device, "ID_FS_LABEL");
+		device_source.list_get = usb_sysfs_device_list_get;
+		device_source.root = *root ? root + 1 : "/";
 
-			if (label)
-				device->label = strdup(label);
+		return 0;
+	}
 
-			else
-				device->label = strdup("");
+	if (strncmp(source, SOURCE_FIXTURE, prefix_size) != 0 || !isdigit(source[prefix_size]))
+		return -1;
 
-			char *type = (char *)udev_device_get_property_value(block_device, "ID_FS_TYPE");
+	size_t num_devices = strtoul(source + prefix_size, &end, 10);
+	size_t num_partitions = 0;
 
-			if (type)
-				device->type = strdup(type);
+	if (*end == 'x' && isdigit(end[1]))
+		num_partitions = strtoul(end + 1, &end, 10);
 
-			else
-				device->type = strdup("");
+	if (*end != '\0')
+		return -1;
 
-			device->sys_path = strdup((char *)udev_device_get_syspath(usb_device));
-			device->speed = strdup((char *)udev_device_get_sysattr_value(usb_device, "speed"));
-			device->version = strdup((char *)udev_device_get_sysattr_value(usb_device, "version"));
-			device->max_children = atoi(udev_device_get_sysattr_value(usb_device, "maxchild"));
-			device->bus = atoi(udev_device_get_sysattr_value(usb_device, "busnum"));
-			device->size = atol(udev_device_get_sysattr_value(block_device, "size")) * (size_t)512;
+	device_source.list_get = usb_fixture_device_list_get;
+	device_source.num_devices = num_devices;
+	device_source.num_partitions = num_partitions;
 
-			device->partition_list = usb_partition_list_new();
-			struct udev_enumerate *enumerate_partitions = udev_enumerate_new(udev);
+	return 0;
+}
 
-			udev_enumerate_add_match_parent(enumerate_partitions, block_device);
-			udev_enumerate_add_match_subsystem(enumerate_partitions, "block");
-			udev_enumerate_add_match_sysattr(enumerate_partitions, "partition", "*");
-			udev_enumerate_scan_devices(enumerate_partitions);
+/*
+ * Count every device and its partitions for the metrics file, with those
+ * mounted on their mount directory as the MOUNTED column has them.
+ */
+void usb_metrics_inventory(void)
+{
+	struct usb_device_list *list = usb_device_list_get(FIELD_BUS | FIELD_SPEED | FIELD_PARTITIONS | FIELD_MOUNTS,
+	                                                   NULL);
+	struct usb_mount_table *mount_table = usb_mount_table_get();
 
-			struct udev_list_entry *partition_entry = udev_enumerate_get_list_entry(enumerate_partitions);
+	for (size_t i = 0; list && i < list->num_devices; i++) {
+		struct usb_device *device = &list->devices[i];
+		size_t num_mounted = 0;
 
-			while (partition_entry) {
-				const char *partition_name = udev_list_entry_get_name(partition_entry);
-				struct udev_device *partition_device = udev_device_new_from_syspath(udev, partition_name);
-				struct usb_partition *partition = usb_partition_new();
+		for (size_t j = 0; j < device->num_partitions; j++)
+			num_mounted += usb_partition_is_mounted(mount_table, &device->partitions[j]);
 
-				if (!partition)
-					err(EXIT_FAILURE, NULL);
+		metrics_device(device->bus, device->speed ? device->speed : "", device->num_partitions, num_mounted);
+	}
 
-				char *partition_num = (char *)udev_device_get_sysattr_value(partition_device,
-				                                                            "partition");
-				partition->device = device;
-				partition->node = strdup((char *)udev_device_get_devnode(partition_device));
-				partition->sys_path = strdup((char *)udev_device_get_syspath(partition_device));
-				partition->num = atoi(partition_num);
-				partition->dev_path = malloc(strlen(device->dev_path) + strlen(partition_num) + 2);
+	usb_device_list_free(list);
+	usb_mount_table_free(mount_table);
+}
 
-				if (!partition->dev_path)
-					err(EXIT_FAILURE, NULL);
+/*
+ * Benchmark the listing path on a fixture of num_devices devices with
+ * num_partitions partitions each: enumerating it, looking every device up
+ * by node and every partition by dev_path, and rendering the default table.
+ * Prints the mean time and number of allocations of each phase over rounds
+ * runs, counting allocations with the allocations callback.
+ */
+void usb_bench(FILE *stream,
+               size_t num_devices,
+               size_t num_partitions,
+               size_t rounds,
+               size_t (*allocations)(void))
+{
+	struct usb_source saved_source = device_source;
+	struct usb_mount_table *mount_table = usb_mount_table_get();
+	struct usb_device_list *list = NULL;
+	struct timespec start;
+	size_t start_allocations = 0;
+	size_t num_lookups = 0;
+	int columns[TABLE_MAX_COLUMNS];
+	size_t num_columns = 0;
+	double seconds = 0;
 
-				sprintf(partition->dev_path, "%s-%s", device->dev_path, partition_num);
+	device_source.list_get = usb_fixture_device_list_get;
+	device_source.num_devices = num_devices;
+	device_source.num_partitions = num_partitions;
 
-				partition->size = atol(udev_device_get_sysattr_value(partition_device, "size"))
-				                * (size_t)512;
+	usb_print_columns(NULL, 0, USB_OUTPUT_TEXT, columns, &num_columns);
 
-				label = (char *)udev_device_get_property_value(partition_device, "ID_FS_LABEL");
+	start_allocations = allocations();
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-				if (label)
-					partition->label = strdup(label);
+	for (size_t i = 0; i < rounds; i++) {
+		usb_device_list_free(list);
 
-				else
-					partition->label = strdup("");
+		list = usb_device_list_get(FIELD_ALL, NULL);
+	}
 
-				type = (char *)udev_device_get_property_value(partition_device, "ID_FS_TYPE");
+	seconds = usb_seconds_since(&start);
 
-				if (type)
-					partition->type = strdup(type);
+	fprintf(stream,
+	        "%7zu %10zu  %-10s %12.3f %10zu\n",
+	        num_devices,
+	        num_partitions,
+	        "enumerate",
+	        seconds * 1e3 / rounds,
+	        (allocations() - start_allocations) / rounds);
 
-				else
-					partition->type = strdup("");
+	start_allocations = allocations();
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-				udev_device_unref(partition_device);
+	for (size_t i = 0; i < rounds; i++) {
+		struct usb_index *index = usb_index_new(list);
 
-				usb_partition_list_add(device->partition_list, partition);
+		num_lookups = 0;
 
-				partition_entry = udev_list_entry_get_next(partition_entry);
-			}
+		for (size_t j = 0; j < list->num_devices; j++) {
+			struct usb_device *device = &list->devices[j];
 
-			udev_enumerate_unref(enumerate_partitions);
+			num_lookups += usb_index_find(index, device->node) != NULL;
 
-			usb_device_list_add(list, device);
+			for (size_t k = 0; k < device->num_partitions; k++)
+				num_lookups += usb_index_find(index, device->partitions[k].dev_path) != NULL;
 		}
 
-		udev_device_unref(block_device);
-		udev_device_unref(scsi_disk_device);
-		udev_device_unref(scsi_device);
-
-		device_entry = udev_list_entry_get_next(device_entry);
+		usb_index_free(index);
 	}
 
-	udev_enumerate_unref(enumerate);
-
-	udev_unref(udev);
-
-	return list;
-}
-
-static struct usb_device *usb_device_new()
-{
-	return malloc(sizeof(struct usb_device));
-}
-
-static struct usb_partition *usb_partition_new()
-{
-	return malloc(sizeof(struct usb_partition));
-}
+	seconds = usb_seconds_since(&start);
+
+	fprintf(stream,
+	        "%7zu %10zu  %-10s %12.3f %10zu\n",
+	        num_devices,
+	        num_partitions,
+	        "lookup",
+	        seconds * 1e3 / rounds,
+	        (allocations() - start_allocations) / rounds);
+
+	if (num_lookups != num_devices * (num_partitions + 1))
+		warnx("Only %zu of %zu lookups matched", num_lookups, num_devices * (num_partitions + 1));
+
+	start_allocations = allocations();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < rounds; i++) {
+		size_t print_size = 0;
+
+		free(usb_device_list_render(list,
+		                            mount_table,
+		                            0,
+		                            0,
+		                            USB_OUTPUT_TEXT,
+		                            columns,
+		                            num_columns,
+		                            &print_size));
+	}
 
-static struct usb_partition_list *usb_partition_list_new()
-{
-	struct usb_partition_list *list = malloc(sizeof(struct usb_partition_list));
+	seconds = usb_seconds_since(&start);
 
-	if (!list)
-		err(EXIT_FAILURE, NULL);
+	fprintf(stream,
+	        "%7zu %10zu  %-10s %12.3f %10zu\n",
+	        num_devices,
+	        num_partitions,
+	        "render",
+	        seconds * 1e3 / rounds,
+	        (allocations() - start_allocations) / rounds);
 
-	memset(list, 0, sizeof(struct usb_partition_list));
+	usb_device_list_free(list);
+	usb_mount_table_free(mount_table);
 
-	return list;
+	device_source = saved_source;
 }
 
-static void usb_device_free(struct usb_device *device)
+static double usb_seconds_since(const struct timespec *start)
 {
-	if (!device)
-		return;
+	struct timespec end;
 
-	usb_partition_list_free(device->partition_list);
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-	free(device->node);
-	free(device->manufacturer);
-	free(device->product);
-	free(device->serial);
-	free(device->dev_path);
-	free(device->label);
-	free(device->type);
-	free(device->sys_path);
-	free(device->version);
-	free(device->speed);
-	free(device);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
 }
 
 static void usb_device_list_free(struct usb_device_list *list)
@@ -1443,52 +6327,44 @@ static void usb_device_list_free(struct usb_device_list *list)
 	if (!list)
 		return;
 
-	if (list->next)
-		usb_device_list_free(list->next);
-
-	usb_device_free(list->device);
-
-	free(list);
+	arena_free(list->arena);
 }
 
-static void usb_partition_list_free(struct usb_partition_list *list)
+/*
+ * A list of the devices of list that usb_paths name, each once, in the order
+ * they are first named. Sets ret_code to ENODEV if a path names nothing. The
+ * devices still refer to the strings of list, which must outlive it.
+ */
+static struct usb_device_list *usb_device_list_select(struct usb_device_list *list,
+                                                     char *usb_paths[],
+                                                     int num_usb_paths,
+                                                     int *ret_code)
 {
-	if (!list)
-		return;
+	struct usb_device_list *selected = usb_device_list_new(arena_new());
+	struct usb_index *index = usb_index_new(list);
+	struct hash_table *added = hash_table_new(0);
 
-	if (list->next) {
-		usb_partition_list_free(list->next);
-	}
+	for (int i = 0; i < num_usb_paths; i++) {
+		struct usb_index_entry *entry = usb_index_find(index, usb_paths[i]);
 
-	usb_partition_free(list->partition);
+		if (!entry) {
+			warnx("No USB device matches %s", usb_paths[i]);
 
-	free(list);
-}
+			*ret_code = ENODEV;
+		}
 
-static void usb_partition_free(struct usb_partition *partition)
-{
-	if (!partition)
-		return;
+		for (; entry; entry = entry->next) {
+			if (hash_table_get(added, &entry->device, sizeof(struct usb_device *)))
+				continue;
 
-	free(partition->node);
-	free(partition->dev_path);
-	free(partition->label);
-	free(partition->type);
-	free(partition->sys_path);
-	free(partition);
-}
+			hash_table_put(added, &entry->device, sizeof(struct usb_device *), entry->device);
 
-static void usb_partition_list_add(struct usb_partition_list *list,
-                                   struct usb_partition *partition)
-{
-	if (!list->partition) {
-		list->partition = partition;
-	} else {
-		while (list->next) {
-			list = list->next;
+			usb_device_list_add(selected, entry->device);
 		}
-
-		list->next = usb_partition_list_new();
-		list->next->partition = partition;
 	}
+
+	hash_table_free(added);
+	usb_index_free(index);
+
+	return selected;
 }
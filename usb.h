@@ -1,14 +1,69 @@
 #ifndef _SALLYMOUNT_USB_H
 #define _SALLYMOUNT_USB_H
 
-int usb_print(char *usb_path, int verbose, int human_readable);
-int usb_print_multiple(char *usb_paths[], int num_usb_paths, int verbose, int human_readable);
-int usb_print_all(int verbose, int human_readable);
+#include <stddef.h>
+#include <stdio.h>
+
+#define USB_CACHE_PATH "/run/sallymount/inventory"
+
+struct usb_filter;
+
+enum usb_output {
+	USB_OUTPUT_TEXT,
+	USB_OUTPUT_JSON,
+	USB_OUTPUT_NDJSON,
+	USB_OUTPUT_CSV
+};
+
+int usb_print(char *usb_path,
+              struct usb_filter *filter,
+              int verbose,
+              int human_readable,
+              int output,
+              const char *columns,
+              const char *cache_path);
+int usb_print_multiple(char *usb_paths[],
+                       int num_usb_paths,
+                       struct usb_filter *filter,
+                       int verbose,
+                       int human_readable,
+                       int output,
+                       const char *columns,
+                       const char *cache_path);
+int usb_print_all(struct usb_filter *filter,
+                  int verbose,
+                  int human_readable,
+                  int output,
+                  const char *columns,
+                  const char *cache_path);
+int usb_columns_valid(const char *columns);
+int usb_throughput(char *usb_paths[],
+                   int num_usb_paths,
+                   struct usb_filter *filter,
+                   int human_readable,
+                   int write,
+                   size_t size,
+                   unsigned int queue_depth);
 int usb_mount(char *usb_path, char *options);
-int usb_mount_multiple(char *usb_paths[], int num_usb_paths, char *options);
-int usb_mount_all(char *options);
+int usb_mount_multiple(char *usb_paths[],
+                       int num_usb_paths,
+                       struct usb_filter *filter,
+                       char *options,
+                       size_t jobs,
+                       int check);
+int usb_mount_all(struct usb_filter *filter, char *options, size_t jobs, int check);
 int usb_umount(char *usb_path);
-int usb_umount_multiple(char *usb_paths[], int num_usb_paths);
-int usb_umount_all();
+int usb_umount_multiple(char *usb_paths[], int num_usb_paths, struct usb_filter *filter, size_t jobs);
+int usb_umount_all(struct usb_filter *filter, size_t jobs);
+struct usb_filter *usb_filter_new(const char *where);
+void usb_filter_free(struct usb_filter *filter);
+int usb_watch(char *options, int mount, int umount, int verbose);
+int usb_source_set(const char *source);
+void usb_metrics_inventory(void);
+void usb_bench(FILE *stream,
+               size_t num_devices,
+               size_t num_partitions,
+               size_t rounds,
+               size_t (*allocations)(void));
 
 #endif
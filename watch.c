@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+
+#include "cli.h"
+#include "watch.h"
+#include "usb.h"
+
+static const char cli_doc_watch[] =
+	"\n"
+	"Watch for USB mass storage devices being added and removed.";
+
+static const char cli_args_doc_watch[] = "";
+
+static struct argp_option cli_options_watch[] = {
+	{
+		"mount",
+		'm',
+		0,
+		0,
+		"Mount partitions as they appear"
+	},
+	{
+		"umount",
+		'u',
+		0,
+		0,
+		"Unmount partitions of removed devices"
+	},
+	{
+		"options",
+		'o',
+		"options",
+		0,
+		"Mount options string"
+	},
+	{NULL}
+};
+
+static struct argp cli_argp_watch = {
+	cli_options_watch,
+	cli_parse_watch,
+	cli_args_doc_watch,
+	cli_doc_watch
+};
+
+error_t cli_parse_watch(int key, char *arg, struct argp_state *state)
+{
+	struct cli_args_watch *cli_args_watch = state->input;
+
+	switch(key)
+	{
+		case 'm':
+			cli_args_watch->mount = 1;
+
+			break;
+
+		case 'u':
+			cli_args_watch->umount = 1;
+
+			break;
+
+		case 'o':
+			cli_args_watch->options = strdup(arg);
+
+			break;
+
+		case ARGP_KEY_ARG:
+			argp_usage(state);
+
+			break;
+	}
+
+	return 0;
+}
+
+void cmd_watch(struct argp_state *state)
+{
+	struct cli_args_watch cli_args_watch = {0};
+	int argc = state->argc - state->next + 1;
+	char **argv = &state->argv[state->next - 1];
+	char *argv0 = argv[0];
+
+	cli_args_watch.cli_args = state->input;
+	cli_args_watch.options = NULL;
+
+	argv[0] = malloc(strlen(state->name) + strlen("watch") + 2);
+
+	if(!argv[0])
+		argp_failure(state, 1, ENOMEM, 0);
+
+	sprintf(argv[0], "%s watch", state->name);
+
+	argp_parse(&cli_argp_watch, argc, argv, ARGP_IN_ORDER, &argc, &cli_args_watch);
+
+	free(argv[0]);
+
+	argv[0] = argv0;
+
+	state->next += argc - 1;
+
+	usb_watch(cli_args_watch.options,
+	          cli_args_watch.mount,
+	          cli_args_watch.umount,
+	          cli_args_watch.cli_args->verbose);
+
+	free(cli_args_watch.options);
+
+	return;
+}
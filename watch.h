@@ -0,0 +1,15 @@
+#ifndef _SALLYMOUNT_WATCH_H
+#define _SALLYMOUNT_WATCH_H
+
+struct cli_args_watch
+{
+	struct cli_args *cli_args;
+	int mount;
+	int umount;
+	char *options;
+};
+
+error_t cli_parse_watch(int key, char *arg, struct argp_state *state);
+void cmd_watch(struct argp_state *state);
+
+#endif